@@ -0,0 +1,71 @@
+#include "binary_reader.h"
+
+using namespace std;
+
+BinaryReader::BinaryReader(const char * data, size_t size) {
+    this->_data = data;
+    this->_size = size;
+    this->_position = 0;
+    this->overrun = false;
+}
+
+bool BinaryReader::_check(size_t bytes) {
+    // Written this way round so a huge count from a broken file can't wrap around
+    if (this->_position > this->_size || bytes > this->_size - this->_position) {
+        this->_position = this->_size;
+        this->overrun = true;
+        return false;
+    }
+    return true;
+}
+
+void BinaryReader::readToken(char * token) {
+    if (!this->_check(4)) {
+        token[0] = '\0';
+        return;
+    }
+    memcpy(token, this->_data + this->_position, 4);
+    token[4] = '\0';
+    this->_position += 4;
+}
+
+string BinaryReader::readString() {
+    unsigned short length = this->read<unsigned short>();
+    if (!this->_check(length)) {
+        return "";
+    }
+    string result(this->_data + this->_position, length);
+    this->_position += length;
+
+    // Some exporters include the terminating null in the length
+    size_t end = result.find('\0');
+    if (end != string::npos) result.resize(end);
+    return result;
+}
+
+void BinaryReader::skip(size_t bytes) {
+    if (this->_check(bytes)) {
+        this->_position += bytes;
+    }
+}
+
+void BinaryReader::seek(size_t position) {
+    if (position > this->_size) {
+        this->_position = this->_size;
+        this->overrun = true;
+    } else {
+        this->_position = position;
+    }
+}
+
+size_t BinaryReader::position() {
+    return this->_position;
+}
+
+size_t BinaryReader::remaining() {
+    return this->_size - this->_position;
+}
+
+const char * BinaryReader::current() {
+    return this->_data + this->_position;
+}
@@ -0,0 +1,73 @@
+/**
+ * A cursor over a block of memory, usually a memory mapped file, for reading the
+ * little-endian binary formats used by racer (DOF etc).
+ *
+ * Reading past the end of the block never touches memory outside of it, instead
+ * zeros are returned and the overrun flag is set so the caller can warn about a
+ * malformed file.
+ */
+#pragma once
+
+#include <string>
+#include <cstring>
+#include <cstddef>
+
+class BinaryReader {
+    public:
+        BinaryReader(const char * data, size_t size);
+
+        // Read a single value of type T
+        template <class T> T read();
+
+        // Copy count values of type T straight into array with a single memcpy
+        template <class T> void readArray(T * array, size_t count);
+
+        // Read a 4 character racer token (i.e. DOF1, MAT0) into a null terminated
+        // buffer of at least 5 chars
+        void readToken(char * token);
+
+        // Read a string which is prefixed with its length as a short
+        std::string readString();
+
+        // Move the cursor
+        void skip(size_t bytes);
+        void seek(size_t position);
+
+        // Where the cursor is and how much is left
+        size_t position();
+        size_t remaining();
+
+        // Pointer to the data at the cursor, useful for viewing an array in place
+        const char * current();
+
+        // Set if we tried to read past the end of the data
+        bool overrun;
+
+    private:
+        const char * _data;
+        size_t _size;
+        size_t _position;
+
+        // Check that there are at least bytes left, sets overrun if there isn't
+        bool _check(size_t bytes);
+};
+
+template <class T> T BinaryReader::read() {
+    T value;
+    if (!this->_check(sizeof(T))) {
+        memset(&value, 0, sizeof(T));
+        return value;
+    }
+    memcpy(&value, this->_data + this->_position, sizeof(T));
+    this->_position += sizeof(T);
+    return value;
+}
+
+template <class T> void BinaryReader::readArray(T * array, size_t count) {
+    if (!this->_check(count * sizeof(T))) {
+        memset(array, 0, count * sizeof(T));
+        return;
+    }
+    memcpy(array, this->_data + this->_position, count * sizeof(T));
+    this->_position += count * sizeof(T);
+}
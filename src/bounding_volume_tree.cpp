@@ -0,0 +1,132 @@
+#include "bounding_volume_tree.h"
+
+#include <algorithm>
+
+using namespace std;
+
+int BoundingVolumeTree::leafSize = 8;
+
+// Orders box indices by the centre of the box along one axis
+class CentreLess {
+    public:
+        CentreLess(vector<float> & boxes, int axis) : boxes(boxes), axis(axis) {}
+
+        bool operator()(int a, int b) const {
+            return this->boxes[a * 6 + this->axis * 2] + this->boxes[a * 6 + this->axis * 2 + 1]
+                < this->boxes[b * 6 + this->axis * 2] + this->boxes[b * 6 + this->axis * 2 + 1];
+        }
+
+        vector<float> & boxes;
+        int axis;
+};
+
+BoundingVolumeTree::BoundingVolumeTree() {
+    this->nTested = 0;
+    this->nVisible = 0;
+}
+
+int BoundingVolumeTree::add(const float * boundingBox) {
+    this->_boxes.insert(this->_boxes.end(), boundingBox, boundingBox + 6);
+    return this->_boxes.size() / 6 - 1;
+}
+
+void BoundingVolumeTree::build() {
+    this->_nodes.clear();
+    this->_order.resize(this->_boxes.size() / 6);
+    for (unsigned int i = 0; i < this->_order.size(); ++i) {
+        this->_order[i] = i;
+    }
+    if (!this->_order.empty()) this->_build(0, this->_order.size());
+
+    this->_sortedBoxes.clear();
+    for (unsigned int i = 0; i < this->_order.size(); ++i) {
+        this->_sortedBoxes.add(&this->_boxes[this->_order[i] * 6]);
+    }
+}
+
+void BoundingVolumeTree::_build(int first, int count) {
+    int index = this->_nodes.size();
+    this->_nodes.push_back(Node());
+
+    // The node's box covers all of its boxes, and the centres give the longest side
+    Node & node = this->_nodes[index];
+    float centres[6];
+    for (int i = 0; i < 6; i += 2) {
+        node.boundingBox[i] = this->_boxes[this->_order[first] * 6 + i];
+        node.boundingBox[i + 1] = this->_boxes[this->_order[first] * 6 + i + 1];
+        centres[i] = centres[i + 1] = node.boundingBox[i] + node.boundingBox[i + 1];
+    }
+    for (int j = first + 1; j < first + count; ++j) {
+        float * box = &this->_boxes[this->_order[j] * 6];
+        for (int i = 0; i < 6; i += 2) {
+            node.boundingBox[i] = min(node.boundingBox[i], box[i]);
+            node.boundingBox[i + 1] = max(node.boundingBox[i + 1], box[i + 1]);
+            centres[i] = min(centres[i], box[i] + box[i + 1]);
+            centres[i + 1] = max(centres[i + 1], box[i] + box[i + 1]);
+        }
+    }
+    node.first = first;
+    node.count = count;
+    node.right = 0;
+
+    if (count <= BoundingVolumeTree::leafSize) return;
+
+    // Split the boxes in half by their centres along the longest side
+    int axis = 0;
+    for (int i = 1; i < 3; ++i) {
+        if (centres[i * 2 + 1] - centres[i * 2] > centres[axis * 2 + 1] - centres[axis * 2]) {
+            axis = i;
+        }
+    }
+    int half = count / 2;
+    nth_element(this->_order.begin() + first, this->_order.begin() + first + half,
+            this->_order.begin() + first + count, CentreLess(this->_boxes, axis));
+
+    // The node can move as the children are added
+    this->_build(first, half);
+    this->_nodes[index].right = this->_nodes.size();
+    this->_build(first + half, count - half);
+}
+
+int BoundingVolumeTree::cull(ViewFrustumCulling & culler, vector<int> & visible) {
+    this->nTested = 0;
+    this->nVisible = 0;
+    if (!this->_nodes.empty()) this->_cull(0, FRUSTUM_ALL_PLANES, culler, visible);
+    return this->nVisible;
+}
+
+void BoundingVolumeTree::_cull(int index, int planes, ViewFrustumCulling & culler,
+        vector<int> & visible) {
+    Node & node = this->_nodes[index];
+
+    ++this->nTested;
+    int result = culler.testBox(node.boundingBox, planes);
+    if (result == FRUSTUM_OUTSIDE) return;
+
+    // Everything below is in view
+    if (result == FRUSTUM_INSIDE) {
+        visible.insert(visible.end(), this->_order.begin() + node.first,
+                this->_order.begin() + node.first + node.count);
+        this->nVisible += node.count;
+        return;
+    }
+
+    if (node.right != 0) {
+        this->_cull(index + 1, planes, culler, visible);
+        this->_cull(node.right, planes, culler, visible);
+        return;
+    }
+
+    // A leaf that's partly in view, its boxes need testing on their own
+    this->nTested += node.count;
+    this->nVisible += this->_sortedBoxes.cull(culler, node.first, node.count, planes,
+            visible, &this->_order[0]);
+}
+
+int BoundingVolumeTree::getNBoxes() {
+    return this->_boxes.size() / 6;
+}
+
+int BoundingVolumeTree::getNNodes() {
+    return this->_nodes.size();
+}
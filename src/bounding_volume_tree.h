@@ -0,0 +1,70 @@
+/**
+ * A tree of bounding boxes for culling the track. Testing every geob against the
+ * frustum each frame costs the same however little of the track is in view, the
+ * tree lets whole areas that are out of view be skipped with one test, and whole
+ * areas that are completely in view be taken without testing what's in them.
+ *
+ * It's built once when the track loads by splitting the boxes in half along their
+ * longest side, so it can't change after that. The nodes are kept in one array,
+ * the first child of a node is the one after it. The boxes in the leaves are tested
+ * together with a BoxCuller.
+ */
+#pragma once
+
+#include "box_culler.h"
+#include "frustum_culler.h"
+
+#include <vector>
+
+class BoundingVolumeTree {
+    public:
+        BoundingVolumeTree();
+
+        // Add a box to the tree, returns the index cull gives back for it. The box is
+        // copied
+        int add(const float * boundingBox);
+
+        // Build the tree once everything has been added
+        void build();
+
+        // Add the indices of the boxes in the frustum to visible, returns the number
+        // added
+        int cull(ViewFrustumCulling & culler, std::vector<int> & visible);
+
+        // Figures for the last cull: the nodes and boxes tested against the frustum,
+        // and the boxes found to be in it
+        int nTested;
+        int nVisible;
+
+        int getNBoxes();
+        int getNNodes();
+
+        // Most boxes in a leaf, the leaves are tested four boxes at a time
+        static int leafSize;
+
+    private:
+        class Node {
+            public:
+                float boundingBox[6];
+                // The node's boxes are _order[first] to _order[first + count - 1],
+                // for the leaves and the nodes above them
+                int first;
+                int count;
+                // The second child, 0 for a leaf
+                int right;
+        };
+
+        // Six floats for each box
+        std::vector<float> _boxes;
+        // Indices of the boxes, sorted so each node's are together
+        std::vector<int> _order;
+        // The boxes again in that order, for testing the leaves
+        BoxCuller _sortedBoxes;
+        std::vector<Node> _nodes;
+
+        // Make the node for count boxes from first in _order, and the ones below it
+        void _build(int first, int count);
+
+        void _cull(int node, int planes, ViewFrustumCulling & culler,
+                std::vector<int> & visible);
+};
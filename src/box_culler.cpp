@@ -0,0 +1,101 @@
+#include "box_culler.h"
+
+#ifdef __SSE__
+#include <xmmintrin.h>
+#endif
+
+using namespace std;
+
+BoxCuller::BoxCuller() {
+    this->clear();
+}
+
+void BoxCuller::clear() {
+    this->_nBoxes = 0;
+    for (int i = 0; i < 6; ++i) {
+        this->_bounds[i].assign(3, 0);
+    }
+}
+
+int BoxCuller::add(const float * boundingBox) {
+    for (int i = 0; i < 6; ++i) {
+        this->_bounds[i][this->_nBoxes] = boundingBox[i];
+        this->_bounds[i].push_back(0);
+    }
+    return this->_nBoxes++;
+}
+
+int BoxCuller::getNBoxes() {
+    return this->_nBoxes;
+}
+
+int BoxCuller::cull(ViewFrustumCulling & culler, vector<int> & visible) {
+    return this->cull(culler, 0, this->_nBoxes, FRUSTUM_ALL_PLANES, visible);
+}
+
+int BoxCuller::cull(ViewFrustumCulling & culler, int first, int count, int planes,
+        vector<int> & visible, const int * ids) {
+    // For each plane, the corner of the boxes furthest along its normal. Which
+    // corner that is only depends on the plane, so it's the same for every box
+    int nPlanes = 0;
+    float plane[6][4];
+    const float * corner[6][3];
+    for (int i = 0; i < 6; ++i) {
+        if (!(planes & (1 << i))) continue;
+        const float * values = culler.getPlane(i);
+        for (int j = 0; j < 4; ++j) {
+            plane[nPlanes][j] = values[j];
+        }
+        for (int j = 0; j < 3; ++j) {
+            corner[nPlanes][j] = &this->_bounds[j * 2 + (values[j] > 0 ? 1 : 0)][0];
+        }
+        ++nPlanes;
+    }
+
+#ifdef __SSE__
+    __m128 planeValues[6][4];
+    for (int i = 0; i < nPlanes; ++i) {
+        for (int j = 0; j < 4; ++j) {
+            planeValues[i][j] = _mm_set1_ps(plane[i][j]);
+        }
+    }
+    __m128 zero = _mm_setzero_ps();
+#endif
+
+    int nVisible = 0;
+    for (int i = first; i < first + count; i += 4) {
+        // A bit for each of the four boxes still in
+        int in = 15;
+
+#ifdef __SSE__
+        for (int j = 0; j < nPlanes && in != 0; ++j) {
+            __m128 distance = _mm_add_ps(planeValues[j][3],
+                    _mm_mul_ps(planeValues[j][0], _mm_loadu_ps(corner[j][0] + i)));
+            distance = _mm_add_ps(distance,
+                    _mm_mul_ps(planeValues[j][1], _mm_loadu_ps(corner[j][1] + i)));
+            distance = _mm_add_ps(distance,
+                    _mm_mul_ps(planeValues[j][2], _mm_loadu_ps(corner[j][2] + i)));
+            in &= _mm_movemask_ps(_mm_cmpge_ps(distance, zero));
+        }
+#else
+        for (int k = 0; k < 4; ++k) {
+            for (int j = 0; j < nPlanes; ++j) {
+                float distance = plane[j][3] + plane[j][0] * corner[j][0][i + k]
+                    + plane[j][1] * corner[j][1][i + k] + plane[j][2] * corner[j][2][i + k];
+                if (!(distance >= 0)) {
+                    in &= ~(1 << k);
+                    break;
+                }
+            }
+        }
+#endif
+
+        // The last four can go past the end
+        for (int k = 0; k < 4 && i + k < first + count; ++k) {
+            if (!(in & (1 << k))) continue;
+            visible.push_back(ids != NULL ? ids[i + k] : i + k);
+            ++nVisible;
+        }
+    }
+    return nVisible;
+}
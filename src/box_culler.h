@@ -0,0 +1,43 @@
+/**
+ * Culls a list of bounding boxes against the frustum four at a time. The boxes are
+ * kept as separate arrays of each coordinate rather than six floats per box, so
+ * one SSE instruction works on the same coordinate of four boxes. Each box is
+ * tested exactly against the planes (with the corner furthest along the plane's
+ * normal) rather than with a sphere around it.
+ *
+ * Without SSE the same tests are done a box at a time.
+ */
+#pragma once
+
+#include "frustum_culler.h"
+
+#include <vector>
+
+class BoxCuller {
+    public:
+        BoxCuller();
+
+        // Add a box, returns its index
+        int add(const float * boundingBox);
+
+        // Add the indices of the boxes in the frustum to visible, returns the number
+        // added
+        int cull(ViewFrustumCulling & culler, std::vector<int> & visible);
+
+        // Test count boxes from first against the planes set in planes (see
+        // ViewFrustumCulling::testBox). The ones in the frustum are added to visible,
+        // as ids[index] if ids is given
+        int cull(ViewFrustumCulling & culler, int first, int count, int planes,
+                std::vector<int> & visible, const int * ids = NULL);
+
+        int getNBoxes();
+
+        void clear();
+
+    private:
+        int _nBoxes;
+
+        // Minimum and maximum x, y and z of each box. They have 3 floats more than
+        // there are boxes, so four can always be loaded from any box
+        std::vector<float> _bounds[6];
+};
@@ -147,7 +147,7 @@ void * Car::update(void * _car) {
     }
 }
 
-void Car::render() {
+void Car::submit(RenderQueue & queue) {
     glPushMatrix();
     this->mutex.lock();
 
@@ -159,20 +159,22 @@ void Car::render() {
     Matrix rotationMatrix(rotation, 3);
     glMultMatrixf(rotationMatrix.getMatrix());
 
-    this->_bodyDof->render(true);
+    // The queue draws it later, so it has to keep the matrix
+    queue.captureTransform();
+    this->_bodyDof->submit(queue, true);
 
     // Render the brake model if we have one and brake is pressed
     if (this->brakePressed && this->brakeModel != NULL) {
-        this->brakeModel->render(true);
+        this->brakeModel->submit(queue, true);
     }
 
     glPopMatrix();
 
     // Render the wheels
-    std::for_each(
-            this->wheels.begin(), 
-            this->wheels.end(), 
-            std::mem_fun_ref(&Wheel::render));
+    for (unsigned int i = 0; i < this->wheels.size(); ++i) {
+        this->wheels[i].submit(queue);
+    }
+    queue.releaseTransform();
 
     this->mutex.unlock();
 
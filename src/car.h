@@ -15,6 +15,7 @@
 #include "wheel.h"
 #include "track.h"
 #include "dof.h"
+#include "render_queue.h"
 #include "quaternion.h"
 #include "vector.h"
 #include "drive_systems.h"
@@ -28,7 +29,9 @@ class Car {
     public:
         Car();
         ~Car();
-        void render();
+
+        // Add the car body and wheels to the queue, they're drawn where the car is now
+        void submit(RenderQueue & queue);
 
         // Handle key presses
         void handleKeyPress(SDL_Event &event);
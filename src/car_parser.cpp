@@ -5,6 +5,7 @@
 #include "car_parser.h"
 #include "logger.h"
 #include "lib.h"
+#include "file_index.h"
 //#include "drive_systems.h"
 
 #include <boost/filesystem.hpp>
@@ -25,7 +26,7 @@ namespace fs = boost::filesystem;
 
 Car * parseCar(string carPathString) {
     path carPath(carPathString);
-    Ini carIniFile((carPath / "car.ini").string());
+    Ini carIniFile(FileIndex::find((carPath / "car.ini").string()));
 
     // Now we have the ini settings, we can load the actual car
     Dof * dof;
@@ -42,14 +43,15 @@ Car * parseCar(string carPathString) {
     // Load the car body
     if (carIniFile.hasKey("/body/model/file")) {
         cout << (carPath / carIniFile["/body/model/file"]).string() << endl;
-        dof = new Dof((carPath / carIniFile["/body/model/file"]).string(), 0, false);
+        dof = new Dof(FileIndex::find((carPath / carIniFile["/body/model/file"]).string()),
+                0, false);
         car->setBody(dof);
     }
 
     // Load the brake model
     if (carIniFile.hasKey("/body/model_braking_l/file")) {
-        dof = new Dof(
-                (carPath / carIniFile["/body/model_braking_l/file"]).string(), 0, false);
+        dof = new Dof(FileIndex::find(
+                (carPath / carIniFile["/body/model_braking_l/file"]).string()), 0, false);
         car->setBrakeModel(dof);
     }
     
@@ -107,7 +109,7 @@ Car * parseCar(string carPathString) {
     for (int i = 0; i < 4; ++i) {
         s << "/wheel" << i << "/model/file";
         if (carIniFile.hasKey(s.str())) {
-            p = (carPath / carIniFile[s.str()]).string();
+            p = FileIndex::find((carPath / carIniFile[s.str()]).string());
             dof = new Dof(p, 0, false);
             wheel = new Wheel(i, dof, *car);
             car->setWheel(wheel, i);
@@ -136,7 +138,7 @@ Car * parseCar(string carPathString) {
         // Load the brake dof
         s << "/wheel" << i << "/model_brake/file";
         if (carIniFile.hasKey(s.str())) {
-            p = (carPath / carIniFile[s.str()]).string();
+            p = FileIndex::find((carPath / carIniFile[s.str()]).string());
             dof = new Dof(p, 0, false);
             wheel->setBrakeDof(dof);
         }
@@ -232,7 +234,7 @@ void parseEngine(Ini & ini, Car * car, path carPath) {
     engine.setDifferential(ini.getFloat("/differential/ratio"));
 
     // Get the torque curve
-    Curve curve((carPath / ini["/engine/curve_torque"]).string());
+    Curve curve(FileIndex::find((carPath / ini["/engine/curve_torque"]).string()));
     engine.setTorqueCurve(
             curve,
             ini.getFloat("/engine/max_torque"));
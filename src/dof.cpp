@@ -2,13 +2,21 @@
 #include "frustum_culler.h"
 #include "logger.h"
 #include "lib.h"
+#include "binary_reader.h"
+#include "geometry_cache.h"
+#include "load_timer.h"
+#include "mesh_optimiser.h"
+#include "mesh_simplifier.h"
+#include "render_queue.h"
 
 #include <fstream>
 #include <iostream>
+#include <set>
 #include <unistd.h>
 #include <SDL/SDL.h>
 #include <SDL/SDL_image.h>
 #include <boost/filesystem.hpp>
+#include <boost/iostreams/device/mapped_file.hpp>
 #include <boost/algorithm/string.hpp>
 #include <boost/foreach.hpp>
 #include <math.h>
@@ -19,25 +27,29 @@ using namespace boost;
 using namespace boost::filesystem;
 namespace fs = boost::filesystem;
 
-Dof::Dof(string filePath, int flags, bool perGeobDisplayList) {
+Dof::Dof(string filePath, int flags, bool perGeobDisplayList, bool deferUpload) {
     // 4 characters used for tokens such as DOF1 and 32 bit integers
     char buffer[5];
-    int dofLength;
     this->_filePath = filePath;
     this->_perGeobDisplayList = perGeobDisplayList;
     this->_flags = flags;
-    buffer[4] = NULL;
+    this->_transparent = false;
     this->isValid = false;
+    double start = LoadTimer::now();
 
-    // Load the file
-    ifstream file(this->_filePath.c_str());
-    if (!file.is_open()) {
+    // Map the file into memory, the chunks are then read in place rather than through
+    // lots of small stream reads
+    iostreams::mapped_file_source file;
+    try {
+        file.open(this->_filePath);
+    } catch (std::exception & e) {
         cout << "Error opening file: " << this->_filePath << endl;
         return;
     }
+    BinaryReader reader(file.data(), file.size());
 
     // Read the header: DOF1 and its length
-    file.read(buffer, 4);
+    reader.readToken(buffer);
 
     // Check that we have a DOF1 object
     if (strcmp(buffer, "DOF1") != 0) {
@@ -45,28 +57,95 @@ Dof::Dof(string filePath, int flags, bool perGeobDisplayList) {
     }
     
     // Read the length of the DOF object
-    file.read((char *)&dofLength, sizeof(int));
+    reader.read<int>();
 
     // Read the object components
     // .. first up should be the MATS
-    file.read(buffer, 4);
+    reader.readToken(buffer);
     if (strcmp(buffer, "MATS") != 0) {
         cout << "Warning: MATS was expected but not found in " << this->_filePath << endl;
     }
 
-    this->_parseMats(&file);
+    this->_parseMats(reader);
+
+    // The geobs might already be in the geometry cache, in which case there's no
+    // need to look at the rest of the file
+    if (!reader.overrun && GeometryCache::read(
+                this->_filePath, this, this->mats.size(), this->geobs)) {
+        file.close();
+    } else {
+        // Now read the GEOB components
+        reader.readToken(buffer);
+        if (strcmp(buffer, "GEOB") != 0) {
+            cout << "Warning: GEOB was expected but got " << buffer << endl;
+        }
+
+        // Parse the GEOBs
+        this->_parseGeobs(reader);
+
+        // Unmap the file, everything we need has been copied out
+        file.close();
+
+        // Running off the end means the file is truncated or the chunk counts are
+        // garbage, either way the geometry can't be trusted
+        if (reader.overrun) {
+            cout << "Warning: unexpected end of file in " << this->_filePath << endl;
+            return;
+        }
+
+        this->_splitBursts();
+
+        // Reorder the triangles and vertices for the vertex cache
+        if (MeshOptimiser::enabled) {
+            BOOST_FOREACH(Geob & geob, this->geobs) {
+                MeshOptimiser::optimise(geob);
+            }
+        }
+
+        // Make the simplified versions of the big geobs, after the optimiser as that
+        // moves the vertices around
+        if (MeshSimplifier::enabled) {
+            BOOST_FOREACH(Geob & geob, this->geobs) {
+                if (MeshSimplifier::canSimplify(*this, geob)) {
+                    MeshSimplifier::simplify(geob);
+                }
+            }
+        }
+
+        // Calculate bounding box
+        this->_calculateBoundingBox();
 
-    // Now read the GEOB components
-    file.read(buffer, 4);
-    if (strcmp(buffer, "GEOB") != 0) {
-        cout << "Warning: GEOB was expected but got " << buffer << endl;
+        // Interleave the vertex data ready for the VBOs and save it all for next time
+        std::for_each(
+                this->geobs.begin(), 
+                this->geobs.end(), 
+                std::mem_fun_ref(&Geob::buildVertexData));
+        GeometryCache::write(this->_filePath, this->mats.size(), this->geobs);
     }
 
-    // Parse the GEOBs
-    this->_parseGeobs(&file);
+    // Encode the vertices for the VBOs, the cache always holds the plain floats so
+    // the encoding can be changed without rebuilding it
+    std::for_each(
+            this->geobs.begin(), 
+            this->geobs.end(), 
+            std::mem_fun_ref(&Geob::packVertexData));
+    std::for_each(
+            this->geobs.begin(), 
+            this->geobs.end(), 
+            std::mem_fun_ref(&Geob::compileBursts));
+    this->sortGeobs();
+    LoadTimer::add("dof parse", LoadTimer::now() - start);
 
-    // close the file
-    file.close();
+    // If we got here it is valid
+    this->isValid = true;
+
+    if (!deferUpload) {
+        this->upload();
+    }
+}
+
+void Dof::upload() {
+    double start = LoadTimer::now();
 
     // Generate VAOs
     std::for_each(
@@ -74,11 +153,124 @@ Dof::Dof(string filePath, int flags, bool perGeobDisplayList) {
             this->geobs.end(), 
             std::mem_fun_ref(&Geob::generateVAO));
 
-    // Calculate bounding box
-    this->_calculateBoundingBox();
+    LoadTimer::add("vbo upload", LoadTimer::now() - start);
+}
 
-    // If we got here it is valid
-    this->isValid = true;
+// Add a value or an array to a chunk being built up in memory
+template <class T> static void appendValue(string & chunk, T value) {
+    chunk.append((const char *)&value, sizeof(T));
+}
+
+template <class T> static void appendArray(string & chunk, const T * array, size_t count) {
+    if (count > 0) chunk.append((const char *)array, count * sizeof(T));
+}
+
+// Add a chunk with its token and length
+static void appendChunk(string & parent, const char * token, const string & chunk) {
+    parent.append(token, 4);
+    appendValue<int>(parent, chunk.size());
+    parent.append(chunk);
+}
+
+bool Dof::save(string filePath) {
+    char buffer[5];
+    string mats;
+
+    // Pull the MATS chunk out of the original file. We don't keep everything in it
+    // (the material class, the texture names as written) so it is copied as it is
+    iostreams::mapped_file_source file;
+    try {
+        file.open(this->_filePath);
+    } catch (std::exception & e) {
+        cout << "Error opening file: " << this->_filePath << endl;
+        return false;
+    }
+    BinaryReader reader(file.data(), file.size());
+    reader.skip(2 * sizeof(int));
+    size_t start = reader.position();
+    reader.readToken(buffer);
+    int length = reader.read<int>();
+    if (strcmp(buffer, "MATS") != 0 || length < 0 || (size_t)length > reader.remaining()) {
+        cout << "Warning: couldn't find the MATS in " << this->_filePath << endl;
+        return false;
+    }
+    mats.assign(file.data() + start, reader.position() - start + length);
+    file.close();
+
+    string geobs;
+    appendValue<int>(geobs, this->geobs.size());
+    BOOST_FOREACH(Geob & geob, this->geobs) {
+        string geobChunk, chunk;
+
+        appendValue<int>(chunk, geob.flags);
+        appendValue<int>(chunk, geob.paintFlags);
+        appendValue<int>(chunk, geob.material);
+        appendChunk(geobChunk, "GHDR", chunk);
+
+        chunk.clear();
+        appendValue<int>(chunk, geob.nIndices);
+        appendArray<unsigned short>(chunk, geob.indices, geob.nIndices);
+        appendChunk(geobChunk, "INDI", chunk);
+
+        chunk.clear();
+        appendValue<int>(chunk, geob.nVertices);
+        appendArray<float>(chunk, (float *)geob.vertices, geob.nVertices * 3);
+        appendChunk(geobChunk, "VERT", chunk);
+
+        // The y was flipped when the dof was loaded
+        if (geob.nTextureCoords > 0) {
+            chunk.clear();
+            appendValue<int>(chunk, geob.nTextureCoords);
+            for (unsigned int i = 0; i < geob.nTextureCoords; ++i) {
+                appendValue<float>(chunk, geob.textureCoords[i][0]);
+                appendValue<float>(chunk, -geob.textureCoords[i][1]);
+            }
+            appendChunk(geobChunk, "TVER", chunk);
+        }
+
+        if (geob.nNormals > 0) {
+            chunk.clear();
+            appendValue<int>(chunk, geob.nNormals);
+            appendArray<float>(chunk, (float *)geob.normals, geob.nNormals * 3);
+            appendChunk(geobChunk, "NORM", chunk);
+        }
+
+        // All our primitives are triangles
+        chunk.clear();
+        appendValue<int>(chunk, geob.nBursts);
+        appendArray<int>(chunk, geob.burstStarts, geob.nBursts);
+        appendArray<int>(chunk, geob.burstsCount, geob.nBursts);
+        appendArray<int>(chunk, geob.burstsMaterials, geob.nBursts);
+        for (int i = 0; i < geob.nBursts; ++i) {
+            appendValue<int>(chunk, 3);
+        }
+        appendChunk(geobChunk, "BRST", chunk);
+
+        geobChunk.append("GEND", 4);
+        appendChunk(geobs, "GOB1", geobChunk);
+    }
+
+    // The DOF1 length covers everything after it, EDOF included
+    string dof = mats;
+    appendChunk(dof, "GEOB", geobs);
+    dof.append("EDOF", 4);
+
+    ofstream output(filePath.c_str(), ios::out | ios::binary | ios::trunc);
+    if (!output.is_open()) {
+        cout << "Couldn't write " << filePath << endl;
+        return false;
+    }
+    output.write("DOF1", 4);
+    length = dof.size();
+    output.write((const char *)&length, sizeof(int));
+    output.write(dof.c_str(), dof.size());
+    output.close();
+
+    if (output.fail()) {
+        cout << "Failed writing " << filePath << endl;
+        return false;
+    }
+    return true;
 }
 
 Dof::Dof(const Dof & dof) {
@@ -92,69 +284,71 @@ Dof & Dof::operator=(const Dof & dof) {
 Dof::~Dof() {
 }
 
-void Dof::_parseMats(ifstream * file) {
+void Dof::_parseMats(BinaryReader & reader) {
     int length;
     char token[5];
-    char fileString[255];
-    int fileStringLength;
-    token[4] = NULL;
+    string fileString;
+    token[4] = '\0';
     //std::cout << "DOF: " << this->_filePath << std::endl;
     path texturePath(this->_filePath);
     texturePath.remove_filename();
     string textureName;
 
     // Read the MAT0 chunk length
-    file->read((char *)&length, sizeof(int));
+    reader.read<int>();
     // .. and the number of MAT0s
-    int numberMats;
-    file->read((char *)&(numberMats), sizeof(int));
+    int numberMats = reader.read<int>();
 
     // Create all the mats
-    for (int i = 0; i < numberMats; ++i) {
+    for (int i = 0; i < numberMats && !reader.overrun; ++i) {
         Mat * mat = new Mat();
 
         // read the token
-        file->read(token, 4);
+        reader.readToken(token);
         if (strcmp(token, "MAT0")) {
             cout << "Warning: expected MAT0 (" << i << "), got " << token << endl;
         }
 
         // read the chunk length
-        file->read((char *)&length, sizeof(int));
+        reader.read<int>();
 
         // Parse the object component attributes
         do {
             // Get the token
-            file->read(token, 4);
+            reader.readToken(token);
             // .. and the length
             if (strcmp(token, "MEND") != 0) {
-                file->read((char *)&length, sizeof(int));
+                length = reader.read<int>();
             }
 
             if (strcmp(token, "MHDR") == 0) {
                 // Get the material name
-                parseString(file, fileString);
-                mat->name = fileString;
+                mat->name = reader.readString();
                 // Ignore the material class
-                parseString(file, fileString);
+                reader.readString();
 
                 // Look for a shader that matches the material name
                 mat->shader = Shader::getShader(mat->name);
             } else if (strcmp(token, "MCOL") == 0) {
                 // Contains the various material colors
-                parseVector<float>(file, mat->ambient, 4);
-                parseVector<float>(file, mat->diffuse, 4);
-                parseVector<float>(file, mat->specular, 4);
-                parseVector<float>(file, mat->emission, 4);
-                file->read((char *)&(mat->shininess), sizeof(float));
+                reader.readArray<float>(mat->ambient, 4);
+                reader.readArray<float>(mat->diffuse, 4);
+                reader.readArray<float>(mat->specular, 4);
+                reader.readArray<float>(mat->emission, 4);
+                mat->shininess = reader.read<float>();
             } else if (strcmp(token, "MTEX") == 0) {
                 // Load the textures
-                file->read((char *)&(mat->nTextures), sizeof(int));
+                mat->nTextures = reader.read<int>();
+                if (mat->nTextures < 0 || (size_t)mat->nTextures > reader.remaining()) {
+                    cout << "Warning: bad texture count in " << this->_filePath << endl;
+                    mat->nTextures = 0;
+                    reader.overrun = true;
+                    break;
+                }
                 mat->textures = new Texture *[mat->nTextures];
 
                 for (int j = 0; j < mat->nTextures; ++j) {
-                    fileStringLength = parseString(file, fileString);
-
+                    fileString = reader.readString();
 
                     textureName = (texturePath / fileString).string();
 
@@ -165,73 +359,74 @@ void Dof::_parseMats(ifstream * file) {
                     }
 
                     // If all else fails try and load the image
-                    mat->textures[j] = Texture::getOrMakeTexture(textureName);
+                    this->_textureNames.push_back(textureName);
+                    if (this->_flags & DOF_NO_TEXTURES) {
+                        mat->textures[j] = NULL;
+                    } else {
+                        mat->textures[j] = Texture::getOrMakeTexture(textureName);
+                    }
                 }
             } else if (strcmp(token, "MUVW") == 0) {
-                file->read((char *)&(mat->uvwUoffset), sizeof(float));
-                file->read((char *)&(mat->uvwVoffset), sizeof(float));
-                file->read((char *)&(mat->uvwUtiling), sizeof(float));
-                file->read((char *)&(mat->uvwVtiling), sizeof(float));
-                file->read((char *)&(mat->uvwAngle), sizeof(float));
-                file->read((char *)&(mat->uvwBlur), sizeof(float));
-                file->read((char *)&(mat->uvwBlurOffset), sizeof(float));
+                mat->uvwUoffset = reader.read<float>();
+                mat->uvwVoffset = reader.read<float>();
+                mat->uvwUtiling = reader.read<float>();
+                mat->uvwVtiling = reader.read<float>();
+                mat->uvwAngle = reader.read<float>();
+                mat->uvwBlur = reader.read<float>();
+                mat->uvwBlurOffset = reader.read<float>();
             } else if (strcmp(token, "MTRA") == 0) {
                 // The transparency float isn't used
-                file->seekg(sizeof(float), ios::cur);
+                reader.skip(sizeof(float));
 
                 // get the blendMode
-                file->read((char *)&(mat->blendMode), sizeof(int));
+                mat->blendMode = reader.read<int>();
             } else if (strcmp(token, "MEND") == 0) {
                 // do nothing
             } else {
-                file->seekg(length, ios::cur);
+                reader.skip(length);
             }
-        } while (strcmp(token, "MEND") != 0);
+        } while (strcmp(token, "MEND") != 0 && !reader.overrun);
 
         this->mats.push_back(mat);
     }
 }
 
-void Dof::_parseGeobs(ifstream * file) {
+void Dof::_parseGeobs(BinaryReader & reader) {
     int length;
     char token[5];
 
     // We need to add a null to the token so that we can print and compare the string
-    token[4] = NULL;
-
-    int geobChunkLength;
-    file->read((char *)&geobChunkLength, sizeof(int));
+    token[4] = '\0';
 
-    int numberGeobs;
-    file->read((char *)&(numberGeobs), sizeof(int));
+    // Skip the GEOB chunk length
+    reader.read<int>();
 
-    // Create a number of geob instances
-    //this->_geobs = new Geob[this->_nGeobs];
+    int numberGeobs = reader.read<int>();
 
     // Create all the geobs
-    for (int i = 0; i < numberGeobs; ++i) {
-        //geob = &(this->_geobs[i]);
+    for (int i = 0; i < numberGeobs && !reader.overrun; ++i) {
         Geob * geob = new Geob();
         geob->dof = this;
 
         // read the token, this should be GOB1
-        file->read(token, 4);
+        reader.readToken(token);
         if (strcmp(token, "GOB1") != 0) {
             cout << "Warning: (" << i << ") expecting GOB1, got " << token << ". " << endl;
         }
 
         // Get this geob's length
-        int geobLength;
-        file->read((char *)&geobLength, sizeof(int));
+        reader.read<int>();
 
-        // Now we parse a number of object component attributes
+        // Now we parse a number of object component attributes. NOTE: the chunk
+        // lengths of the array chunks aren't reliable (some exporters leave out the
+        // count), so we always go by the counts
         do {
             // Read the next token
-            file->read(token, 4);
+            reader.readToken(token);
             // .. and its chunk length (if token is not GEND)
-            int chunkLength;
+            int chunkLength = 0;
             if (strcmp(token, "GEND") != 0) {
-                file->read((char *)&chunkLength, sizeof(int));
+                chunkLength = reader.read<int>();
             }
 
             if (strcmp(token, "GHDR") == 0) {
@@ -241,142 +436,199 @@ void Dof::_parseGeobs(ifstream * file) {
                 // 1: int paintFlags (not defined)
                 // 2: int materialRef, the material reference 
 
-                // We ignore the first two
-                file->seekg(2 * sizeof(int), ios::cur);
-                file->read((char *)&(geob->material), sizeof(int));
+                // We only keep the first two for saving
+                geob->flags = reader.read<int>();
+                geob->paintFlags = reader.read<int>();
+                geob->material = reader.read<int>();
             } else if (strcmp(token, "INDI") == 0) {
                 // Parse the indices, not sure what these are for, an index which is global 
                 // to DOF for the vertices?
-                file->read((char *)&(geob->nIndices), sizeof(int));
-                geob->indices = new unsigned short[geob->nIndices];
-                for (int j = 0; j < geob->nIndices; ++j) {
-                    file->read((char *)&(geob->indices[j]), sizeof(unsigned short));
-                }
-
+                length = reader.read<int>();
+                if (!_checkCount(reader, length, sizeof(unsigned short))) break;
+                geob->nIndices = length;
+                geob->indices = new unsigned short[length];
+                reader.readArray<unsigned short>(geob->indices, length);
             } else if (strcmp(token, "VERT") == 0) {
                 // These are the vertices
-                file->read((char *)&length, sizeof(int));
+                length = reader.read<int>();
+                if (!_checkCount(reader, length, 3 * sizeof(float))) break;
                 geob->nVertices = length;
                 geob->vertices = new float[length][3];
-
-                // Read the vertices
-                for (int j = 0; j < length; ++j) {
-                    parseVector<float>(file, geob->vertices[j], 3);
-                }
+                reader.readArray<float>(geob->vertices[0], length * 3);
             } else if (strcmp(token, "TVER") == 0) {
                 // Read the texture coordinates
-                file->read((char *)&length, sizeof(int));
+                length = reader.read<int>();
+                if (!_checkCount(reader, length, 2 * sizeof(float))) break;
                 geob->nTextureCoords = length;
                 geob->textureCoords = new float[length][2];
+                reader.readArray<float>(geob->textureCoords[0], length * 2);
 
-                // Read the vertices
+                // Flip the y
                 for (int j = 0; j < length; ++j) {
-                    parseVector<float>(file, geob->textureCoords[j], 2);
-                    // Flip the y
                     geob->textureCoords[j][1] *= -1;
                 }
             } else if (strcmp(token, "NORM") == 0) {
                 // These are the normals
-                file->read((char *)&length, sizeof(int));
+                length = reader.read<int>();
+                if (!_checkCount(reader, length, 3 * sizeof(float))) break;
                 geob->nNormals = length;
                 geob->normals = new float[length][3];
-
-                // Read the vertices
-                for (int j = 0; j < length; ++j) {
-                    parseVector<float>(file, geob->normals[j], 3);
-                }
+                reader.readArray<float>(geob->normals[0], length * 3);
             } else if (strcmp(token, "VCOL") == 0) {
                 // We're ignoring this for now
-                file->read((char *)&length, sizeof(int));
-                file->seekg(length * 3 * sizeof(float), ios::cur);
+                length = reader.read<int>();
+                reader.skip(length * 3 * sizeof(float));
             } else if (strcmp(token, "BRST") == 0) {
-                // We're ignoring this for now
-                file->read((char *)&(geob->nBursts), sizeof(int));
-                geob->burstStarts = new int[geob->nBursts];
-                for (int j = 0; j < geob->nBursts; ++j) {
-                    file->read((char *)&(geob->burstStarts[j]), sizeof(int));
-                }
-                
-                geob->burstsCount = new int[geob->nBursts];
-                for (int j = 0; j < geob->nBursts; ++j) {
-                    file->read((char *)&(geob->burstsCount[j]), sizeof(int));
-                }
-                
-                geob->burstsMaterials = new int[geob->nBursts];
-                for (int j = 0; j < geob->nBursts; ++j) {
-                    file->read((char *)&(geob->burstsMaterials[j]), sizeof(int));
-                }
-                //file->seekg(length * sizeof(int), ios::cur);
-                file->seekg(geob->nBursts * sizeof(int), ios::cur);
+                length = reader.read<int>();
+                if (!_checkCount(reader, length, 4 * sizeof(int))) break;
+                geob->nBursts = length;
+                geob->burstStarts = new int[length];
+                reader.readArray<int>(geob->burstStarts, length);
+                geob->burstsCount = new int[length];
+                reader.readArray<int>(geob->burstsCount, length);
+                geob->burstsMaterials = new int[length];
+                reader.readArray<int>(geob->burstsMaterials, length);
+
+                // We're ignoring the vertices per primitive, they're always 3
+                reader.skip(length * sizeof(int));
             } else if (strcmp(token, "GEND") == 0) {
                 // ignore this
             } else {
                 cout << "Warning: unknown token in GOB1, " << token << endl;
-                file->seekg(chunkLength, ios::cur);
+                reader.skip(chunkLength);
                 break;
             }
-        } while (strcmp(token, "GEND") != 0);
+        } while (strcmp(token, "GEND") != 0 && !reader.overrun);
+
+        this->_checkIndices(*geob);
 
         // Add to the list of geobs
         this->geobs.push_back(geob);
     }
 }
 
-void Dof::_renderGeob(Geob & geob) {
-    int burstCount, burstStart;
-    int stop;
-
-    try {
-        Mat & mat = this->mats.at(geob.material);
-        this->loadMaterial(mat);
-    } catch (std::out_of_range ex) {
-        Logger::warn << "Error loading material, skipping..." << endl;
-        return;
-    }
+void Dof::_splitBursts() {
+    for (boost::ptr_list<Geob>::iterator it = this->geobs.begin(); it != this->geobs.end();) {
+        Geob & geob = *it;
+
+        // Most exporters leave the burst materials as 0 whatever the geob uses, so
+        // they're only believed when the bursts actually disagree. Bursts with a bad
+        // material go with the geob's own one
+        vector<int> burstMaterials;
+        set<int> materials;
+        for (int j = 0; j < geob.nBursts; ++j) {
+            bool valid = geob.burstsMaterials[j] >= 0 
+                && (unsigned int)geob.burstsMaterials[j] < this->mats.size();
+            burstMaterials.push_back(valid ? geob.burstsMaterials[j] : (int)geob.material);
+            materials.insert(burstMaterials.back());
+        }
+        if (materials.size() < 2) {
+            ++it;
+            continue;
+        }
 
-    // Bind to VAO
-    //glBindVertexArrayAPPLE(geob->vao);
-    glBindBufferARB(GL_ARRAY_BUFFER, geob.vertexVBO);
-    glBindBufferARB(GL_ELEMENT_ARRAY_BUFFER, geob.indexVBO);
-    glVertexPointer(3, GL_FLOAT, 0, (GLvoid*)((char*)NULL));
-    glNormalPointer(GL_FLOAT, 0, 
-            (GLvoid*)((char*)NULL + geob.nVertices * 3 * sizeof(float)));
+        // Each part keeps all the vertices, it's rare enough not to bother trimming
+        // them
+        BOOST_FOREACH(int material, materials) {
+            Geob * part = new Geob();
+            part->dof = this;
+            part->material = material;
+            part->flags = geob.flags;
+            part->paintFlags = geob.paintFlags;
+
+            // Overlapping bursts only get their triangles copied once
+            vector<bool> used(geob.nIndices, false);
+            for (int j = 0; j < geob.nBursts; ++j) {
+                if (burstMaterials[j] != material) continue;
+                int start = max(geob.burstStarts[j] / 3, 0);
+                int end = min(geob.burstStarts[j] / 3 + geob.burstsCount[j] / 3, 
+                        geob.nIndices);
+                fill(used.begin() + min(start, end), used.begin() + end, true);
+            }
+            vector<unsigned short> indices;
+            for (int i = 0; i < geob.nIndices; ++i) {
+                if (used[i]) indices.push_back(geob.indices[i]);
+            }
+            if (indices.empty()) {
+                delete part;
+                continue;
+            }
 
-    glEnableClientState(GL_TEXTURE_COORD_ARRAY);
-    for (int i = 0; i < OpenGLState::global.lastUsedTextures; ++i) {
+            part->nIndices = indices.size();
+            part->indices = new unsigned short[part->nIndices];
+            copy(indices.begin(), indices.end(), part->indices);
+            part->nVertices = geob.nVertices;
+            part->vertices = new float[geob.nVertices][3];
+            copy(geob.vertices, geob.vertices + geob.nVertices, part->vertices);
+            part->nNormals = geob.nNormals;
+            part->normals = new float[geob.nNormals][3];
+            copy(geob.normals, geob.normals + geob.nNormals, part->normals);
+            part->nTextureCoords = geob.nTextureCoords;
+            part->textureCoords = new float[geob.nTextureCoords][2];
+            copy(geob.textureCoords, geob.textureCoords + geob.nTextureCoords, 
+                    part->textureCoords);
+
+            part->nBursts = 1;
+            part->burstStarts = new int[1];
+            part->burstsCount = new int[1];
+            part->burstsMaterials = new int[1];
+            part->burstStarts[0] = 0;
+            part->burstsCount[0] = part->nIndices * 3;
+            part->burstsMaterials[0] = material;
+
+            this->geobs.insert(it, part);
+        }
 
-        glClientActiveTexture(GL_TEXTURE0 + i);
-        glTexCoordPointer(2, GL_FLOAT, 0, (GLvoid*)((char*)NULL + geob.nVertices * 3 * sizeof(float) + geob.nNormals * 3 * sizeof(float)));
+        it = this->geobs.erase(it);
     }
+}
 
+void Dof::_checkIndices(Geob & geob) {
+    int badTriangles = 0;
+
+    // Some exporters write out garbage indices, make those triangles degenerate
+    // rather than reading off the end of the vertices
+    for (int i = 0; i + 2 < geob.nIndices; i += 3) {
+        if (geob.indices[i] >= geob.nVertices 
+                || geob.indices[i + 1] >= geob.nVertices 
+                || geob.indices[i + 2] >= geob.nVertices) {
+            geob.indices[i] = geob.indices[i + 1] = geob.indices[i + 2] = 0;
+            ++badTriangles;
+        }
+    }
 
-    glEnableClientState(GL_VERTEX_ARRAY);
-    glEnableClientState(GL_NORMAL_ARRAY);
-
-    for (int j = 0; j < geob.nBursts; ++j) {
-        burstCount = geob.burstsCount[j] / 3;
-        burstStart = geob.burstStarts[j] / 3;
-
-        // NOTE: I would have expected the burst material to be valid here, but it 
-        // doesn't seem to work. Not sure what it's for...
+    if (geob.nVertices == 0) {
+        geob.nIndices = 0;
+    }
 
-        // Some files have fewer indices than bursts, which is really odd.
-        // Racer's source doesn't handle this case, something really odd is 
-        // going on there... 
-        // It only happens with some tracks, so it might be a bug in a track 
-        // generator.
-        stop = min(burstStart + burstCount, geob.nIndices) - burstStart;
+    if (badTriangles > 0) {
+        cout << "Warning: " << badTriangles << " triangles with bad indices in " 
+            << this->_filePath << endl;
+    }
+}
 
-        // Do some sanity checks
-        if (burstStart > geob.nIndices) {
-            cout << "Error start past indices" << endl;
-            continue;
-        }
+bool Dof::_checkCount(BinaryReader & reader, int count, size_t size) {
+    // Catch negative or ridiculous counts before we allocate for them
+    if (count < 0 || (size_t)count > reader.remaining() / size) {
+        cout << "Warning: bad array length (" << count << ") in " << this->_filePath 
+            << endl;
+        reader.overrun = true;
+        return false;
+    }
+    return true;
+}
 
-        // Draw the elements
-        glDrawElements(GL_TRIANGLES, stop, GL_UNSIGNED_SHORT, 
-                (GLvoid*)((char *)(0)));
+void Dof::_renderGeob(Geob & geob) {
+    try {
+        Mat & mat = this->mats.at(geob.material);
+        this->loadMaterial(mat);
+    } catch (std::out_of_range ex) {
+        Logger::warn << "Error loading material, skipping..." << endl;
+        return;
     }
+
+    geob.bind();
+    geob.draw();
 }
 
 void Dof::loadMaterial(Mat & mat) {
@@ -402,7 +654,7 @@ void Dof::loadMaterial(Mat & mat) {
         Texture * texture = mat.textures[0];
         OpenGLState::global.setTexture(texture->texture);
     } else {
-        glDisable(GL_TEXTURE_2D);
+        OpenGLState::global.clearTextures();
     }
 
     /*
@@ -430,76 +682,165 @@ void Dof::loadMaterial(Mat & mat) {
     */
 }
 
+// Only for sorting the opaque geobs by material
+static bool compareMaterials(const pair<Geob *, Mat *> & a, const pair<Geob *, Mat *> & b) {
+    return a.first->material < b.first->material;
+}
+
+void Dof::sortGeobs() {
+    this->_skyGeobs.clear();
+    this->_opaqueGeobs.clear();
+    this->_transparentGeobs.clear();
+    this->_transparent = false;
+
+    BOOST_FOREACH(Geob & geob, this->geobs) {
+        if (geob.material >= this->mats.size()) continue;
+        Mat & mat = this->mats[geob.material];
+        if (mat.isTransparent()) this->_transparent = true;
+
+        if (mat.shader != NULL && mat.shader->isSky) {
+            this->_skyGeobs.push_back(make_pair(&geob, &mat));
+        } else if (mat.isTransparent()) {
+            this->_transparentGeobs.push_back(make_pair(&geob, &mat));
+        } else {
+            this->_opaqueGeobs.push_back(make_pair(&geob, &mat));
+        }
+    }
+    stable_sort(this->_opaqueGeobs.begin(), this->_opaqueGeobs.end(), compareMaterials);
+}
+
 int Dof::render(bool overrideFrustrumTest) {
     int count = 0;
+    typedef pair<Geob *, Mat *> GeobMat;
 
     // First we render the sky
-    BOOST_FOREACH(Geob & geob, this->geobs) {
-        Mat & mat = this->mats[geob.material];
-        Shader * shader = mat.shader;
-
-        if (shader != NULL && shader->isSky) {
-            // We need to set up the project to be able to manage sky
-            glMatrixMode(GL_PROJECTION);
-            glPushMatrix();
-            glLoadIdentity();
-            int w = 800;
-            int h = 600;
-            float height = 1.0;
-            float width = (float)w / (float)h;
-            glFrustum(-1.0 * width, width, -1.0 * height, height, 1.5, 100000.0);
-            glMatrixMode(GL_MODELVIEW);
-            glPushMatrix();
-
-            this->_renderGeob(geob);
-
-            glPopMatrix();
-            glMatrixMode(GL_PROJECTION);
-            glPopMatrix();
-            glMatrixMode(GL_MODELVIEW);
+    BOOST_FOREACH(GeobMat & item, this->_skyGeobs) {
+        Dof::pushSkyProjection();
+        this->_renderGeob(*item.first);
+        Dof::popSkyProjection();
+    }
+
+    // second we render the non-transparent geobs. Batched geobs are drawn by the
+    // track, with their copies or merged with the rest of the scenery
+    BOOST_FOREACH(GeobMat & item, this->_opaqueGeobs) {
+        if (item.first->batched) continue;
+
+        // Check if we need to render this geob
+        if (overrideFrustrumTest || 
+                ViewFrustumCulling::culler->testObject(item.first->boundingBox)) {
+            this->_renderGeob(*item.first);
+            ++count;
         }
     }
 
-    // second we render the non-transparent geobs
-    BOOST_FOREACH(Geob & geob, this->geobs) {
-        Mat & mat = this->mats[geob.material];
+    // .. Now we render the transparent geobs, unless they have been merged into the
+    // track's static batches
+    BOOST_FOREACH(GeobMat & item, this->_transparentGeobs) {
+        if (item.first->merged) continue;
 
-        if (!mat.isTransparent()) {
-            // Check if we need to render this geob
-            if (overrideFrustrumTest || 
-                    ViewFrustumCulling::culler->testObject(geob.boundingBox)) {
-                // call the previously created display list
-                this->_renderGeob(geob);
-                ++count;
-            }
+        // Check if we need to render this geob
+        if (overrideFrustrumTest ||
+                ViewFrustumCulling::culler->testObject(item.first->boundingBox)) {
+            this->_renderGeob(*item.first);
+            ++count;
         }
     }
+    return count;
+}
+
+int Dof::submit(RenderQueue & queue, bool overrideFrustrumTest) {
+    int count = 0;
+    typedef pair<Geob *, Mat *> GeobMat;
+
+    // The sky isn't culled, it's always there
+    BOOST_FOREACH(GeobMat & item, this->_skyGeobs) {
+        queue.add(RENDER_PASS_SKY, *item.first, *item.second);
+        ++count;
+    }
 
-    // .. Now we render the transparent geobs
-    BOOST_FOREACH(Geob & geob, this->geobs) {
-        Mat mat = this->mats[geob.material];
-
-        if (mat.isTransparent()) {
-            // Check if we need to render this geob
-            if (overrideFrustrumTest ||
-                    ViewFrustumCulling::culler->testObject(geob.boundingBox)) {
-                // call the previously created display list
-                this->_renderGeob(geob);
-                ++count;
-            }
+    // Batched geobs are added by the track, with their copies or merged with the
+    // rest of the scenery
+    BOOST_FOREACH(GeobMat & item, this->_opaqueGeobs) {
+        if (item.first->batched) continue;
+        if (overrideFrustrumTest || 
+                ViewFrustumCulling::culler->testObject(item.first->boundingBox)) {
+            queue.add(RENDER_PASS_OPAQUE, *item.first, *item.second);
+            ++count;
+        }
+    }
+
+    BOOST_FOREACH(GeobMat & item, this->_transparentGeobs) {
+        if (item.first->merged) continue;
+        if (overrideFrustrumTest || 
+                ViewFrustumCulling::culler->testObject(item.first->boundingBox)) {
+            queue.add(RENDER_PASS_TRANSPARENT, *item.first, *item.second);
+            ++count;
         }
     }
     return count;
 }
 
+void Dof::getItems(vector<RenderItem> & items) {
+    typedef pair<Geob *, Mat *> GeobMat;
+
+    BOOST_FOREACH(GeobMat & item, this->_skyGeobs) {
+        items.push_back(RenderItem(RENDER_PASS_SKY, *item.first, *item.second));
+    }
+    BOOST_FOREACH(GeobMat & item, this->_opaqueGeobs) {
+        if (item.first->batched) continue;
+        items.push_back(RenderItem(RENDER_PASS_OPAQUE, *item.first, *item.second));
+    }
+    BOOST_FOREACH(GeobMat & item, this->_transparentGeobs) {
+        if (item.first->merged) continue;
+        items.push_back(RenderItem(RENDER_PASS_TRANSPARENT, *item.first, *item.second));
+    }
+}
+
+void Dof::pushSkyProjection() {
+    // We need to set up the project to be able to manage sky
+    glMatrixMode(GL_PROJECTION);
+    glPushMatrix();
+    glLoadIdentity();
+    int w = 800;
+    int h = 600;
+    float height = 1.0;
+    float width = (float)w / (float)h;
+    glFrustum(-1.0 * width, width, -1.0 * height, height, 1.5, 100000.0);
+    glMatrixMode(GL_MODELVIEW);
+    glPushMatrix();
+}
+
+void Dof::popSkyProjection() {
+    glPopMatrix();
+    glMatrixMode(GL_PROJECTION);
+    glPopMatrix();
+    glMatrixMode(GL_MODELVIEW);
+}
+
 bool Dof::isTransparent() {
+    return this->_transparent;
+}
+
+long Dof::getMemoryUsage() {
+    int stride, normalOffset, textureOffset;
+
+    long bytes = 0;
     BOOST_FOREACH(Geob & geob, this->geobs) {
-        Mat & mat = this->mats[geob.material];
-        if (mat.isTransparent()) {
-            return true;
+        Geob::vertexLayout(geob.format, stride, normalOffset, textureOffset);
+        bytes += geob.nIndices * sizeof(unsigned short) 
+            + geob.nVertices * 3 * sizeof(float)
+            + geob.nNormals * 3 * sizeof(float)
+            + geob.nTextureCoords * 2 * sizeof(float);
+        if (geob.vertexData != NULL) {
+            bytes += geob.nVertices * GEOB_VERTEX_SIZE * sizeof(float);
+        }
+
+        // Copies don't have VBOs of their own
+        if (geob.instanceOf == NULL) {
+            bytes += geob.nVertices * stride + geob.nIndices * sizeof(unsigned short);
         }
     }
-    return false;
+    return bytes;
 }
 
 boost::ptr_list<Geob> & Dof::getGeobs() {
@@ -552,30 +893,57 @@ bool Dof::isSurface() {
     return this->_flags & DOF_SURFACE || this->_flags & DOF_COLLISION;
 }
 
-/****************************************************************************************
- * Utilities
- ***************************************************************************************/
+bool Dof::isOccluder() {
+    return this->_flags & DOF_OCCLUDER;
+}
 
-template <class T> void parseVector(ifstream * file, T * vector, int length) {
-    for (int i = 0; i < length; ++i) {
-        file->read((char *)&(vector[i]), sizeof(T));
-    }
+string Dof::getFilePath() {
+    return this->_filePath;
 }
 
-int parseString(ifstream * file, char * buffer) {
-    short length;
-    file->read((char *)&length, sizeof(short));
-    file->read(buffer, length);
-    buffer[length] = NULL;
-    return length;
+const vector<string> & Dof::getTextureNames() {
+    return this->_textureNames;
 }
 
+int Geob::vertexFormat = 0;
 
 Geob::Geob() {
+    this->material = 0;
+    this->flags = 0;
+    this->paintFlags = 0;
+    this->nIndices = 0;
     this->indices = NULL;
+    this->nVertices = 0;
     this->vertices = NULL;
+    this->nNormals = 0;
     this->normals = NULL;
+    this->nTextureCoords = 0;
     this->textureCoords = NULL;
+    this->nBursts = 0;
+    this->burstStarts = NULL;
+    this->burstsCount = NULL;
+    this->burstsMaterials = NULL;
+    this->nRanges = 0;
+    this->rangeCounts = NULL;
+    this->rangeOffsets = NULL;
+    this->vertexData = NULL;
+    this->packedVertexData = NULL;
+    this->instanceOf = NULL;
+    this->batched = false;
+    this->merged = false;
+    this->nLods = 0;
+    this->nLodIndices = 0;
+    this->lodIndices = NULL;
+    this->vertexVBO = 0;
+    this->indexVBO = 0;
+    this->format = 0;
+    this->positionScale = 1;
+    for (int i = 0; i < 3; ++i) {
+        this->positionOffset[i] = 0;
+    }
+    for (int i = 0; i < 16; ++i) {
+        this->instanceTransform[i] = (i % 5 == 0) ? 1 : 0;
+    }
 }
 Geob::~Geob() {
     // Delete the various arrays
@@ -583,6 +951,169 @@ Geob::~Geob() {
     if (this->vertices != NULL) delete[] this->vertices;
     if (this->normals != NULL) delete[] this->normals;
     if (this->textureCoords != NULL) delete[] this->textureCoords;
+    if (this->burstStarts != NULL) delete[] this->burstStarts;
+    if (this->burstsCount != NULL) delete[] this->burstsCount;
+    if (this->burstsMaterials != NULL) delete[] this->burstsMaterials;
+    if (this->rangeCounts != NULL) delete[] this->rangeCounts;
+    if (this->rangeOffsets != NULL) delete[] this->rangeOffsets;
+    if (this->vertexData != NULL) delete[] this->vertexData;
+    if (this->packedVertexData != NULL) delete[] this->packedVertexData;
+    if (this->lodIndices != NULL) delete[] this->lodIndices;
+
+    // Free the VBOs, streamed dofs come and go
+    if (this->vertexVBO != 0) glDeleteBuffers(1, &this->vertexVBO);
+    if (this->indexVBO != 0) glDeleteBuffers(1, &this->indexVBO);
+}
+
+void Geob::buildVertexData() {
+    if (this->vertexData != NULL) delete[] this->vertexData;
+    this->vertexData = new float[this->nVertices * GEOB_VERTEX_SIZE];
+
+    // Missing normals and texture coordinates are left as 0
+    memset(this->vertexData, 0, this->nVertices * GEOB_VERTEX_SIZE * sizeof(float));
+    for (unsigned int i = 0; i < this->nVertices; ++i) {
+        float * vertex = this->vertexData + i * GEOB_VERTEX_SIZE;
+        memcpy(vertex, this->vertices[i], 3 * sizeof(float));
+        if (i < this->nNormals) memcpy(vertex + 3, this->normals[i], 3 * sizeof(float));
+        if (i < this->nTextureCoords) {
+            memcpy(vertex + 6, this->textureCoords[i], 2 * sizeof(float));
+        }
+    }
+}
+
+void Geob::vertexLayout(int format, int & stride, int & normalOffset,
+        int & textureOffset) {
+    // Everything is kept 4 byte aligned, so short positions get padded to 8 bytes
+    // and byte normals to 4
+    normalOffset = (format & VERTEX_SHORT_POSITIONS) ? 
+        4 * sizeof(short) : 3 * sizeof(float);
+    textureOffset = normalOffset + ((format & VERTEX_BYTE_NORMALS) ? 
+        4 * sizeof(char) : 3 * sizeof(float));
+    stride = textureOffset + ((format & VERTEX_HALF_TEXTURE_COORDS) ?
+        2 * sizeof(unsigned short) : 2 * sizeof(float));
+}
+
+void Geob::packVertexData() {
+    int stride, normalOffset, textureOffset;
+
+    if (this->packedVertexData != NULL) delete[] this->packedVertexData;
+    this->packedVertexData = NULL;
+
+    // Short positions are scaled back up by the modelview matrix, and texgen would
+    // see the shorts rather than the real positions
+    this->format = Geob::vertexFormat;
+    if (this->dof != NULL && this->material < this->dof->getMats().size()
+            && this->dof->getMats()[this->material].usesTexGen()) {
+        this->format &= ~VERTEX_SHORT_POSITIONS;
+    }
+    if (this->format == 0 || this->vertexData == NULL) {
+        this->format = 0;
+        return;
+    }
+
+    Geob::vertexLayout(this->format, stride, normalOffset, textureOffset);
+    this->packedVertexData = new unsigned char[this->nVertices * stride];
+    memset(this->packedVertexData, 0, this->nVertices * stride);
+
+    // The shorts cover the range of all the vertices. This can't use the bounding
+    // box as that only includes the vertices that are indexed
+    if (this->format & VERTEX_SHORT_POSITIONS && this->nVertices > 0) {
+        float min[3], max[3];
+        for (int j = 0; j < 3; ++j) {
+            min[j] = max[j] = this->vertexData[j];
+        }
+        for (unsigned int i = 1; i < this->nVertices; ++i) {
+            float * vertex = this->vertexData + i * GEOB_VERTEX_SIZE;
+            for (int j = 0; j < 3; ++j) {
+                if (vertex[j] < min[j]) min[j] = vertex[j];
+                if (vertex[j] > max[j]) max[j] = vertex[j];
+            }
+        }
+        // The longest side sets the scale
+        this->positionScale = 0;
+        for (int j = 0; j < 3; ++j) {
+            this->positionOffset[j] = (min[j] + max[j]) / 2;
+            this->positionScale = std::max(this->positionScale, 
+                    (max[j] - min[j]) / 2 / 32767);
+        }
+        if (this->positionScale <= 0) this->positionScale = 1;
+    }
+
+    for (unsigned int i = 0; i < this->nVertices; ++i) {
+        float * vertex = this->vertexData + i * GEOB_VERTEX_SIZE;
+        unsigned char * packed = this->packedVertexData + i * stride;
+
+        if (this->format & VERTEX_SHORT_POSITIONS) {
+            short * position = (short *)packed;
+            for (int j = 0; j < 3; ++j) {
+                // Clamped as float rounding can put the extremes just out of range
+                float p = (vertex[j] - this->positionOffset[j]) / this->positionScale;
+                position[j] = (short)floorf(max(-32767.0f, min(32767.0f, p)) + 0.5f);
+            }
+        } else {
+            memcpy(packed, vertex, 3 * sizeof(float));
+        }
+
+        if (this->format & VERTEX_BYTE_NORMALS) {
+            signed char * normal = (signed char *)(packed + normalOffset);
+            for (int j = 0; j < 3; ++j) {
+                float n = max(-1.0f, min(1.0f, vertex[3 + j]));
+                normal[j] = (signed char)floorf(n * 127 + 0.5f);
+            }
+        } else {
+            memcpy(packed + normalOffset, vertex + 3, 3 * sizeof(float));
+        }
+
+        if (this->format & VERTEX_HALF_TEXTURE_COORDS) {
+            unsigned short * textureCoord = (unsigned short *)(packed + textureOffset);
+            textureCoord[0] = floatToHalf(vertex[6]);
+            textureCoord[1] = floatToHalf(vertex[7]);
+        } else {
+            memcpy(packed + textureOffset, vertex + 6, 2 * sizeof(float));
+        }
+    }
+}
+
+void Geob::compileBursts() {
+    // The bursts are in thirds of an index
+    vector<pair<int, int> > bursts;
+    for (int j = 0; j < this->nBursts; ++j) {
+        int start = max(this->burstStarts[j] / 3, 0);
+        int end = min(this->burstStarts[j] / 3 + this->burstsCount[j] / 3, this->nIndices);
+        if (start < end) bursts.push_back(make_pair(start, end));
+    }
+    if (this->nBursts == 0 && this->nIndices > 0) {
+        bursts.push_back(make_pair(0, this->nIndices));
+    }
+
+    sort(bursts.begin(), bursts.end());
+    vector<pair<int, int> > ranges;
+    for (unsigned int i = 0; i < bursts.size(); ++i) {
+        if (!ranges.empty() && bursts[i].first <= ranges.back().second) {
+            ranges.back().second = max(ranges.back().second, bursts[i].second);
+        } else {
+            ranges.push_back(bursts[i]);
+        }
+    }
+
+    if (this->rangeCounts != NULL) delete[] this->rangeCounts;
+    if (this->rangeOffsets != NULL) delete[] this->rangeOffsets;
+    this->nRanges = ranges.size();
+    this->rangeCounts = new GLsizei[this->nRanges];
+    this->rangeOffsets = new const GLvoid *[this->nRanges];
+    for (int i = 0; i < this->nRanges; ++i) {
+        this->rangeCounts[i] = ranges[i].second - ranges[i].first;
+        this->rangeOffsets[i] = (GLvoid *)((char *)NULL
+                + ranges[i].first * sizeof(unsigned short));
+    }
+}
+
+void Geob::placeLods() {
+    int start = this->nIndices;
+    for (int i = 0; i < this->nLods; ++i) {
+        this->lodOffsets[i] = (GLvoid *)((char *)NULL + start * sizeof(unsigned short));
+        start += this->lodCounts[i];
+    }
 }
 
 void Geob::generateVAO() {
@@ -595,28 +1126,124 @@ void Geob::generateVAO() {
         return;
     }
 
-    // SEt up the VAO
+    // Copies of another geob draw with its buffers, so don't need any of their own,
+    // and neither do geobs merged into a static batch
+    if (this->instanceOf != NULL || this->merged) {
+        if (this->packedVertexData != NULL) delete[] this->packedVertexData;
+        this->packedVertexData = NULL;
+        return;
+    }
+
+    // SEt up the VAO, the interleaved data goes up in one go
     glGenBuffers(1, &(this->vertexVBO));
     glBindBufferARB(GL_ARRAY_BUFFER, this->vertexVBO);
-    const GLsizeiptr vSize = this->nVertices * 3 * sizeof(float);
-    const GLsizeiptr nSize = this->nNormals * 3 * sizeof(float);
-    const GLsizeiptr tSize = this->nTextureCoords * 2 * sizeof(float);
-    glBufferData(GL_ARRAY_BUFFER, vSize + nSize + tSize, NULL, GL_STATIC_DRAW);
-
-    // Copy the data
-    /*GLvoid * buffer = glMapBuffer(GL_ARRAY_BUFFER, GL_WRITE_ONLY);
-    memcpy(buffer, this->vertices, vSize);
-    buffer = (GLvoid *)((char *)buffer + vSize);
-    memcpy(buffer, this->normals, nSize);
-    glUnmapBuffer(GL_ARRAY_BUFFER);
-    */
-    glBufferSubData(GL_ARRAY_BUFFER, 0, vSize, this->vertices);
-    glBufferSubData(GL_ARRAY_BUFFER, vSize, nSize, this->normals);
-    glBufferSubData(GL_ARRAY_BUFFER, vSize + nSize, tSize, this->textureCoords);
+    if (this->packedVertexData != NULL) {
+        int stride, normalOffset, textureOffset;
+        Geob::vertexLayout(this->format, stride, normalOffset, textureOffset);
+        glBufferData(GL_ARRAY_BUFFER, this->nVertices * stride, 
+                this->packedVertexData, GL_STATIC_DRAW);
+
+        // Only the GPU needs the packed copy
+        delete[] this->packedVertexData;
+        this->packedVertexData = NULL;
+    } else {
+        glBufferData(GL_ARRAY_BUFFER, this->nVertices * GEOB_VERTEX_SIZE * sizeof(float), 
+                this->vertexData, GL_STATIC_DRAW);
+    }
 
     glGenBuffers(1, &(this->indexVBO));
     glBindBufferARB(GL_ELEMENT_ARRAY_BUFFER, this->indexVBO);
-    glBufferData(GL_ELEMENT_ARRAY_BUFFER, this->nIndices * sizeof(unsigned short), this->indices, GL_STATIC_DRAW);
+    if (this->nLods > 0) {
+        // The levels follow the full geob in the same buffer
+        vector<unsigned short> indices(this->indices, this->indices + this->nIndices);
+        indices.insert(indices.end(), this->lodIndices, this->lodIndices + this->nLodIndices);
+        glBufferData(GL_ELEMENT_ARRAY_BUFFER, indices.size() * sizeof(unsigned short),
+                &indices[0], GL_STATIC_DRAW);
+    } else {
+        glBufferData(GL_ELEMENT_ARRAY_BUFFER, this->nIndices * sizeof(unsigned short), this->indices, GL_STATIC_DRAW);
+    }
+}
+
+void Geob::bind() {
+    // Copies of another geob use its buffers
+    Geob & buffers = this->instanceOf != NULL ? *this->instanceOf : *this;
+
+    // Bind to VAO
+    //glBindVertexArrayAPPLE(geob->vao);
+    glBindBufferARB(GL_ARRAY_BUFFER, buffers.vertexVBO);
+    glBindBufferARB(GL_ELEMENT_ARRAY_BUFFER, buffers.indexVBO);
+    // The vertex data is interleaved: position, normal, texture coordinate
+    int stride, normalOffset, textureOffset;
+    const int format = buffers.format;
+    Geob::vertexLayout(format, stride, normalOffset, textureOffset);
+    glVertexPointer(3, (format & VERTEX_SHORT_POSITIONS) ? GL_SHORT : GL_FLOAT, 
+            stride, (GLvoid*)((char*)NULL));
+    glNormalPointer((format & VERTEX_BYTE_NORMALS) ? GL_BYTE : GL_FLOAT, 
+            stride, (GLvoid*)((char*)NULL + normalOffset));
+
+    // Every texture unit in use gets the same coordinates
+    OpenGLState::global.setClientArrays(OpenGLState::global.lastUsedTextures);
+    for (int i = 0; i < OpenGLState::global.lastUsedTextures; ++i) {
+        OpenGLState::global.setClientActiveTexture(i);
+        glTexCoordPointer(2, (format & VERTEX_HALF_TEXTURE_COORDS) ? GL_HALF_FLOAT_ARB : GL_FLOAT,
+                stride, (GLvoid*)((char*)NULL + textureOffset));
+    }
+}
+
+void Geob::_pushTransform() {
+    Geob & buffers = this->instanceOf != NULL ? *this->instanceOf : *this;
+    const int format = buffers.format;
+
+    if (this->instanceOf != NULL || format & VERTEX_SHORT_POSITIONS) {
+        glPushMatrix();
+    }
+
+    // A copy is moved from where the original is to where it should be
+    if (this->instanceOf != NULL) {
+        glMultMatrixf(this->instanceTransform);
+    }
+
+    // Short positions are scaled back up by the modelview matrix, which also scales
+    // the normals so they have to be renormalised
+    if (format & VERTEX_SHORT_POSITIONS) {
+        glTranslatef(buffers.positionOffset[0], buffers.positionOffset[1], 
+                buffers.positionOffset[2]);
+        glScalef(buffers.positionScale, buffers.positionScale, buffers.positionScale);
+        glEnable(GL_NORMALIZE);
+    }
+}
+
+void Geob::_popTransform() {
+    Geob & buffers = this->instanceOf != NULL ? *this->instanceOf : *this;
+    const int format = buffers.format;
+
+    if (format & VERTEX_SHORT_POSITIONS) {
+        glDisable(GL_NORMALIZE);
+    }
+    if (this->instanceOf != NULL || format & VERTEX_SHORT_POSITIONS) {
+        glPopMatrix();
+    }
+}
+
+void Geob::draw() {
+    this->_pushTransform();
+
+    // Nearly every geob is a single burst, which doesn't need the multi draw
+    if (this->nRanges == 1) {
+        glDrawElements(GL_TRIANGLES, this->rangeCounts[0], GL_UNSIGNED_SHORT,
+                this->rangeOffsets[0]);
+    } else if (this->nRanges > 1) {
+        glMultiDrawElements(GL_TRIANGLES, this->rangeCounts, GL_UNSIGNED_SHORT,
+                this->rangeOffsets, this->nRanges);
+    }
+
+    this->_popTransform();
+}
+
+void Geob::drawRanges(const GLsizei * counts, const GLvoid ** offsets, int n) {
+    this->_pushTransform();
+    glMultiDrawElements(GL_TRIANGLES, counts, GL_UNSIGNED_SHORT, offsets, n);
+    this->_popTransform();
 }
 
 Shader * Geob::getShader() {
@@ -632,6 +1259,31 @@ Mat::Mat() {
 
 Mat::~Mat() {}
 
+// Key for untextured materials, they all load the same state
+static char untexturedKey;
+
+void * Mat::getStateKey() {
+    // This is all Dof::loadMaterial looks at
+    if (this->shader != NULL) return this->shader;
+    if (this->nTextures > 0 && this->textures[0] != NULL) return this->textures[0];
+    return &untexturedKey;
+}
+
+bool Mat::usesTexGen() {
+    if (this->shader == NULL) return false;
+    for (int i = 0; i < this->shader->nLayers; ++i) {
+        if (this->shader->layers[i]->texGen) return true;
+    }
+    return false;
+}
+
+bool Mat::isOpaqueSolid() {
+    // The blend mode is set on nearly everything, buildings included, so only alpha
+    // testing rules a material out
+    return this->shader == NULL
+        || (!this->shader->isSky && this->shader->layers[0]->alphaFunction <= 1);
+}
+
 bool Mat::isTransparent() {
     if (this->blendMode > 0) {
         return true;
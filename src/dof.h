@@ -13,23 +13,43 @@
 #include "shader.h"
 #include "texture.h"
 #include "opengl_state.h"
+#include "binary_reader.h"
 
 #include <GL/gl.h>
 #include <GL/glu.h>
 #include <string>
+#include <vector>
+#include <utility>
 #include <boost/ptr_container/ptr_list.hpp>
 #include <boost/ptr_container/ptr_vector.hpp>
 
-// Utility function to load vector
-template <class T> void parseVector(ifstream * file, T * vector, int length);
-// to load string
-int parseString(ifstream * file, char * buffer);
-
 // Define the geometry object flags
 #define DOF_COLLISION 2
 #define DOF_SURFACE 4
+// Not one of Racer's, marks the dof as something to hide things behind, see
+// OcclusionCuller
+#define DOF_OCCLUDER 256
+// Not one of Racer's either, loads the dof without its textures for when only the
+// geometry is wanted. The materials' textures are left NULL
+#define DOF_NO_TEXTURES 512
+
+// Number of floats per vertex in the interleaved vertex data: position (3), 
+// normal (3), texture coordinate (2)
+#define GEOB_VERTEX_SIZE 8
+
+// Most simplified versions a geob can have, see MeshSimplifier
+#define GEOB_MAX_LODS 3
 
 class Dof;
+class RenderQueue;
+class RenderItem;
+
+// Compact vertex encodings, these can be combined in Geob::vertexFormat. Positions
+// become shorts relative to the geob's bounds, normals signed bytes and texture
+// coordinates half floats (which needs GL_ARB_half_float_vertex)
+#define VERTEX_SHORT_POSITIONS 1
+#define VERTEX_BYTE_NORMALS 2
+#define VERTEX_HALF_TEXTURE_COORDS 4
 
 // This should either be a struct or have proper encapsulation. Not sure which yet
 class Geob {
@@ -37,6 +57,11 @@ class Geob {
         Geob();
         ~Geob();
         unsigned int material;
+        // The other two ints in the GHDR, the spec doesn't say what they are but they
+        // are kept so the geob can be saved as it was. The geometry cache doesn't keep
+        // them
+        int flags;
+        int paintFlags;
         int nIndices;
         unsigned short * indices;
         unsigned int nVertices;
@@ -45,10 +70,27 @@ class Geob {
         float (* textureCoords)[2];
         unsigned int nNormals;
         float (* normals)[3];
+        // The above interleaved as floats: position, normal, texture coordinate
+        float * vertexData;
+        // vertexData in the encoding picked by vertexFormat, this is what goes to the
+        // VBO. It's NULL when everything is a float and vertexData can go up as is
+        unsigned char * packedVertexData;
+        // The encodings packedVertexData actually uses. Geobs whose material generates
+        // texture coordinates keep float positions, as texgen works from them
+        int format;
+        // Short positions map back to the real ones with offset + position * scale.
+        // The scale is the same on every axis so the normals keep their direction
+        float positionOffset[3];
+        float positionScale;
         int nBursts;
         int * burstStarts;
         int * burstsCount;
         int * burstsMaterials;
+        // The bursts as ranges of indexVBO, for drawing them all in one call. See
+        // compileBursts
+        int nRanges;
+        GLsizei * rangeCounts;
+        const GLvoid ** rangeOffsets;
         // Still to implement
         // * VCOL
         unsigned int displayList;
@@ -60,11 +102,71 @@ class Geob {
         unsigned int indexVBO;
         Dof * dof;
 
+        // Set when this geob is a moved copy of another. It then draws with the other
+        // geob's buffers, transformed by instanceTransform (an OpenGL matrix)
+        Geob * instanceOf;
+        float instanceTransform[16];
+        // Set when the track draws this geob in an instance batch, rather than the dof
+        bool batched;
+        // Set when the geob has been copied into one of the track's static batches.
+        // It's drawn from there, so it doesn't get buffers of its own
+        bool merged;
+
+        // Simplified versions for drawing from further away, coarser as they go.
+        // Their indices go in indexVBO after the geob's own, so each one is a range
+        // of lodCounts[i] indices at lodOffsets[i]. lodErrors[i] is roughly how far
+        // the level is from the real shape
+        int nLods;
+        int nLodIndices;
+        unsigned short * lodIndices;
+        GLsizei lodCounts[GEOB_MAX_LODS];
+        const GLvoid * lodOffsets[GEOB_MAX_LODS];
+        float lodErrors[GEOB_MAX_LODS];
+
+        // Interleave the vertices, normals and texture coordinates into vertexData
+        void buildVertexData();
+
+        // Encode vertexData into packedVertexData using vertexFormat
+        void packVertexData();
+
+        // Which of the VERTEX_* encodings to use. This has to be set before any dofs
+        // are loaded
+        static int vertexFormat;
+
+        // The size of a vertex and the offsets of the normal and texture coordinate
+        // for a geob's format
+        static void vertexLayout(int format, int & stride, int & normalOffset,
+                int & textureOffset);
+
+        // Work out the ranges from the bursts. The bursts are clamped to the indices,
+        // and ones that overlap or follow on from each other are joined up so nothing
+        // is drawn twice. A geob without any bursts is one range
+        void compileBursts();
+
+        // Work out lodOffsets from lodCounts
+        void placeLods();
+
         // Generate the vao
         void generateVAO();
 
+        // Point the vertex arrays at the geob's buffers. The material has to be loaded
+        // first so we know how many texture units need coordinates
+        void bind();
+
+        // Draw the geob's ranges, it has to be bound (or be a copy of the bound geob)
+        void draw();
+
+        // Draw n ranges of the index buffer in one call, offsets are in bytes. The
+        // geob has to be bound
+        void drawRanges(const GLsizei * counts, const GLvoid ** offsets, int n);
+
         // Get the shader for this geob, NULL if there isn't one
         Shader * getShader();
+
+    private:
+        // Set up the modelview matrix for a copy or short positions, and put it back
+        void _pushTransform();
+        void _popTransform();
 };
 
 class Mat {
@@ -72,6 +174,11 @@ class Mat {
         Mat();
         ~Mat();
         bool isTransparent();
+        // True if any of the shader's layers generate texture coordinates
+        bool usesTexGen();
+        // True if the material draws solid surfaces, nothing can be seen through them
+        // or round their edges
+        bool isOpaqueSolid();
 
         std::string name;
         float ambient[4];
@@ -98,11 +205,20 @@ class Mat {
 
         Geob * getGeob(int index);
         int getNGeobs();
+
+        // Materials with the same key set up the same OpenGL state in
+        // Dof::loadMaterial, so their geobs can be drawn one after another without
+        // loading anything in between
+        void * getStateKey();
 };
 
 class Dof {
     public:
-        Dof(std::string filePath, int flags, bool perGeobDisplayList = true);
+        // Load the dof at filePath. With deferUpload nothing is sent to OpenGL, so
+        // the dof can be loaded on a worker thread, and upload() has to be called on
+        // the main thread before it is rendered
+        Dof(std::string filePath, int flags, bool perGeobDisplayList = true,
+                bool deferUpload = false);
         ~Dof();
 
         // These haven't been properly implemented so just throw at the moment
@@ -112,6 +228,30 @@ class Dof {
         // Render the dof
         int render(bool overrideFrustrumTest = false);
 
+        // Add the visible geobs to the queue rather than drawing them straight away,
+        // returns the number added
+        int submit(RenderQueue & queue, bool overrideFrustrumTest = false);
+
+        // Add what submit would to items, without culling, for things that are kept
+        // and culled some other way
+        void getItems(std::vector<RenderItem> & items);
+
+        // The sky is drawn with its own projection so it's never clipped, these set
+        // it up and put the normal one back
+        static void pushSkyProjection();
+        static void popSkyProjection();
+
+        // Create the VBOs for the geobs
+        void upload();
+
+        // Write the dof out to filePath as DOF1. The materials are copied as they are
+        // from the file it was loaded from, the geobs are written from what is in
+        // memory, so changes made to them are saved. Returns false if it couldn't
+        bool save(std::string filePath);
+
+        // Roughly how many bytes the geometry takes up, in memory and in VBOs
+        long getMemoryUsage();
+
         // Return true if one of the materials is transparent
         bool isTransparent();
 
@@ -124,9 +264,21 @@ class Dof {
         // Return true if this is part of the track surface
         bool isSurface();
 
+        // Return true if the dof has been flagged as an occluder
+        bool isOccluder();
+
+        std::string getFilePath();
+
+        // The paths of the textures the materials use, whether they were loaded or not
+        const std::vector<std::string> & getTextureNames();
+
         // Set up the material for OpenGL
         void loadMaterial(Mat & mat);
 
+        // Sort the geobs into the passes, which is done when the dof loads. Anything
+        // that changes the geobs' materials afterwards has to call this again
+        void sortGeobs();
+
     private:
         std::string _filePath;
 
@@ -135,6 +287,7 @@ class Dof {
 
         // Material objects
         boost::ptr_vector<Mat> mats;
+        std::vector<std::string> _textureNames;
 
         // Some objects are small enough that all the geobs can be drawn in two display
         // lists, one for transparent and one for non-transparent. This also lets us
@@ -145,13 +298,24 @@ class Dof {
         // Flags
         int _flags;
 
-        // Parse the geobs from the file into Geob objects. This assumes that the file
-        // pointer is at the start of GOB1 and will leave the pointer at the end of GEND
-        void _parseGeobs(ifstream * file);
+        // Parse the geobs from the mapped file into Geob objects. This assumes that the
+        // reader is just after the GEOB token and will leave it at the end of the last GEND
+        void _parseGeobs(BinaryReader & reader);
+
+        // Parse the mats from the mapped file into Mat objects. Like _parseGeobs, it
+        // assumes the reader is just after the MATS token and leaves it after the last MEND
+        void _parseMats(BinaryReader & reader);
 
-        // Parse the mats from the file into Mat objects. Like _parseGeobs, it assumes that
-        // the file pointer is at the beginning of the first MAT0 and leaves it after MEND
-        void _parseMats(ifstream * file);
+        // Check an array count read from the file fits in what is left of it, warns and
+        // flags the reader as overrun if not
+        bool _checkCount(BinaryReader & reader, int count, size_t size);
+
+        // Split up any geobs whose bursts use different materials, so each material's
+        // bursts are a geob of their own
+        void _splitBursts();
+
+        // Make sure the indices all point at vertices
+        void _checkIndices(Geob & geob);
 
         // Load a texture
         void _loadTexture(std::string name, Texture * texture);
@@ -161,6 +325,15 @@ class Dof {
         // Render a geob, will only change material if previous Mat != the current one
         void _renderGeob(Geob & geob);
 
+        // The geobs with their materials, sorted into the passes once the dof has
+        // loaded so drawing doesn't have to look at the materials every frame. The
+        // opaque ones are grouped by material. Geobs with a bad material aren't in any
+        std::vector<std::pair<Geob *, Mat *> > _skyGeobs;
+        std::vector<std::pair<Geob *, Mat *> > _opaqueGeobs;
+        std::vector<std::pair<Geob *, Mat *> > _transparentGeobs;
+        // Set if any of the geobs are transparent
+        bool _transparent;
+
         // The bounding box for the dof
         void _calculateBoundingBox();
 
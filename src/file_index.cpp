@@ -0,0 +1,62 @@
+#include "file_index.h"
+
+#include <boost/filesystem.hpp>
+#include <boost/algorithm/string.hpp>
+
+using namespace std;
+namespace fs = boost::filesystem;
+
+boost::unordered_map<string, FileIndex::Directory> FileIndex::_directories;
+pthread_mutex_t FileIndex::_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+string FileIndex::find(const string & filePath) {
+    pthread_mutex_lock(&FileIndex::_mutex);
+    string found = FileIndex::_find(filePath);
+    pthread_mutex_unlock(&FileIndex::_mutex);
+    return found;
+}
+
+string FileIndex::_find(const string & filePath) {
+    fs::path path(filePath);
+    string name = path.filename().string();
+    if (name.empty() || name == "." || name == "..") return filePath;
+
+    const Directory & directory = FileIndex::_getDirectory(path.parent_path().string());
+    boost::unordered_map<string, string>::const_iterator it = 
+        directory.names.find(boost::to_lower_copy(name));
+    if (it == directory.names.end()) return filePath;
+
+    // If names only differ by case the one asked for wins, the index only has one
+    // of them
+    if (it->second != name && fs::exists(filePath)) return filePath;
+
+    if (directory.path.empty()) return it->second;
+    return (fs::path(directory.path) / it->second).string();
+}
+
+const FileIndex::Directory & FileIndex::_getDirectory(const string & directoryPath) {
+    boost::unordered_map<string, Directory>::iterator it = 
+        FileIndex::_directories.find(directoryPath);
+    if (it != FileIndex::_directories.end()) return it->second;
+
+    Directory & directory = FileIndex::_directories[directoryPath];
+
+    // The directory itself might need finding
+    directory.path = directoryPath;
+    if (!directoryPath.empty() && !fs::exists(directoryPath)) {
+        directory.path = FileIndex::_find(directoryPath);
+    }
+
+    string listPath = directory.path.empty() ? "." : directory.path;
+    try {
+        if (!fs::is_directory(listPath)) return directory;
+        for (fs::directory_iterator file(listPath), end; file != end; ++file) {
+            string name = file->path().filename().string();
+            // The first of any names that only differ by case is kept
+            directory.names.insert(make_pair(boost::to_lower_copy(name), name));
+        }
+    } catch (std::exception & e) {
+        // Unreadable directories are left empty, their files are used as given
+    }
+    return directory;
+}
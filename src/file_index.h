@@ -0,0 +1,44 @@
+/**
+ * Finds asset files whatever the case of their names. The tracks and cars come from
+ * Windows, so the names in the inis, shaders and dofs often don't match the case of
+ * the files on disk.
+ *
+ * Each directory is listed once, the first time a file in it is looked up, into a
+ * hash of its lower case names. After that a lookup is a hash lookup rather than a
+ * scan of the directory, which for a track directory of several hundred files was
+ * most of the cost of finding the textures. Directories with the wrong case are
+ * found the same way, through their parent's index.
+ *
+ * Files are looked up from the loader threads, so the indexes are kept behind a
+ * mutex. An index isn't updated once made, a file added afterwards is only found if
+ * it is asked for with the right case.
+ */
+#pragma once
+
+#include <string>
+#include <pthread.h>
+#include <boost/unordered_map.hpp>
+
+class FileIndex {
+    public:
+        // The path of the file matching filePath ignoring case, or filePath itself if
+        // there isn't one
+        static std::string find(const std::string & filePath);
+
+    private:
+        // The lower case names in a directory and the names they really have
+        class Directory {
+            public:
+                std::string path;
+                boost::unordered_map<std::string, std::string> names;
+        };
+
+        static boost::unordered_map<std::string, Directory> _directories;
+        static pthread_mutex_t _mutex;
+
+        // find, with the mutex held
+        static std::string _find(const std::string & filePath);
+
+        // The index of the directory at directoryPath, listing it if it hasn't been
+        static const Directory & _getDirectory(const std::string & directoryPath);
+};
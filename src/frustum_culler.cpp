@@ -40,16 +40,68 @@ bool ViewFrustumCulling::testObject(float * boundingBox) {
     return true;
 }
 
+int ViewFrustumCulling::testBox(const float * boundingBox, int & planes) {
+    for (int i = 0; i < 6; ++i) {
+        if (!(planes & (1 << i))) continue;
+        float * plane = this->_frustum[i];
+
+        // The corner furthest along the plane's normal, and the one furthest back
+        float furthest = plane[3];
+        float nearest = plane[3];
+        for (int j = 0; j < 3; ++j) {
+            float low = plane[j] * boundingBox[j * 2];
+            float high = plane[j] * boundingBox[j * 2 + 1];
+            furthest += low > high ? low : high;
+            nearest += low > high ? high : low;
+        }
+
+        if (furthest < 0) return FRUSTUM_OUTSIDE;
+        if (nearest >= 0) planes &= ~(1 << i);
+    }
+    return planes == 0 ? FRUSTUM_INSIDE : FRUSTUM_INTERSECTS;
+}
+
 void ViewFrustumCulling::refreshMatrices() {
     float modelView[16];
     float projection[16];
-    float t;
-    float (* frustum)[4] = this->_frustum;
 
     // Load the MODELVIEW and PROJETION matrices
     glGetFloatv(GL_MODELVIEW_MATRIX, modelView);
     glGetFloatv(GL_PROJECTION_MATRIX, projection);
 
+    this->setMatrices(modelView, projection);
+}
+
+const float * ViewFrustumCulling::getPlane(int index) {
+    return this->_frustum[index];
+}
+
+float * ViewFrustumCulling::getMatrix() {
+    return this->_matrix.getMatrix();
+}
+
+void ViewFrustumCulling::getCameraPosition(float * position) {
+    for (int i = 0; i < 3; ++i) {
+        position[i] = this->_cameraPosition[i];
+    }
+}
+
+float ViewFrustumCulling::getProjectionScale() {
+    return this->_projectionScale;
+}
+
+void ViewFrustumCulling::setMatrices(float * modelView, float * projection) {
+    float t;
+    float (* frustum)[4] = this->_frustum;
+
+    this->_projectionScale = projection[5];
+
+    // The camera is where the translation ends up once the rotation is undone
+    for (int i = 0; i < 3; ++i) {
+        this->_cameraPosition[i] = -(modelView[i * 4] * modelView[12]
+                + modelView[i * 4 + 1] * modelView[13] + modelView[i * 4 + 2] * modelView[14]);
+    }
+
     // Combine the two matrices
     this->_matrix.reset();
     this->_matrix.multiplyMatrix(projection);
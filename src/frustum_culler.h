@@ -11,18 +11,50 @@
 
 #include "matrix.h"
 
+// Results of testBox
+#define FRUSTUM_OUTSIDE 0
+#define FRUSTUM_INTERSECTS 1
+#define FRUSTUM_INSIDE 2
+
+// All six planes, for testBox
+#define FRUSTUM_ALL_PLANES 63
+
 class ViewFrustumCulling {
     public:
         // Refresh the MODELVIEW and PROJECTION matrices
         void refreshMatrices();
 
+        // Work out the frustum from the given matrices rather than OpenGL's
+        void setMatrices(float * modelView, float * projection);
+
+        // One of the planes, a, b, c and d of ax + by + cz + d = 0 with the normal
+        // pointing into the frustum. In the order right, left, bottom, top, far, near
+        const float * getPlane(int index);
+
+        // The projection and modelview matrices multiplied together
+        float * getMatrix();
+
+        // Where the camera is, from the modelview matrix
+        void getCameraPosition(float * position);
+
+        // How much the projection scales heights by, something of height h at a
+        // distance d covers h * getProjectionScale() / d of half the screen
+        float getProjectionScale();
+
         // Test if an object is in the frustum, return TRUE if it is.
         bool testObject(float * boundingBox);
 
+        // Test the box itself rather than a sphere around it, against the planes set
+        // in planes (a bit for each). The planes the box is completely inside are
+        // cleared, so anything inside the box only needs testing against the rest
+        int testBox(const float * boundingBox, int & planes);
+
         static ViewFrustumCulling * culler;
 
     private:
         float _frustum[6][4];
         Matrix _matrix;
+        float _cameraPosition[3];
+        float _projectionScale;
 
 };
@@ -0,0 +1,260 @@
+#include "geometry_cache.h"
+#include "binary_reader.h"
+#include "mesh_optimiser.h"
+#include "mesh_simplifier.h"
+
+#include <fstream>
+#include <iostream>
+#include <sstream>
+#include <boost/filesystem.hpp>
+#include <boost/functional/hash.hpp>
+#include <boost/iostreams/device/mapped_file.hpp>
+#include <boost/foreach.hpp>
+
+using namespace std;
+namespace fs = boost::filesystem;
+
+string GeometryCache::cachePath = "cache/geometry";
+const int GeometryCache::version = 3;
+int GeometryCache::hits = 0;
+int GeometryCache::misses = 0;
+pthread_mutex_t GeometryCache::_countMutex = PTHREAD_MUTEX_INITIALIZER;
+
+// Utility functions to write values and arrays
+template <class T> void writeValue(ofstream & file, T value) {
+    file.write((const char *)&value, sizeof(T));
+}
+
+template <class T> void writeArray(ofstream & file, const T * array, size_t count) {
+    if (count > 0) file.write((const char *)array, count * sizeof(T));
+}
+
+string GeometryCache::_entryPath(const string & dofPath) {
+    stringstream name;
+    name << hex << boost::hash<string>()(dofPath) << ".geo";
+    return (fs::path(GeometryCache::cachePath) / name.str()).string();
+}
+
+void GeometryCache::_count(bool hit) {
+    pthread_mutex_lock(&GeometryCache::_countMutex);
+    if (hit) {
+        ++GeometryCache::hits;
+    } else {
+        ++GeometryCache::misses;
+    }
+    pthread_mutex_unlock(&GeometryCache::_countMutex);
+}
+
+int GeometryCache::_options() {
+    int options = 0;
+    if (MeshOptimiser::enabled) options |= 1;
+    if (MeshSimplifier::enabled) options |= 2;
+    return options;
+}
+
+bool GeometryCache::read(const string & dofPath, Dof * dof, int nMats,
+        boost::ptr_list<Geob> & geobs) {
+    char token[5];
+
+    if (GeometryCache::cachePath.empty()) return false;
+
+    string entryPath = GeometryCache::_entryPath(dofPath);
+    if (!fs::exists(entryPath)) {
+        GeometryCache::_count(false);
+        return false;
+    }
+
+    boost::iostreams::mapped_file_source file;
+    try {
+        file.open(entryPath);
+    } catch (std::exception & e) {
+        GeometryCache::_count(false);
+        return false;
+    }
+    BinaryReader reader(file.data(), file.size());
+
+    // Check the entry is for this version of this file
+    bool valid;
+    try {
+        reader.readToken(token);
+        valid = strcmp(token, "RGC1") == 0
+            && reader.read<int>() == GeometryCache::version
+            && reader.read<int>() == GeometryCache::_options()
+            && reader.read<long long>() == (long long)fs::last_write_time(dofPath)
+            && reader.read<long long>() == (long long)fs::file_size(dofPath)
+            && reader.readString() == dofPath
+            && reader.read<int>() == nMats;
+    } catch (std::exception & e) {
+        valid = false;
+    }
+    if (!valid) {
+        GeometryCache::_count(false);
+        return false;
+    }
+
+    int nGeobs = reader.read<int>();
+    for (int i = 0; i < nGeobs && !reader.overrun; ++i) {
+        Geob * geob = new Geob();
+        geob->dof = dof;
+        geobs.push_back(geob);
+
+        geob->material = reader.read<int>();
+        geob->nIndices = reader.read<int>();
+        geob->nVertices = reader.read<int>();
+        geob->nNormals = reader.read<int>();
+        geob->nTextureCoords = reader.read<int>();
+        geob->nBursts = reader.read<int>();
+        reader.readArray<float>(geob->boundingBox, 6);
+
+        // Guard against a corrupt entry before allocating anything. The normals and
+        // texture coordinates come out of the vertex data, so there can't be more of
+        // them than vertices
+        size_t needed = (size_t)geob->nBursts * 3 * sizeof(int)
+            + (size_t)geob->nIndices * sizeof(unsigned short)
+            + (size_t)geob->nVertices * GEOB_VERTEX_SIZE * sizeof(float);
+        if (geob->nBursts < 0 || geob->nIndices < 0 || needed > reader.remaining()
+                || geob->nNormals > geob->nVertices
+                || geob->nTextureCoords > geob->nVertices) {
+            reader.overrun = true;
+            break;
+        }
+
+        geob->burstStarts = new int[geob->nBursts];
+        reader.readArray<int>(geob->burstStarts, geob->nBursts);
+        geob->burstsCount = new int[geob->nBursts];
+        reader.readArray<int>(geob->burstsCount, geob->nBursts);
+        geob->burstsMaterials = new int[geob->nBursts];
+        reader.readArray<int>(geob->burstsMaterials, geob->nBursts);
+
+        geob->indices = new unsigned short[geob->nIndices];
+        reader.readArray<unsigned short>(geob->indices, geob->nIndices);
+        reader.skip((geob->nIndices % 2) * sizeof(unsigned short));
+
+        // The interleaved data goes straight into the VBO
+        geob->vertexData = new float[geob->nVertices * GEOB_VERTEX_SIZE];
+        reader.readArray<float>(geob->vertexData, geob->nVertices * GEOB_VERTEX_SIZE);
+
+        // .. but the rest of the game still wants the separate arrays
+        geob->vertices = new float[geob->nVertices][3];
+        geob->normals = new float[geob->nNormals][3];
+        geob->textureCoords = new float[geob->nTextureCoords][2];
+        for (unsigned int j = 0; j < geob->nVertices; ++j) {
+            float * vertex = geob->vertexData + j * GEOB_VERTEX_SIZE;
+            memcpy(geob->vertices[j], vertex, 3 * sizeof(float));
+            if (j < geob->nNormals) memcpy(geob->normals[j], vertex + 3, 3 * sizeof(float));
+            if (j < geob->nTextureCoords) {
+                memcpy(geob->textureCoords[j], vertex + 6, 2 * sizeof(float));
+            }
+        }
+
+        // The simplified versions
+        geob->nLods = reader.read<int>();
+        if (geob->nLods < 0 || geob->nLods > GEOB_MAX_LODS) {
+            reader.overrun = true;
+            break;
+        }
+        geob->nLodIndices = 0;
+        for (int j = 0; j < geob->nLods; ++j) {
+            geob->lodCounts[j] = reader.read<int>();
+            if (geob->lodCounts[j] < 0) reader.overrun = true;
+            geob->nLodIndices += geob->lodCounts[j];
+        }
+        reader.readArray<float>(geob->lodErrors, geob->nLods);
+        if (reader.overrun
+                || (size_t)geob->nLodIndices * sizeof(unsigned short) > reader.remaining()) {
+            reader.overrun = true;
+            break;
+        }
+        if (geob->nLods > 0) {
+            geob->lodIndices = new unsigned short[geob->nLodIndices];
+            reader.readArray<unsigned short>(geob->lodIndices, geob->nLodIndices);
+            reader.skip((geob->nLodIndices % 2) * sizeof(unsigned short));
+            geob->placeLods();
+        }
+    }
+
+    if (reader.overrun) {
+        cout << "Corrupt geometry cache entry for " << dofPath << endl;
+        geobs.clear();
+        GeometryCache::_count(false);
+        return false;
+    }
+
+    GeometryCache::_count(true);
+    return true;
+}
+
+void GeometryCache::write(const string & dofPath, int nMats,
+        boost::ptr_list<Geob> & geobs) {
+    if (GeometryCache::cachePath.empty()) return;
+
+    string entryPath = GeometryCache::_entryPath(dofPath);
+    string tmpPath = entryPath + ".tmp";
+
+    long long mtime, size;
+    try {
+        mtime = fs::last_write_time(dofPath);
+        size = fs::file_size(dofPath);
+        fs::create_directories(GeometryCache::cachePath);
+    } catch (std::exception & e) {
+        cout << "Couldn't create geometry cache: " << e.what() << endl;
+        return;
+    }
+
+    // Write to a temporary file and move it into place so a half written entry is
+    // never picked up
+    ofstream file(tmpPath.c_str(), ios::out | ios::binary | ios::trunc);
+    if (!file.is_open()) {
+        cout << "Couldn't write geometry cache entry " << tmpPath << endl;
+        return;
+    }
+
+    file.write("RGC1", 4);
+    writeValue<int>(file, GeometryCache::version);
+    writeValue<int>(file, GeometryCache::_options());
+    writeValue<long long>(file, mtime);
+    writeValue<long long>(file, size);
+    writeValue<unsigned short>(file, dofPath.size());
+    file.write(dofPath.c_str(), dofPath.size());
+    writeValue<int>(file, nMats);
+    writeValue<int>(file, geobs.size());
+
+    BOOST_FOREACH(Geob & geob, geobs) {
+        writeValue<int>(file, geob.material);
+        writeValue<int>(file, geob.nIndices);
+        writeValue<int>(file, geob.nVertices);
+        // Only the first nVertices normals and texture coordinates make it into the
+        // interleaved data
+        writeValue<int>(file, min(geob.nNormals, geob.nVertices));
+        writeValue<int>(file, min(geob.nTextureCoords, geob.nVertices));
+        writeValue<int>(file, geob.nBursts);
+        writeArray<float>(file, geob.boundingBox, 6);
+        writeArray<int>(file, geob.burstStarts, geob.nBursts);
+        writeArray<int>(file, geob.burstsCount, geob.nBursts);
+        writeArray<int>(file, geob.burstsMaterials, geob.nBursts);
+        writeArray<unsigned short>(file, geob.indices, geob.nIndices);
+        if (geob.nIndices % 2) writeValue<unsigned short>(file, 0);
+        writeArray<float>(file, geob.vertexData, geob.nVertices * GEOB_VERTEX_SIZE);
+        writeValue<int>(file, geob.nLods);
+        for (int i = 0; i < geob.nLods; ++i) {
+            writeValue<int>(file, geob.lodCounts[i]);
+        }
+        writeArray<float>(file, geob.lodErrors, geob.nLods);
+        writeArray<unsigned short>(file, geob.lodIndices, geob.nLodIndices);
+        if (geob.nLodIndices % 2) writeValue<unsigned short>(file, 0);
+    }
+
+    file.close();
+
+    try {
+        if (file.fail()) {
+            cout << "Failed writing geometry cache entry " << tmpPath << endl;
+            fs::remove(tmpPath);
+            return;
+        }
+
+        fs::rename(tmpPath, entryPath);
+    } catch (std::exception & e) {
+        cout << "Failed writing geometry cache entry: " << e.what() << endl;
+    }
+}
@@ -0,0 +1,63 @@
+/**
+ * An on-disk cache of the parsed DOF geometry. Each DOF gets a file holding its geobs
+ * already processed (texture coordinates flipped, bounding boxes calculated) and in
+ * the interleaved layout that goes to the VBO, so a warm start is a memory map and a
+ * few memcpys rather than a full parse.
+ *
+ * Entries are keyed by the DOF's path, modification time and size, anything else
+ * is treated as a miss and the entry gets rewritten.
+ *
+ * DOFs are loaded on worker threads, so this only reports problems on cout (the
+ * Logger isn't thread safe) and the counters are kept behind a mutex.
+ *
+ * Format (all little-endian):
+ *  header: "RGC1", int version, int options, int64 mtime, int64 size, string path,
+ *          int nMats, int nGeobs
+ *  geob:   int material, int nIndices, int nVertices, int nNormals,
+ *          int nTextureCoords, int nBursts, float boundingBox[6],
+ *          int burstStarts[nBursts], int burstsCount[nBursts],
+ *          int burstsMaterials[nBursts], unsigned short indices[nIndices]
+ *          (padded to 4 bytes), float vertexData[nVertices][GEOB_VERTEX_SIZE],
+ *          int nLods, int lodCounts[nLods], float lodErrors[nLods],
+ *          unsigned short lodIndices[sum of lodCounts] (padded to 4 bytes)
+ */
+#pragma once
+
+#include "dof.h"
+
+#include <string>
+#include <pthread.h>
+
+class GeometryCache {
+    public:
+        // Where the cache files live, an empty path disables the cache
+        static std::string cachePath;
+
+        // Load the geobs for the DOF at dofPath into geobs. Returns false (leaving
+        // geobs empty) if there is no valid entry
+        static bool read(const std::string & dofPath, Dof * dof, int nMats,
+                boost::ptr_list<Geob> & geobs);
+
+        // Write an entry for the DOF at dofPath
+        static void write(const std::string & dofPath, int nMats,
+                boost::ptr_list<Geob> & geobs);
+
+        // Bump this whenever the layout or the processing of the geometry changes
+        static const int version;
+
+        // Counters for reporting how well the cache is doing
+        static int hits;
+        static int misses;
+
+    private:
+        // Bump hits or misses
+        static void _count(bool hit);
+        static pthread_mutex_t _countMutex;
+
+        // The file an entry for dofPath is kept in
+        static std::string _entryPath(const std::string & dofPath);
+
+        // Load options that change the cached geometry, entries written with
+        // different options are misses
+        static int _options();
+};
@@ -2,6 +2,7 @@
 #include "logger.h"
 
 #include <math.h>
+#include <string.h>
 #include <iostream>
 #include <SDL/SDL_image.h>
 
@@ -233,6 +234,39 @@ bool normaliseVector(float * a) {
     return true;
 }
 
+unsigned short floatToHalf(float value) {
+    unsigned int bits;
+    memcpy(&bits, &value, sizeof(float));
+
+    unsigned short sign = (bits >> 16) & 0x8000;
+    int exponent = ((bits >> 23) & 0xff) - 127 + 15;
+    unsigned int mantissa = bits & 0x7fffff;
+
+    // NaN and infinity
+    if (((bits >> 23) & 0xff) == 0xff) {
+        return sign | 0x7c00 | (mantissa ? 0x200 : 0);
+    }
+    // Too big, clamp to infinity
+    if (exponent >= 31) {
+        return sign | 0x7c00;
+    }
+    // Too small for a normal half, make it denormal (or zero)
+    if (exponent <= 0) {
+        if (exponent < -10) return sign;
+        mantissa |= 0x800000;
+        int shift = 14 - exponent;
+        unsigned int half = mantissa >> shift;
+        // Round to nearest
+        if ((mantissa >> (shift - 1)) & 1) ++half;
+        return sign | half;
+    }
+
+    unsigned int half = sign | (exponent << 10) | (mantissa >> 13);
+    // Round to nearest, a carry out of the mantissa correctly bumps the exponent
+    if (mantissa & 0x1000) ++half;
+    return half;
+}
+
 void printVector(float * a) {
     cout << "{ " << a[0] << ", " << a[1] << ", " << a[2] << "}" << endl;
 }
@@ -50,6 +50,9 @@ bool colorCopy4(float * from, float * to);
 
 void printVector(float * a);
 
+// Convert a float to an IEEE half float, rounding to nearest
+unsigned short floatToHalf(float value);
+
 // calculate the vector from the origin that is perpendicular to the vector of a force
 // passing through a point
 Vector momentDistance(Vector & a, Vector & vector, Vector & cog);
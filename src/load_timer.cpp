@@ -0,0 +1,39 @@
+#include "load_timer.h"
+
+#include <time.h>
+#include <iomanip>
+#include <sstream>
+
+map<string, double> LoadTimer::phases;
+pthread_mutex_t LoadTimer::_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+double LoadTimer::now() {
+    timespec time;
+    clock_gettime(CLOCK_MONOTONIC, &time);
+    return time.tv_sec * 1000.0 + time.tv_nsec / 1000000.0;
+}
+
+void LoadTimer::add(const string & phase, double milliseconds) {
+    pthread_mutex_lock(&LoadTimer::_mutex);
+    LoadTimer::phases[phase] += milliseconds;
+    pthread_mutex_unlock(&LoadTimer::_mutex);
+}
+
+void LoadTimer::reset() {
+    pthread_mutex_lock(&LoadTimer::_mutex);
+    LoadTimer::phases.clear();
+    pthread_mutex_unlock(&LoadTimer::_mutex);
+}
+
+void LoadTimer::report(ostream & out) {
+    pthread_mutex_lock(&LoadTimer::_mutex);
+    map<string, double>::iterator it;
+    for (it = LoadTimer::phases.begin(); it != LoadTimer::phases.end(); ++it) {
+        // Format separately so we don't leave fixed set on the stream
+        stringstream line;
+        line << "  " << it->first << ": " << fixed << setprecision(1) << it->second 
+            << " ms";
+        out << line.str() << endl;
+    }
+    pthread_mutex_unlock(&LoadTimer::_mutex);
+}
@@ -0,0 +1,35 @@
+/**
+ * Accumulate the time spent in the different phases of loading (parsing, texture
+ * decoding, uploading etc) so the loaders can report where the time goes. Times
+ * added from the worker threads are summed, so a phase can add up to more than the
+ * wall clock time of the load.
+ */
+#pragma once
+
+#include <map>
+#include <string>
+#include <ostream>
+#include <pthread.h>
+
+using namespace std;
+
+class LoadTimer {
+    public:
+        // A monotonic timestamp in milliseconds
+        static double now();
+
+        // Add some time to a phase, safe to call from any thread
+        static void add(const string & phase, double milliseconds);
+
+        // Clear all the phases
+        static void reset();
+
+        // Write out each phase on its own line
+        static void report(ostream & out);
+
+        // Total milliseconds for each phase
+        static map<string, double> phases;
+
+    private:
+        static pthread_mutex_t _mutex;
+};
@@ -26,6 +26,13 @@
 #include "track.h"
 #include "frustum_culler.h"
 #include "logger.h"
+#include "mesh_optimiser.h"
+#include "mesh_simplifier.h"
+#include "render_queue.h"
+#include "texture.h"
+#include "texture_cache.h"
+#include "mipmap_generator.h"
+#include "texture_atlas.h"
 
 using namespace std;
 
@@ -34,6 +41,8 @@ static Camera * camera;
 static Hud * hud;
 static SDL_Surface * drawContext;
 static Track * track;
+// Everything drawn in a frame goes through this
+static RenderQueue renderQueue;
 static pthread_t carUpdateThread;
 
 static int screenWidth = 800;
@@ -69,6 +78,9 @@ void init(void) {
 
     setupLighting();
 
+    // Stands in for the textures that are still being decoded
+    Texture::createPlaceholder();
+
     srand(clock());
 
 }
@@ -83,6 +95,85 @@ void checkExtensions() {
         cout << "GL_ARB_multitexture not available" << endl;
         exit(1);
     }
+
+    // Half float texture coordinates are optional, fall back to floats
+    if (Geob::vertexFormat & VERTEX_HALF_TEXTURE_COORDS &&
+            strstr(extensions, "GL_ARB_half_float_vertex") == NULL) {
+        cout << "GL_ARB_half_float_vertex not available, using float texture coordinates" 
+            << endl;
+        Geob::vertexFormat &= ~VERTEX_HALF_TEXTURE_COORDS;
+    }
+
+    // So is keeping the textures compressed
+    if (TextureCache::compress &&
+            strstr(extensions, "GL_EXT_texture_compression_s3tc") == NULL) {
+        cout << "GL_EXT_texture_compression_s3tc not available, textures won't be compressed"
+            << endl;
+        TextureCache::compress = false;
+    }
+}
+
+void parseArguments(int argc, char ** argv) {
+    for (int i = 1; i < argc; ++i) {
+        string argument(argv[i]);
+
+        // Pick the vertex encodings, so their effect on the frame rate can be measured
+        if (argument == "--short-positions") {
+            Geob::vertexFormat |= VERTEX_SHORT_POSITIONS;
+        } else if (argument == "--byte-normals") {
+            Geob::vertexFormat |= VERTEX_BYTE_NORMALS;
+        } else if (argument == "--half-texture-coords") {
+            Geob::vertexFormat |= VERTEX_HALF_TEXTURE_COORDS;
+        } else if (argument == "--compact-vertices") {
+            Geob::vertexFormat |= VERTEX_SHORT_POSITIONS | VERTEX_BYTE_NORMALS 
+                | VERTEX_HALF_TEXTURE_COORDS;
+        } else if (argument == "--optimise-meshes") {
+            MeshOptimiser::enabled = true;
+        } else if (argument == "--static-batching") {
+            StaticBatcher::enabled = true;
+        } else if (argument == "--occlusion-culling") {
+            OcclusionCuller::enabled = true;
+        } else if (argument.find("--occluder-size=") == 0) {
+            // Geobs this many metres across and high hide what's behind them, 0 for
+            // only the dofs flagged in geometry.ini
+            OcclusionCuller::occluderSize = atof(argument.substr(16).c_str());
+        } else if (argument.find("--occlusion-threads=") == 0) {
+            OcclusionCuller::threads = atoi(argument.substr(20).c_str());
+        } else if (argument == "--lod") {
+            MeshSimplifier::enabled = true;
+        } else if (argument.find("--lod-error=") == 0) {
+            // How many pixels a simplified geob can be out before a finer one is used
+            MeshSimplifier::maxScreenError = atof(argument.substr(12).c_str());
+        } else if (argument == "--visibility-sets") {
+            // Made with raceya-pvsgen
+            VisibilitySets::enabled = true;
+        } else if (argument.find("--stream=") == 0) {
+            // Stream the track scenery within this many metres of the car
+            Track::streaming = true;
+            TrackStreamer::radius = atof(argument.substr(9).c_str());
+        } else if (argument.find("--stream-budget=") == 0) {
+            // .. keeping at most this many megabytes of it loaded
+            TrackStreamer::budget = atol(argument.substr(16).c_str()) * 1024 * 1024;
+        } else if (argument == "--async-textures") {
+            // Decode the textures in the background, drawing with a placeholder until
+            // they're ready
+            Texture::asyncDecode = true;
+        } else if (argument.find("--texture-upload-time=") == 0) {
+            // .. and spend at most this many milliseconds a frame uploading them
+            Texture::uploadTime = atof(argument.substr(22).c_str());
+        } else if (argument == "--compress-textures") {
+            // Keep the textures S3TC compressed, in the texture cache and on the GPU
+            TextureCache::compress = true;
+        } else if (argument == "--texture-atlas") {
+            // Pack the small track textures into a few big ones
+            TextureAtlas::enabled = true;
+        } else if (argument == "--gamma-correct-mipmaps") {
+            // Average the mipmaps in linear space
+            MipmapGenerator::gammaCorrect = true;
+        } else {
+            cout << "Unknown argument: " << argument << endl;
+        }
+    }
 }
 
 void setupLighting() {
@@ -137,14 +228,20 @@ void display(void) {
 
     ViewFrustumCulling::culler->refreshMatrices();
 
+    // Put up some more of the textures that have been decoded in the background
+    if (Texture::asyncDecode) Texture::uploadPending();
+
+    track->update(car->getPosition());
+
     // Reset the openGL state
     OpenGLState::global.reset();
 
-    track->render();
-
-    // Draw the car, this needs to be after track, because we can sometime see through
-    // the window
-    car->render();
+    // Everything goes through the one queue, so the car's windows are sorted by depth
+    // along with the transparent bits of the track
+    renderQueue.clear();
+    track->submit(renderQueue);
+    car->submit(renderQueue);
+    renderQueue.execute();
 
     // Render the HUD
     // Alpha blending is still messed up here. Not sure why, 
@@ -179,6 +276,8 @@ void handleKeyboard() {
 }
 
 int main(int argc, char** argv) {
+    parseArguments(argc, argv);
+
     int error = SDL_Init(SDL_INIT_EVERYTHING);
 
     // Initialise the TTF library
@@ -210,6 +309,7 @@ int main(int argc, char** argv) {
     std::cout << "GL Error: " << glGetError() << std::endl;
 
     reshape(screenWidth, screenHeight);
+    MeshSimplifier::screenHeight = screenHeight;
 
     // Check that we have all the extensions we need
     checkExtensions();
@@ -0,0 +1,249 @@
+#include "mesh_instancer.h"
+#include "lib.h"
+
+#include <math.h>
+#include <boost/foreach.hpp>
+#include <boost/functional/hash.hpp>
+
+using namespace std;
+
+// How far apart two vertices can be and still be the same. This is well under
+// anything you could see but allows for the rounding from the objects being moved
+#define INSTANCE_POSITION_TOLERANCE 0.001f
+#define INSTANCE_NORMAL_TOLERANCE 0.001f
+#define INSTANCE_ATTRIBUTE_TOLERANCE 0.0001f
+// The edges used to work out how a copy has been turned have to be at least this
+// long, so the rotation is accurate
+#define INSTANCE_FRAME_LENGTH 0.01f
+
+MeshInstancer::MeshInstancer() {
+    this->nInstances = 0;
+    this->savedBytes = 0;
+}
+
+size_t MeshInstancer::_hash(Geob & geob) {
+    size_t seed = 0;
+    boost::hash_combine(seed, geob.nVertices);
+    boost::hash_combine(seed, geob.nIndices);
+    boost::hash_combine(seed, geob.nNormals);
+    boost::hash_combine(seed, geob.nTextureCoords);
+    for (int i = 0; i < geob.nIndices; ++i) {
+        boost::hash_combine(seed, geob.indices[i]);
+    }
+    for (unsigned int i = 0; i < geob.nTextureCoords; ++i) {
+        for (int j = 0; j < 2; ++j) {
+            boost::hash_combine(seed, (long)floorf(geob.textureCoords[i][j] * 1000 + 0.5f));
+        }
+    }
+
+    // The distance of each vertex from the first one doesn't change however the geob
+    // has been moved or turned. These are rounded, so copies that round differently
+    // are missed, which only costs us the sharing
+    float distance[3];
+    for (unsigned int i = 1; i < geob.nVertices; ++i) {
+        vertexSub(geob.vertices[i], geob.vertices[0], distance);
+        boost::hash_combine(seed, (long)floorf(vectorLength(distance) * 100 + 0.5f));
+    }
+    return seed;
+}
+
+// Build an orthonormal frame (as the columns of frame) from the triangle a, b, c
+static void triangleFrame(float * a, float * b, float * c, float frame[3][3]) {
+    float ab[3], ac[3], x[3], y[3], z[3];
+    vertexSub(b, a, ab);
+    vertexSub(c, a, ac);
+    vertexCopy(ab, x);
+    normaliseVector(x);
+    crossProduct(ab, ac, z);
+    normaliseVector(z);
+    crossProduct(z, x, y);
+    for (int i = 0; i < 3; ++i) {
+        frame[i][0] = x[i];
+        frame[i][1] = y[i];
+        frame[i][2] = z[i];
+    }
+}
+
+// Rotate vector by the 3x3 rotation
+static void rotate(float rotation[3][3], float * vector, float * result) {
+    for (int i = 0; i < 3; ++i) {
+        result[i] = rotation[i][0] * vector[0] + rotation[i][1] * vector[1] 
+            + rotation[i][2] * vector[2];
+    }
+}
+
+bool MeshInstancer::_matches(Geob & geob, Geob & mesh, float * transform) {
+    if (geob.nVertices != mesh.nVertices || geob.nIndices != mesh.nIndices
+            || geob.nNormals != mesh.nNormals
+            || geob.nTextureCoords != mesh.nTextureCoords
+            || geob.nBursts != mesh.nBursts
+            // Texgen materials keep float positions, so the buffers could differ
+            || geob.format != mesh.format) {
+        return false;
+    }
+
+    if (memcmp(geob.indices, mesh.indices, geob.nIndices * sizeof(unsigned short)) != 0
+            || memcmp(geob.burstStarts, mesh.burstStarts, geob.nBursts * sizeof(int)) != 0
+            || memcmp(geob.burstsCount, mesh.burstsCount, geob.nBursts * sizeof(int)) != 0) {
+        return false;
+    }
+
+    for (unsigned int i = 0; i < geob.nTextureCoords; ++i) {
+        for (int j = 0; j < 2; ++j) {
+            if (fabsf(geob.textureCoords[i][j] - mesh.textureCoords[i][j])
+                    > INSTANCE_ATTRIBUTE_TOLERANCE) {
+                return false;
+            }
+        }
+    }
+
+    // Work out the rotation from a triangle of vertices that aren't in a line. If
+    // there isn't one the geob is flat enough that moving it is all we can do
+    float rotation[3][3] = { { 1, 0, 0 }, { 0, 1, 0 }, { 0, 0, 1 } };
+    float ab[3], ac[3], normal[3];
+    unsigned int b = 0;
+    for (unsigned int i = 1; i < mesh.nVertices && b == 0; ++i) {
+        vertexSub(mesh.vertices[i], mesh.vertices[0], ab);
+        if (vectorLength(ab) > INSTANCE_FRAME_LENGTH) b = i;
+    }
+    for (unsigned int i = 1; i < mesh.nVertices && b > 0; ++i) {
+        vertexSub(mesh.vertices[i], mesh.vertices[0], ac);
+        crossProduct(ab, ac, normal);
+        if (vectorLength(normal) > INSTANCE_FRAME_LENGTH * vectorLength(ac)) {
+            float meshFrame[3][3], geobFrame[3][3];
+            triangleFrame(mesh.vertices[0], mesh.vertices[b], mesh.vertices[i], meshFrame);
+            triangleFrame(geob.vertices[0], geob.vertices[b], geob.vertices[i], geobFrame);
+
+            // The frames are orthonormal so the inverse of meshFrame is its transpose
+            for (int j = 0; j < 3; ++j) {
+                for (int k = 0; k < 3; ++k) {
+                    rotation[j][k] = geobFrame[j][0] * meshFrame[k][0]
+                        + geobFrame[j][1] * meshFrame[k][1]
+                        + geobFrame[j][2] * meshFrame[k][2];
+                }
+            }
+            break;
+        }
+    }
+
+    float offset[3], moved[3];
+    rotate(rotation, mesh.vertices[0], moved);
+    vertexSub(geob.vertices[0], moved, offset);
+
+    // Check everything really does line up
+    for (unsigned int i = 0; i < geob.nVertices; ++i) {
+        rotate(rotation, mesh.vertices[i], moved);
+        for (int j = 0; j < 3; ++j) {
+            if (fabsf(moved[j] + offset[j] - geob.vertices[i][j])
+                    > INSTANCE_POSITION_TOLERANCE) {
+                return false;
+            }
+        }
+    }
+    for (unsigned int i = 0; i < geob.nNormals; ++i) {
+        rotate(rotation, mesh.normals[i], moved);
+        for (int j = 0; j < 3; ++j) {
+            if (fabsf(moved[j] - geob.normals[i][j]) > INSTANCE_NORMAL_TOLERANCE) {
+                return false;
+            }
+        }
+    }
+
+    // OpenGL matrices are column major
+    for (int j = 0; j < 3; ++j) {
+        for (int k = 0; k < 3; ++k) {
+            transform[k * 4 + j] = rotation[j][k];
+        }
+        transform[j * 4 + 3] = 0;
+        transform[12 + j] = offset[j];
+    }
+    transform[15] = 1;
+    return true;
+}
+
+void * MeshInstancer::_materialKey(Geob & geob) {
+    if (geob.material >= geob.dof->getMats().size()) return NULL;
+    Mat & mat = geob.dof->getMats()[geob.material];
+
+    // Transparent geobs have to be drawn in order and the sky has its own projection,
+    // so these are left to the dofs
+    if (mat.isTransparent()) return NULL;
+    if (mat.shader != NULL && mat.shader->isSky) return NULL;
+    return mat.getStateKey();
+}
+
+void MeshInstancer::_addToBatch(Geob & geob, Geob & mesh) {
+    void * key = MeshInstancer::_materialKey(geob);
+    if (key == NULL) return;
+
+    Batch * batch;
+    pair<Geob *, void *> index(&mesh, key);
+    if (this->_batchIndex.count(index) > 0) {
+        batch = this->_batchIndex[index];
+    } else {
+        batch = new Batch();
+        batch->mesh = &mesh;
+        batch->mat = &geob.dof->getMats()[geob.material];
+        this->_batches.push_back(batch);
+        this->_batchIndex[index] = batch;
+
+        // The original goes in too if it looks the same
+        if (!mesh.batched && MeshInstancer::_materialKey(mesh) == key) {
+            mesh.batched = true;
+            batch->geobs.push_back(&mesh);
+        }
+    }
+
+    geob.batched = true;
+    batch->geobs.push_back(&geob);
+}
+
+void MeshInstancer::add(Dof & dof) {
+    int stride, normalOffset, textureOffset;
+
+    BOOST_FOREACH(Geob & geob, dof.getGeobs()) {
+        if (geob.nVertices == 0 || geob.nIndices == 0) continue;
+        // These don't get any buffers to share
+        if (geob.material >= dof.getMats().size()) continue;
+
+        size_t hash = MeshInstancer::_hash(geob);
+        float transform[16];
+        Geob * mesh = NULL;
+
+        pair<multimap<size_t, Geob *>::iterator, multimap<size_t, Geob *>::iterator>
+            range = this->_meshes.equal_range(hash);
+        for (multimap<size_t, Geob *>::iterator it = range.first; it != range.second; ++it) {
+            if (MeshInstancer::_matches(geob, *it->second, transform)) {
+                mesh = it->second;
+                break;
+            }
+        }
+
+        // A new shape, this one keeps its own buffers
+        if (mesh == NULL) {
+            this->_meshes.insert(make_pair(hash, &geob));
+            continue;
+        }
+
+        geob.instanceOf = mesh;
+        memcpy(geob.instanceTransform, transform, sizeof(transform));
+        this->_addToBatch(geob, *mesh);
+
+        ++this->nInstances;
+        Geob::vertexLayout(geob.format, stride, normalOffset, textureOffset);
+        this->savedBytes += geob.nVertices * stride
+            + geob.nIndices * sizeof(unsigned short);
+    }
+}
+
+void MeshInstancer::getItems(vector<RenderItem> & items) {
+    BOOST_FOREACH(Batch & batch, this->_batches) {
+        BOOST_FOREACH(Geob * geob, batch.geobs) {
+            items.push_back(RenderItem(RENDER_PASS_OPAQUE, *geob, *batch.mat));
+        }
+    }
+}
+
+int MeshInstancer::getNBatches() {
+    return this->_batches.size();
+}
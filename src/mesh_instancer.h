@@ -0,0 +1,70 @@
+/**
+ * Finds geobs that are copies of each other and shares their buffers. Tracks are
+ * full of the same object placed over and over (billboards, buildings, lamp posts)
+ * and as the DOF vertices are in world space each copy normally gets its own VBOs.
+ *
+ * Geobs are matched on their shape, so a copy that has been moved or turned is
+ * still found. A copy draws with the original's buffers and a transform. Opaque
+ * copies with the same material are grouped into batches, which go into the render
+ * queue together so the material and buffers are set up once for all of them.
+ *
+ * The renderer is fixed function so there is no hardware instancing, each copy is
+ * still a draw call of its own.
+ */
+#pragma once
+
+#include "dof.h"
+#include "render_queue.h"
+
+#include <map>
+#include <vector>
+#include <boost/ptr_container/ptr_vector.hpp>
+
+class MeshInstancer {
+    public:
+        MeshInstancer();
+
+        // Look for copies of geobs we have already seen in the dof. This has to be
+        // called before the dof is uploaded so the copies don't get buffers
+        void add(Dof & dof);
+
+        // Add the copies in the batches to items, they're culled by the track
+        void getItems(std::vector<RenderItem> & items);
+
+        // Geobs that share another geob's buffers
+        int nInstances;
+        // VBO memory that didn't need to be allocated
+        long savedBytes;
+
+        int getNBatches();
+
+    private:
+        // Copies of one geob with one material
+        class Batch {
+            public:
+                Geob * mesh;
+                Mat * mat;
+                std::vector<Geob *> geobs;
+        };
+
+        // The geobs with their own buffers, by _hash
+        std::multimap<size_t, Geob *> _meshes;
+
+        boost::ptr_vector<Batch> _batches;
+        // Batches by mesh and _materialKey
+        std::map<std::pair<Geob *, void *>, Batch *> _batchIndex;
+
+        // Hash the shape of the geob, it's the same however the geob has been moved
+        static size_t _hash(Geob & geob);
+
+        // Check if geob is a copy of mesh, if it is transform is set to the OpenGL
+        // matrix that moves mesh onto geob
+        static bool _matches(Geob & geob, Geob & mesh, float * transform);
+
+        // Geobs with the same key load the same OpenGL state, NULL if they can't be
+        // batched
+        static void * _materialKey(Geob & geob);
+
+        // Put geob in the batch for mesh and its material
+        void _addToBatch(Geob & geob, Geob & mesh);
+};
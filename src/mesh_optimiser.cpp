@@ -0,0 +1,266 @@
+#include "mesh_optimiser.h"
+
+#include <math.h>
+#include <string.h>
+#include <vector>
+
+using namespace std;
+
+bool MeshOptimiser::enabled = false;
+long MeshOptimiser::triangles = 0;
+long MeshOptimiser::transformsBefore = 0;
+long MeshOptimiser::transformsAfter = 0;
+pthread_mutex_t MeshOptimiser::_countMutex = PTHREAD_MUTEX_INITIALIZER;
+
+// The scoring constants from Forsyth's article. The cache being modelled is bigger
+// than the one acmr() measures with, that works out better on real hardware
+#define FORSYTH_CACHE_SIZE 32
+#define FORSYTH_CACHE_DECAY_POWER 1.5f
+#define FORSYTH_LAST_TRIANGLE_SCORE 0.75f
+#define FORSYTH_VALENCE_BOOST_SCALE 2.0f
+#define FORSYTH_VALENCE_BOOST_POWER 0.5f
+
+// How much we want to use a vertex next, based on where it is in the cache and how
+// many triangles still need it
+static float vertexScore(int cachePosition, int remainingTriangles) {
+    if (remainingTriangles == 0) return -1;
+
+    float score = 0;
+    if (cachePosition >= 0) {
+        if (cachePosition < 3) {
+            // The vertices of the last triangle get a fixed score so we don't just
+            // strip along the same edge
+            score = FORSYTH_LAST_TRIANGLE_SCORE;
+        } else {
+            score = powf(1.0f - (float)(cachePosition - 3) / (FORSYTH_CACHE_SIZE - 3),
+                    FORSYTH_CACHE_DECAY_POWER);
+        }
+    }
+
+    // Boost vertices with few triangles left so we don't leave lonely triangles
+    // behind to be picked up later
+    score += FORSYTH_VALENCE_BOOST_SCALE *
+        powf((float)remainingTriangles, -FORSYTH_VALENCE_BOOST_POWER);
+    return score;
+}
+
+void MeshOptimiser::optimiseTriangles(unsigned short * indices, int nIndices,
+        int nVertices) {
+    int nTriangles = nIndices / 3;
+    if (nTriangles < 2) return;
+
+    // Build the triangle lists for each vertex
+    vector<int> remaining(nVertices, 0);
+    for (int i = 0; i < nTriangles * 3; ++i) {
+        ++remaining[indices[i]];
+    }
+    vector<int> firstTriangle(nVertices + 1, 0);
+    for (int v = 0; v < nVertices; ++v) {
+        firstTriangle[v + 1] = firstTriangle[v] + remaining[v];
+    }
+    vector<int> vertexTriangles(nTriangles * 3);
+    vector<int> filled(nVertices, 0);
+    for (int t = 0; t < nTriangles; ++t) {
+        for (int k = 0; k < 3; ++k) {
+            int v = indices[t * 3 + k];
+            vertexTriangles[firstTriangle[v] + filled[v]++] = t;
+        }
+    }
+
+    vector<int> cachePosition(nVertices, -1);
+    vector<float> score(nVertices);
+    for (int v = 0; v < nVertices; ++v) {
+        score[v] = vertexScore(-1, remaining[v]);
+    }
+
+    vector<float> triangleScore(nTriangles);
+    vector<bool> added(nTriangles, false);
+    for (int t = 0; t < nTriangles; ++t) {
+        triangleScore[t] = score[indices[t * 3]] + score[indices[t * 3 + 1]]
+            + score[indices[t * 3 + 2]];
+    }
+
+    // The cache is kept as a list in LRU order, with room for the 3 new vertices to
+    // push the old ones off the end
+    int cache[FORSYTH_CACHE_SIZE + 3];
+    int cacheSize = 0;
+
+    vector<unsigned short> result(nTriangles * 3);
+    int bestTriangle = -1;
+    int scanFrom = 0;
+
+    for (int n = 0; n < nTriangles; ++n) {
+        // If nothing in the cache is any use find the next triangle that hasn't been
+        // added. This only happens when we move on to a new bit of the mesh
+        if (bestTriangle < 0) {
+            while (added[scanFrom]) ++scanFrom;
+            bestTriangle = scanFrom;
+        }
+
+        // Add the triangle
+        added[bestTriangle] = true;
+        int newCache[FORSYTH_CACHE_SIZE + 3];
+        int newCacheSize = 0;
+        for (int k = 0; k < 3; ++k) {
+            int v = indices[bestTriangle * 3 + k];
+            result[n * 3 + k] = v;
+            --remaining[v];
+
+            // Take it out of the vertex's list of triangles
+            int * list = &vertexTriangles[firstTriangle[v]];
+            for (int j = 0; j <= remaining[v]; ++j) {
+                if (list[j] == bestTriangle) {
+                    list[j] = list[remaining[v]];
+                    break;
+                }
+            }
+
+            // .. and put it at the front of the cache
+            bool duplicate = false;
+            for (int j = 0; j < newCacheSize; ++j) {
+                if (newCache[j] == v) duplicate = true;
+            }
+            if (!duplicate) newCache[newCacheSize++] = v;
+        }
+
+        // Everything else moves back
+        for (int j = 0; j < cacheSize; ++j) {
+            int v = cache[j];
+            if (v != newCache[0] && (newCacheSize < 2 || v != newCache[1])
+                    && (newCacheSize < 3 || v != newCache[2])) {
+                newCache[newCacheSize++] = v;
+            }
+        }
+
+        // Rescore the vertices in the cache, and anything that has just fallen out
+        for (int j = 0; j < newCacheSize; ++j) {
+            int v = newCache[j];
+            cachePosition[v] = j < FORSYTH_CACHE_SIZE ? j : -1;
+            score[v] = vertexScore(cachePosition[v], remaining[v]);
+        }
+        cacheSize = min(newCacheSize, FORSYTH_CACHE_SIZE);
+        memcpy(cache, newCache, cacheSize * sizeof(int));
+
+        // Rescore their triangles and pick the best one for next time
+        float bestScore = -1;
+        bestTriangle = -1;
+        for (int j = 0; j < cacheSize; ++j) {
+            int v = cache[j];
+            for (int i = 0; i < remaining[v]; ++i) {
+                int t = vertexTriangles[firstTriangle[v] + i];
+                triangleScore[t] = score[indices[t * 3]] + score[indices[t * 3 + 1]]
+                    + score[indices[t * 3 + 2]];
+                if (triangleScore[t] > bestScore) {
+                    bestScore = triangleScore[t];
+                    bestTriangle = t;
+                }
+            }
+        }
+    }
+
+    memcpy(indices, &result[0], nTriangles * 3 * sizeof(unsigned short));
+}
+
+bool MeshOptimiser::vertexOrder(const unsigned short * indices, int nIndices,
+        int nVertices, int * remap) {
+    int next = 0;
+    bool moved = false;
+
+    for (int v = 0; v < nVertices; ++v) {
+        remap[v] = -1;
+    }
+    for (int i = 0; i < nIndices; ++i) {
+        if (remap[indices[i]] < 0) {
+            if (indices[i] != next) moved = true;
+            remap[indices[i]] = next++;
+        }
+    }
+    // Keep any unused vertices, something else might be looking at them
+    for (int v = 0; v < nVertices; ++v) {
+        if (remap[v] < 0) {
+            if (v != next) moved = true;
+            remap[v] = next++;
+        }
+    }
+    return moved;
+}
+
+float MeshOptimiser::acmr(const unsigned short * indices, int nIndices, int cacheSize) {
+    int nTriangles = nIndices / 3;
+    if (nTriangles == 0) return 0;
+
+    // Simulate a FIFO cache, a hit doesn't change the order
+    vector<int> fifo(cacheSize, -1);
+    int head = 0;
+    int misses = 0;
+    for (int i = 0; i < nTriangles * 3; ++i) {
+        bool hit = false;
+        for (int j = 0; j < cacheSize; ++j) {
+            if (fifo[j] == indices[i]) {
+                hit = true;
+                break;
+            }
+        }
+        if (!hit) {
+            fifo[head] = indices[i];
+            head = (head + 1) % cacheSize;
+            ++misses;
+        }
+    }
+    return (float)misses / nTriangles;
+}
+
+// Apply a vertex remapping to one of the geob's vertex arrays
+template <class T> static void remapArray(T * array, const int * remap, int count) {
+    if (count == 0) return;
+    T * copy = new T[count];
+    memcpy(copy, array, count * sizeof(T));
+    for (int i = 0; i < count; ++i) {
+        memcpy(array[remap[i]], copy[i], sizeof(T));
+    }
+    delete[] copy;
+}
+
+void MeshOptimiser::optimise(Geob & geob) {
+    if (geob.nIndices < 6 || geob.nVertices == 0) return;
+
+    float before = MeshOptimiser::acmr(geob.indices, geob.nIndices);
+
+    // Triangles can't move between bursts, so each one is done on its own
+    if (geob.nBursts == 0) {
+        MeshOptimiser::optimiseTriangles(geob.indices, geob.nIndices, geob.nVertices);
+    }
+    for (int j = 0; j < geob.nBursts; ++j) {
+        int start = geob.burstStarts[j] / 3;
+        int end = min(start + geob.burstsCount[j] / 3, geob.nIndices);
+        if (start < 0 || start >= end) continue;
+        MeshOptimiser::optimiseTriangles(geob.indices + start, end - start,
+                geob.nVertices);
+    }
+
+    // The vertices can only be moved if all the arrays line up
+    if ((geob.nNormals == 0 || geob.nNormals == geob.nVertices)
+            && (geob.nTextureCoords == 0 || geob.nTextureCoords == geob.nVertices)) {
+        vector<int> remap(geob.nVertices);
+        if (MeshOptimiser::vertexOrder(geob.indices, geob.nIndices, geob.nVertices,
+                    &remap[0])) {
+            for (int i = 0; i < geob.nIndices; ++i) {
+                geob.indices[i] = remap[geob.indices[i]];
+            }
+            remapArray(geob.vertices, &remap[0], geob.nVertices);
+            remapArray(geob.normals, &remap[0], geob.nNormals);
+            remapArray(geob.textureCoords, &remap[0], geob.nTextureCoords);
+        }
+    }
+
+    MeshOptimiser::_count(geob.nIndices / 3, before,
+            MeshOptimiser::acmr(geob.indices, geob.nIndices));
+}
+
+void MeshOptimiser::_count(int nTriangles, float before, float after) {
+    pthread_mutex_lock(&MeshOptimiser::_countMutex);
+    MeshOptimiser::triangles += nTriangles;
+    MeshOptimiser::transformsBefore += (long)(before * nTriangles + 0.5f);
+    MeshOptimiser::transformsAfter += (long)(after * nTriangles + 0.5f);
+    pthread_mutex_unlock(&MeshOptimiser::_countMutex);
+}
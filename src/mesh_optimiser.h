@@ -0,0 +1,52 @@
+/**
+ * Load time optimisation of the geob index buffers. The DOF exporters write the
+ * triangles in whatever order the modeller left them, which thrashes the post
+ * transform vertex cache. This reorders the triangles using Tom Forsyth's linear
+ * speed vertex cache optimisation, then renumbers the vertices in the order they are
+ * first used so the vertex fetches walk through the VBO.
+ *
+ * How well it is doing is measured as the average cache miss ratio (ACMR): vertices
+ * transformed per triangle. 3 is the worst case, 0.5 - 0.7 is about the best a
+ * regular mesh can get.
+ */
+#pragma once
+
+#include "dof.h"
+
+#include <pthread.h>
+
+class MeshOptimiser {
+    public:
+        // Turn the optimisation on, off by default
+        static bool enabled;
+
+        // Optimise the triangle and vertex order of the geob. Safe to call from the
+        // loader threads
+        static void optimise(Geob & geob);
+
+        // Reorder the triangles in indices for the vertex cache. The vertices are left
+        // where they are
+        static void optimiseTriangles(unsigned short * indices, int nIndices,
+                int nVertices);
+
+        // Work out the new position of each vertex so they are in the order they are
+        // first used in indices. Unused vertices go on the end. Returns false if there
+        // is nothing to move
+        static bool vertexOrder(const unsigned short * indices, int nIndices,
+                int nVertices, int * remap);
+
+        // Vertices transformed per triangle with a FIFO cache of cacheSize entries
+        static float acmr(const unsigned short * indices, int nIndices,
+                int cacheSize = 16);
+
+        // Totals for reporting, the ACMR over everything optimised is
+        // transformsBefore / triangles and transformsAfter / triangles
+        static long triangles;
+        static long transformsBefore;
+        static long transformsAfter;
+
+    private:
+        // Add a geob's figures to the totals
+        static void _count(int nTriangles, float before, float after);
+        static pthread_mutex_t _countMutex;
+};
@@ -0,0 +1,576 @@
+#include "mesh_simplifier.h"
+#include "mesh_optimiser.h"
+
+#include <math.h>
+#include <string.h>
+#include <map>
+#include <queue>
+#include <vector>
+#include <algorithm>
+
+using namespace std;
+
+bool MeshSimplifier::enabled = false;
+float MeshSimplifier::maxScreenError = 1;
+int MeshSimplifier::screenHeight = 600;
+int MeshSimplifier::geobs = 0;
+long MeshSimplifier::triangles = 0;
+long MeshSimplifier::lodTriangles[GEOB_MAX_LODS];
+pthread_mutex_t MeshSimplifier::_countMutex = PTHREAD_MUTEX_INITIALIZER;
+
+// Geobs with fewer triangles than this aren't worth simplifying
+#define SIMPLIFIER_MIN_TRIANGLES 128
+
+// A level has to lose at least this much of the one before to be kept
+#define SIMPLIFIER_MIN_REDUCTION 0.8
+
+// The error quadric of a vertex, the sum of the squared distances to the planes of
+// its triangles. Stored as the upper half of the symmetric 4x4 matrix
+class Quadric {
+    public:
+        Quadric() {
+            memset(this->q, 0, sizeof(this->q));
+        }
+
+        // Add the plane ax + by + cz + d = 0
+        void addPlane(double a, double b, double c, double d) {
+            q[0] += a * a; q[1] += a * b; q[2] += a * c; q[3] += a * d;
+            q[4] += b * b; q[5] += b * c; q[6] += b * d;
+            q[7] += c * c; q[8] += c * d;
+            q[9] += d * d;
+        }
+
+        void add(const Quadric & other) {
+            for (int i = 0; i < 10; ++i) {
+                this->q[i] += other.q[i];
+            }
+        }
+
+        // The error at p
+        double error(const float * p) const {
+            double x = p[0], y = p[1], z = p[2];
+            return q[0] * x * x + 2 * q[1] * x * y + 2 * q[2] * x * z + 2 * q[3] * x
+                + q[4] * y * y + 2 * q[5] * y * z + 2 * q[6] * y
+                + q[7] * z * z + 2 * q[8] * z
+                + q[9];
+        }
+
+        double q[10];
+};
+
+// A group of vertices that could be collapsed, the one with the lowest cost goes first
+class Collapse {
+    public:
+        Collapse(double cost, int group, int version)
+            : cost(cost), group(group), version(version) {}
+
+        bool operator<(const Collapse & other) const {
+            return this->cost > other.cost;
+        }
+
+        double cost;
+        int group;
+        // The collapse is out of date if the group has changed since
+        int version;
+};
+
+// For dropping removed triangles from a list
+class IsRemoved {
+    public:
+        IsRemoved(vector<bool> & removed) : removed(removed) {}
+
+        bool operator()(int triangle) {
+            return this->removed[triangle];
+        }
+
+        vector<bool> & removed;
+};
+
+// The unnormalised normal of the triangle
+static void triangleNormal(const float * a, const float * b, const float * c, double * normal) {
+    double u[3], v[3];
+    for (int i = 0; i < 3; ++i) {
+        u[i] = b[i] - a[i];
+        v[i] = c[i] - a[i];
+    }
+    normal[0] = u[1] * v[2] - u[2] * v[1];
+    normal[1] = u[2] * v[0] - u[0] * v[2];
+    normal[2] = u[0] * v[1] - u[1] * v[0];
+}
+
+// How far p is from the triangle abc
+static double triangleDistance(const float * p, const float * a, const float * b,
+        const float * c) {
+    double ab[3], ac[3], ap[3];
+    for (int i = 0; i < 3; ++i) {
+        ab[i] = b[i] - a[i];
+        ac[i] = c[i] - a[i];
+        ap[i] = p[i] - a[i];
+    }
+    double abab = ab[0] * ab[0] + ab[1] * ab[1] + ab[2] * ab[2];
+    double acac = ac[0] * ac[0] + ac[1] * ac[1] + ac[2] * ac[2];
+    double abac = ab[0] * ac[0] + ab[1] * ac[1] + ab[2] * ac[2];
+    double abap = ab[0] * ap[0] + ab[1] * ap[1] + ab[2] * ap[2];
+    double acap = ac[0] * ap[0] + ac[1] * ap[1] + ac[2] * ap[2];
+
+    // Straight down onto the triangle if that's inside it
+    double denominator = abab * acac - abac * abac;
+    if (denominator > 0) {
+        double u = (acac * abap - abac * acap) / denominator;
+        double v = (abab * acap - abac * abap) / denominator;
+        if (u >= 0 && v >= 0 && u + v <= 1) {
+            double distance = 0;
+            for (int i = 0; i < 3; ++i) {
+                double d = ap[i] - u * ab[i] - v * ac[i];
+                distance += d * d;
+            }
+            return sqrt(distance);
+        }
+    }
+
+    // Otherwise the nearest edge
+    const float * corners[4] = { a, b, c, a };
+    double nearest = -1;
+    for (int k = 0; k < 3; ++k) {
+        double edge[3], toP[3];
+        for (int i = 0; i < 3; ++i) {
+            edge[i] = corners[k + 1][i] - corners[k][i];
+            toP[i] = p[i] - corners[k][i];
+        }
+        double length = edge[0] * edge[0] + edge[1] * edge[1] + edge[2] * edge[2];
+        double along = length > 0
+            ? (edge[0] * toP[0] + edge[1] * toP[1] + edge[2] * toP[2]) / length : 0;
+        along = max(0.0, min(1.0, along));
+        double distance = 0;
+        for (int i = 0; i < 3; ++i) {
+            double d = toP[i] - along * edge[i];
+            distance += d * d;
+        }
+        if (nearest < 0 || distance < nearest) nearest = distance;
+    }
+    return sqrt(nearest);
+}
+
+// The working state of one geob being simplified. Vertices in the same place are
+// split wherever the texture coordinates or normals change, so the collapses are
+// worked out on the groups of vertices in each place. Moving a group moves each of
+// its vertices onto a vertex of the target group it shares an edge with, which is
+// on the same side of any seam
+class Simplification {
+    public:
+        Simplification(Geob & geob);
+
+        // Collapse groups until there are no more than target triangles left, or
+        // nothing else can go
+        void run(int target);
+
+        // How far the simplified mesh is from the original. Each place that's gone is
+        // measured against the triangles around where it went, which can only be
+        // further than the nearest part of the surface
+        double measure();
+
+        // The triangles that are left
+        void getIndices(vector<unsigned short> & indices);
+
+        int nTriangles;
+
+    private:
+        float (* _vertices)[3];
+        vector<int> _triangles;
+        vector<bool> _removed;
+        // The group of each vertex, and the vertices in each group
+        vector<int> _groups;
+        vector<vector<int> > _copies;
+        vector<Quadric> _quadrics;
+        vector<bool> _locked;
+        // The triangles each group is in, removed ones are skipped
+        vector<vector<int> > _groupTriangles;
+        vector<int> _versions;
+        priority_queue<Collapse> _queue;
+        // The group each group was moved onto, -1 if it's still there
+        vector<int> _movedTo;
+
+        // Work out the cheapest neighbour to move group onto, -1 if it can't move
+        int _bestTarget(int group, double & cost);
+
+        // Check moving group onto target doesn't flip any triangles or join up parts
+        // of the mesh that aren't next to each other, and find where each of its
+        // vertices goes
+        bool _canCollapse(int group, int target, map<int, int> & moves);
+
+        // Requeue a group after it or its neighbours have changed
+        void _update(int group);
+
+        // The neighbouring groups, from the group's triangles
+        void _neighbours(int group, vector<int> & neighbours);
+
+        bool _hasGroup(int triangle, int group);
+};
+
+Simplification::Simplification(Geob & geob) {
+    int nVertices = geob.nVertices;
+    this->_vertices = geob.vertices;
+
+    // Group the vertices by position
+    vector<pair<vector<float>, int> > positions(nVertices);
+    for (int v = 0; v < nVertices; ++v) {
+        positions[v].first.assign(geob.vertices[v], geob.vertices[v] + 3);
+        positions[v].second = v;
+    }
+    sort(positions.begin(), positions.end());
+    this->_groups.resize(nVertices);
+    for (int i = 0; i < nVertices; ++i) {
+        if (i == 0 || positions[i].first != positions[i - 1].first) {
+            this->_copies.push_back(vector<int>());
+        }
+        this->_groups[positions[i].second] = this->_copies.size() - 1;
+        this->_copies.back().push_back(positions[i].second);
+    }
+    int nGroups = this->_copies.size();
+    this->_quadrics.resize(nGroups);
+    this->_locked.assign(nGroups, false);
+    this->_groupTriangles.resize(nGroups);
+    this->_versions.assign(nGroups, 0);
+    this->_movedTo.assign(nGroups, -1);
+
+    // Only what the bursts cover gets drawn, the same as Geob::draw, so the levels
+    // can't show anything the geob doesn't
+    vector<pair<int, int> > bursts;
+    for (int j = 0; j < geob.nBursts; ++j) {
+        int start = max(geob.burstStarts[j] / 3, 0);
+        bursts.push_back(make_pair(start, min(start + geob.burstsCount[j] / 3,
+                        geob.nIndices)));
+    }
+    if (geob.nBursts == 0) bursts.push_back(make_pair(0, geob.nIndices));
+
+    // Leave out the triangles that point at missing vertices or are already flat
+    for (unsigned int j = 0; j < bursts.size(); ++j) {
+        for (int i = bursts[j].first; i + 2 < bursts[j].second; i += 3) {
+            int a = geob.indices[i], b = geob.indices[i + 1], c = geob.indices[i + 2];
+            if (a >= nVertices || b >= nVertices || c >= nVertices) continue;
+            int ga = this->_groups[a], gb = this->_groups[b], gc = this->_groups[c];
+            if (ga == gb || gb == gc || ga == gc) continue;
+            this->_triangles.push_back(a);
+            this->_triangles.push_back(b);
+            this->_triangles.push_back(c);
+        }
+    }
+    this->nTriangles = this->_triangles.size() / 3;
+    this->_removed.assign(this->nTriangles, false);
+
+    for (int t = 0; t < this->nTriangles; ++t) {
+        int * triangle = &this->_triangles[t * 3];
+        double normal[3];
+        triangleNormal(this->_vertices[triangle[0]], this->_vertices[triangle[1]],
+                this->_vertices[triangle[2]], normal);
+        double length = sqrt(normal[0] * normal[0] + normal[1] * normal[1]
+                + normal[2] * normal[2]);
+        if (length > 0) {
+            for (int j = 0; j < 3; ++j) normal[j] /= length;
+            const float * p = this->_vertices[triangle[0]];
+            double d = -(normal[0] * p[0] + normal[1] * p[1] + normal[2] * p[2]);
+            for (int k = 0; k < 3; ++k) {
+                this->_quadrics[this->_groups[triangle[k]]].addPlane(normal[0], normal[1],
+                        normal[2], d);
+            }
+        }
+        for (int k = 0; k < 3; ++k) {
+            this->_groupTriangles[this->_groups[triangle[k]]].push_back(t);
+        }
+    }
+
+    // An edge with only one triangle is on the edge of the mesh, its ends stay
+    // where they are. So do the ends of edges with more than two
+    vector<pair<int, int> > edges;
+    for (int t = 0; t < this->nTriangles; ++t) {
+        for (int k = 0; k < 3; ++k) {
+            int a = this->_groups[this->_triangles[t * 3 + k]];
+            int b = this->_groups[this->_triangles[t * 3 + (k + 1) % 3]];
+            edges.push_back(make_pair(min(a, b), max(a, b)));
+        }
+    }
+    sort(edges.begin(), edges.end());
+    for (unsigned int i = 0; i < edges.size(); ) {
+        unsigned int j = i + 1;
+        while (j < edges.size() && edges[j] == edges[i]) ++j;
+        if (j - i != 2) {
+            this->_locked[edges[i].first] = true;
+            this->_locked[edges[i].second] = true;
+        }
+        i = j;
+    }
+
+    for (int g = 0; g < nGroups; ++g) {
+        this->_update(g);
+    }
+}
+
+bool Simplification::_hasGroup(int triangle, int group) {
+    for (int k = 0; k < 3; ++k) {
+        if (this->_groups[this->_triangles[triangle * 3 + k]] == group) return true;
+    }
+    return false;
+}
+
+void Simplification::_neighbours(int group, vector<int> & neighbours) {
+    neighbours.clear();
+    vector<int> & triangles = this->_groupTriangles[group];
+    for (unsigned int i = 0; i < triangles.size(); ++i) {
+        if (this->_removed[triangles[i]]) continue;
+        int * triangle = &this->_triangles[triangles[i] * 3];
+        for (int k = 0; k < 3; ++k) {
+            int other = this->_groups[triangle[k]];
+            if (other != group) neighbours.push_back(other);
+        }
+    }
+    sort(neighbours.begin(), neighbours.end());
+    neighbours.erase(unique(neighbours.begin(), neighbours.end()), neighbours.end());
+}
+
+bool Simplification::_canCollapse(int group, int target, map<int, int> & moves) {
+    moves.clear();
+    vector<int> & triangles = this->_groupTriangles[group];
+
+    // Each vertex goes to a vertex of the target it has an edge with
+    for (unsigned int i = 0; i < triangles.size(); ++i) {
+        if (this->_removed[triangles[i]] || !this->_hasGroup(triangles[i], target)) continue;
+        int * triangle = &this->_triangles[triangles[i] * 3];
+        for (int k = 0; k < 3; ++k) {
+            if (this->_groups[triangle[k]] != group) continue;
+            for (int j = 0; j < 3; ++j) {
+                if (this->_groups[triangle[j]] == target) moves[triangle[k]] = triangle[j];
+            }
+        }
+    }
+
+    // The triangles left around the group mustn't turn over, and their vertices
+    // have to have somewhere to go
+    const float * to = this->_vertices[this->_copies[target][0]];
+    for (unsigned int i = 0; i < triangles.size(); ++i) {
+        if (this->_removed[triangles[i]] || this->_hasGroup(triangles[i], target)) continue;
+        int * triangle = &this->_triangles[triangles[i] * 3];
+
+        const float * before[3];
+        const float * after[3];
+        for (int k = 0; k < 3; ++k) {
+            before[k] = this->_vertices[triangle[k]];
+            after[k] = before[k];
+            if (this->_groups[triangle[k]] == group) {
+                if (moves.count(triangle[k]) == 0) return false;
+                after[k] = to;
+            }
+        }
+        double normalBefore[3], normalAfter[3];
+        triangleNormal(before[0], before[1], before[2], normalBefore);
+        triangleNormal(after[0], after[1], after[2], normalAfter);
+        double dot = normalBefore[0] * normalAfter[0] + normalBefore[1] * normalAfter[1]
+            + normalBefore[2] * normalAfter[2];
+        if (dot <= 0) return false;
+    }
+
+    // The edge's two triangles are the only ones that can share both ends,
+    // otherwise the collapse pinches the mesh
+    vector<int> groupNeighbours, targetNeighbours, shared;
+    this->_neighbours(group, groupNeighbours);
+    this->_neighbours(target, targetNeighbours);
+    set_intersection(groupNeighbours.begin(), groupNeighbours.end(),
+            targetNeighbours.begin(), targetNeighbours.end(), back_inserter(shared));
+    return shared.size() <= 2;
+}
+
+int Simplification::_bestTarget(int group, double & cost) {
+    if (this->_locked[group]) return -1;
+
+    vector<int> neighbours;
+    this->_neighbours(group, neighbours);
+    map<int, int> moves;
+    int best = -1;
+    for (unsigned int i = 0; i < neighbours.size(); ++i) {
+        int target = neighbours[i];
+        double error = this->_quadrics[group].error(this->_vertices[this->_copies[target][0]]);
+        if (best >= 0 && error >= cost) continue;
+        if (!this->_canCollapse(group, target, moves)) continue;
+        best = target;
+        cost = error;
+    }
+    return best;
+}
+
+void Simplification::_update(int group) {
+    ++this->_versions[group];
+    double cost;
+    if (this->_bestTarget(group, cost) >= 0) {
+        this->_queue.push(Collapse(max(cost, 0.0), group, this->_versions[group]));
+    }
+}
+
+void Simplification::run(int target) {
+    vector<int> neighbours;
+    map<int, int> moves;
+    while (this->nTriangles > target && !this->_queue.empty()) {
+        Collapse collapse = this->_queue.top();
+        this->_queue.pop();
+        int group = collapse.group;
+        if (collapse.version != this->_versions[group]) continue;
+
+        // Its neighbours might have moved since it was queued
+        double cost;
+        int to = this->_bestTarget(group, cost);
+        if (to < 0) continue;
+        if (cost > collapse.cost * 1.0001 + 1e-9) {
+            this->_queue.push(Collapse(cost, group, ++this->_versions[group]));
+            continue;
+        }
+        this->_canCollapse(group, to, moves);
+
+        // Move the group, the triangles along the edge disappear
+        this->_neighbours(group, neighbours);
+        vector<int> & triangles = this->_groupTriangles[group];
+        vector<int> & targetTriangles = this->_groupTriangles[to];
+        for (unsigned int i = 0; i < triangles.size(); ++i) {
+            int t = triangles[i];
+            if (this->_removed[t]) continue;
+            if (this->_hasGroup(t, to)) {
+                this->_removed[t] = true;
+                --this->nTriangles;
+                continue;
+            }
+            int * triangle = &this->_triangles[t * 3];
+            for (int k = 0; k < 3; ++k) {
+                if (this->_groups[triangle[k]] == group) triangle[k] = moves[triangle[k]];
+            }
+            targetTriangles.push_back(t);
+        }
+        triangles.clear();
+        targetTriangles.erase(remove_if(targetTriangles.begin(), targetTriangles.end(),
+                    IsRemoved(this->_removed)), targetTriangles.end());
+        this->_quadrics[to].add(this->_quadrics[group]);
+        ++this->_versions[group];
+        this->_movedTo[group] = to;
+
+        // Everything around the group has a new shape to check against
+        this->_update(to);
+        for (unsigned int i = 0; i < neighbours.size(); ++i) {
+            if (neighbours[i] != to) this->_update(neighbours[i]);
+        }
+    }
+}
+
+double Simplification::measure() {
+    double error = 0;
+    for (unsigned int group = 0; group < this->_copies.size(); ++group) {
+        int to = group;
+        while (this->_movedTo[to] >= 0) to = this->_movedTo[to];
+        if (to == (int)group) continue;
+
+        const float * position = this->_vertices[this->_copies[group][0]];
+        double nearest = -1;
+        vector<int> & triangles = this->_groupTriangles[to];
+        for (unsigned int i = 0; i < triangles.size(); ++i) {
+            if (this->_removed[triangles[i]]) continue;
+            int * triangle = &this->_triangles[triangles[i] * 3];
+            double distance = triangleDistance(position, this->_vertices[triangle[0]],
+                    this->_vertices[triangle[1]], this->_vertices[triangle[2]]);
+            if (nearest < 0 || distance < nearest) nearest = distance;
+        }
+
+        // Everything around it went too, so only the point it went to is left
+        if (nearest < 0) {
+            const float * end = this->_vertices[this->_copies[to][0]];
+            nearest = sqrt((double)(position[0] - end[0]) * (position[0] - end[0])
+                    + (position[1] - end[1]) * (position[1] - end[1])
+                    + (position[2] - end[2]) * (position[2] - end[2]));
+        }
+        error = max(error, nearest);
+    }
+    return error;
+}
+
+void Simplification::getIndices(vector<unsigned short> & indices) {
+    indices.clear();
+    for (unsigned int t = 0; t < this->_removed.size(); ++t) {
+        if (this->_removed[t]) continue;
+        for (int k = 0; k < 3; ++k) {
+            indices.push_back(this->_triangles[t * 3 + k]);
+        }
+    }
+}
+
+bool MeshSimplifier::canSimplify(Dof & dof, Geob & geob) {
+    if (geob.nIndices / 3 < SIMPLIFIER_MIN_TRIANGLES || geob.nVertices == 0) return false;
+    if (geob.material >= dof.getMats().size()) return false;
+
+    // Alpha tested cutouts and the sky are left as they are
+    return dof.getMats()[geob.material].isOpaqueSolid();
+}
+
+void MeshSimplifier::simplify(Geob & geob) {
+    Simplification simplification(geob);
+    vector<vector<unsigned short> > levels;
+    int nTriangles = simplification.nTriangles;
+    int nLodIndices = 0;
+
+    while ((int)levels.size() < GEOB_MAX_LODS) {
+        simplification.run(nTriangles / 2);
+        if (simplification.nTriangles > nTriangles * SIMPLIFIER_MIN_REDUCTION) break;
+        nTriangles = simplification.nTriangles;
+
+        levels.push_back(vector<unsigned short>());
+        vector<unsigned short> & indices = levels.back();
+        simplification.getIndices(indices);
+        if (MeshOptimiser::enabled) {
+            MeshOptimiser::optimiseTriangles(&indices[0], indices.size(), geob.nVertices);
+        }
+
+        geob.lodCounts[levels.size() - 1] = indices.size();
+        geob.lodErrors[levels.size() - 1] = simplification.measure();
+        nLodIndices += indices.size();
+    }
+    if (levels.empty()) return;
+
+    if (geob.lodIndices != NULL) delete[] geob.lodIndices;
+    geob.nLods = levels.size();
+    geob.nLodIndices = nLodIndices;
+    geob.lodIndices = new unsigned short[nLodIndices];
+    unsigned short * next = geob.lodIndices;
+    for (unsigned int i = 0; i < levels.size(); ++i) {
+        memcpy(next, &levels[i][0], levels[i].size() * sizeof(unsigned short));
+        next += levels[i].size();
+    }
+    geob.placeLods();
+
+    MeshSimplifier::_count(geob);
+}
+
+int MeshSimplifier::selectLod(Geob & geob, const float * boundingBox, const float * camera,
+        float pixelScale) {
+    if (geob.nLods == 0) return -1;
+
+    // The nearest the box gets to the camera
+    float distance = 0;
+    for (int i = 0; i < 3; ++i) {
+        float d = max(boundingBox[i * 2] - camera[i], camera[i] - boundingBox[i * 2 + 1]);
+        if (d > 0) distance += d * d;
+    }
+    distance = sqrt(distance);
+    if (distance <= 0) return -1;
+
+    int level = -1;
+    for (int i = 0; i < geob.nLods; ++i) {
+        if (geob.lodErrors[i] * pixelScale / distance > MeshSimplifier::maxScreenError) {
+            break;
+        }
+        level = i;
+    }
+    return level;
+}
+
+void MeshSimplifier::_count(Geob & geob) {
+    pthread_mutex_lock(&MeshSimplifier::_countMutex);
+    ++MeshSimplifier::geobs;
+    MeshSimplifier::triangles += geob.nIndices / 3;
+    for (int i = 0; i < geob.nLods; ++i) {
+        MeshSimplifier::lodTriangles[i] += geob.lodCounts[i] / 3;
+    }
+    pthread_mutex_unlock(&MeshSimplifier::_countMutex);
+}
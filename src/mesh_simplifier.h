@@ -0,0 +1,55 @@
+/**
+ * Load time level of detail for the big geobs. Each one gets a few simplified
+ * versions made with quadric edge collapses (Garland and Heckbert), each about half
+ * the triangles of the one before. A collapse moves a vertex onto one of its
+ * neighbours, so the levels are just index buffers over the geob's own vertices and
+ * go in the same VBO.
+ *
+ * Vertices on the edge of the mesh never move. The vertices are split wherever the
+ * texture coordinates or normals change, so that keeps the UV seams as well as
+ * stopping cracks opening up between neighbouring geobs.
+ *
+ * The quadrics only decide the order of the collapses, they're a poor guide to how
+ * far the shape has actually moved. Each level is measured once it's done, and the
+ * track picks the coarsest one that is less than maxScreenError pixels out at the
+ * geob's distance.
+ */
+#pragma once
+
+#include "dof.h"
+
+#include <pthread.h>
+
+class MeshSimplifier {
+    public:
+        // Make the levels when the dofs load, off by default
+        static bool enabled;
+        // How many pixels a level can be out before a finer one is used
+        static float maxScreenError;
+        // Height of the viewport the errors are measured in
+        static int screenHeight;
+
+        // Check if a geob is worth simplifying: big enough, and not alpha tested.
+        // Those are mostly foliage cards, which fall apart
+        static bool canSimplify(Dof & dof, Geob & geob);
+
+        // Make the levels for the geob. Safe to call from the loader threads
+        static void simplify(Geob & geob);
+
+        // Pick the level to draw geob with when its box is seen from camera,
+        // -1 for the full geob. pixelScale is the projection's vertical scale times
+        // half the screen height
+        static int selectLod(Geob & geob, const float * boundingBox, const float * camera,
+                float pixelScale);
+
+        // Totals for reporting: geobs simplified, their triangles and the triangles
+        // in each level
+        static int geobs;
+        static long triangles;
+        static long lodTriangles[GEOB_MAX_LODS];
+
+    private:
+        // Add a geob's figures to the totals
+        static void _count(Geob & geob);
+        static pthread_mutex_t _countMutex;
+};
@@ -0,0 +1,153 @@
+#include "mipmap_generator.h"
+
+#include <algorithm>
+#include <math.h>
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+using namespace std;
+
+bool MipmapGenerator::gammaCorrect = false;
+
+// sRGB to linear and back. Linear values are kept in 12 bits, which is enough for
+// the darkest sRGB steps to stay apart
+#define GAMMA_LINEAR_BITS 12
+#define GAMMA_LINEAR_SIZE (1 << GAMMA_LINEAR_BITS)
+
+static unsigned short toLinear[256];
+static unsigned char fromLinear[GAMMA_LINEAR_SIZE];
+
+// Fill in the tables before any of the loader threads can get to them
+static class GammaTables {
+    public:
+        GammaTables() {
+            for (int i = 0; i < 256; ++i) {
+                double value = i / 255.0;
+                value = value <= 0.04045 ? value / 12.92 : pow((value + 0.055) / 1.055, 2.4);
+                toLinear[i] = (unsigned short)(value * (GAMMA_LINEAR_SIZE - 1) + 0.5);
+            }
+            for (int i = 0; i < GAMMA_LINEAR_SIZE; ++i) {
+                double value = i / (double)(GAMMA_LINEAR_SIZE - 1);
+                value = value <= 0.0031308 ? value * 12.92
+                    : 1.055 * pow(value, 1 / 2.4) - 0.055;
+                fromLinear[i] = (unsigned char)(value * 255 + 0.5);
+            }
+        }
+} gammaTables;
+
+void MipmapGenerator::_halveRows(const unsigned char * src, int width, int height, int x,
+        unsigned char * dst) {
+    int halfWidth = max(width / 2, 1);
+    int halfHeight = max(height / 2, 1);
+    // For an edge of 1 the same pixel is used twice
+    int across = width > 1 ? 4 : 0;
+    int down = height > 1 ? width * 4 : 0;
+
+    for (int y = 0; y < halfHeight; ++y) {
+        const unsigned char * pixel = src + (y * 2 * width + x * 2) * 4;
+        unsigned char * out = dst + (y * halfWidth + x) * 4;
+        for (int i = x * 4; i < halfWidth * 4; ++i) {
+            *out++ = (pixel[0] + pixel[across] + pixel[down] + pixel[down + across] + 2) >> 2;
+            // Step to the next pixel pair after the alpha
+            pixel += (i & 3) == 3 ? 8 - 3 : 1;
+        }
+    }
+}
+
+void MipmapGenerator::_halveRowsGamma(const unsigned char * src, int width, int height,
+        unsigned char * dst) {
+    int halfWidth = max(width / 2, 1);
+    int halfHeight = max(height / 2, 1);
+    int across = width > 1 ? 4 : 0;
+    int down = height > 1 ? width * 4 : 0;
+
+    for (int y = 0; y < halfHeight; ++y) {
+        const unsigned char * pixel = src + y * 2 * width * 4;
+        for (int x = 0; x < halfWidth; ++x) {
+            for (int i = 0; i < 3; ++i) {
+                *dst++ = fromLinear[(toLinear[pixel[i]] + toLinear[pixel[i + across]] 
+                        + toLinear[pixel[i + down]] + toLinear[pixel[i + down + across]]
+                        + 2) >> 2];
+            }
+            *dst++ = (pixel[3] + pixel[3 + across] + pixel[3 + down] 
+                    + pixel[3 + down + across] + 2) >> 2;
+            pixel += 8;
+        }
+    }
+}
+
+void MipmapGenerator::halve(const unsigned char * src, int width, int height,
+        unsigned char * dst) {
+    if (MipmapGenerator::gammaCorrect) {
+        MipmapGenerator::_halveRowsGamma(src, width, height, dst);
+        return;
+    }
+
+    int x = 0;
+#ifdef __SSE2__
+    // Four pixels of dst from two rows of eight in src. Every channel is summed in 16
+    // bits so the rounding is exactly the same as the plain version
+    if (width >= 8 && height > 1) {
+        int halfWidth = width / 2;
+        __m128i zero = _mm_setzero_si128();
+        __m128i two = _mm_set1_epi16(2);
+        for (int y = 0; y < height / 2; ++y) {
+            const unsigned char * top = src + y * 2 * width * 4;
+            const unsigned char * bottom = top + width * 4;
+            unsigned char * out = dst + y * halfWidth * 4;
+            for (x = 0; x + 4 <= halfWidth; x += 4) {
+                __m128i a = _mm_loadu_si128((const __m128i *)(top + x * 8));
+                __m128i b = _mm_loadu_si128((const __m128i *)(top + x * 8 + 16));
+                __m128i c = _mm_loadu_si128((const __m128i *)(bottom + x * 8));
+                __m128i d = _mm_loadu_si128((const __m128i *)(bottom + x * 8 + 16));
+
+                // Add the rows, two source pixels in each
+                __m128i s0 = _mm_add_epi16(_mm_unpacklo_epi8(a, zero), 
+                        _mm_unpacklo_epi8(c, zero));
+                __m128i s1 = _mm_add_epi16(_mm_unpackhi_epi8(a, zero), 
+                        _mm_unpackhi_epi8(c, zero));
+                __m128i s2 = _mm_add_epi16(_mm_unpacklo_epi8(b, zero), 
+                        _mm_unpacklo_epi8(d, zero));
+                __m128i s3 = _mm_add_epi16(_mm_unpackhi_epi8(b, zero), 
+                        _mm_unpackhi_epi8(d, zero));
+
+                // Then the pairs across, the even pixels with the odd ones
+                __m128i p01 = _mm_add_epi16(_mm_unpacklo_epi64(s0, s1), 
+                        _mm_unpackhi_epi64(s0, s1));
+                __m128i p23 = _mm_add_epi16(_mm_unpacklo_epi64(s2, s3), 
+                        _mm_unpackhi_epi64(s2, s3));
+
+                p01 = _mm_srli_epi16(_mm_add_epi16(p01, two), 2);
+                p23 = _mm_srli_epi16(_mm_add_epi16(p23, two), 2);
+                _mm_storeu_si128((__m128i *)(out + x * 4), _mm_packus_epi16(p01, p23));
+            }
+        }
+    }
+#endif
+
+    // Whatever is left at the end of the rows, or everything
+    MipmapGenerator::_halveRows(src, width, height, x, dst);
+}
+
+void MipmapGenerator::build(TextureLevels & levels) {
+    // Work out the sizes first so the buffer is only grown once
+    size_t size = levels.offsets[0] + levels.sizes[0];
+    levels.nLevels = 1;
+    while ((levels.widths[levels.nLevels - 1] > 1 || levels.heights[levels.nLevels - 1] > 1)
+            && levels.nLevels < TEXTURE_MAX_LEVELS) {
+        int i = levels.nLevels++;
+        levels.widths[i] = max(levels.widths[i - 1] / 2, 1);
+        levels.heights[i] = max(levels.heights[i - 1] / 2, 1);
+        levels.sizes[i] = levels.widths[i] * levels.heights[i] * 4;
+        levels.offsets[i] = size;
+        size += levels.sizes[i];
+    }
+    levels.buffer.resize(size);
+
+    for (int i = 1; i < levels.nLevels; ++i) {
+        MipmapGenerator::halve(&levels.buffer[levels.offsets[i - 1]], levels.widths[i - 1],
+                levels.heights[i - 1], &levels.buffer[levels.offsets[i]]);
+    }
+}
@@ -0,0 +1,38 @@
+/**
+ * Builds the mip chain for a texture on the CPU, so it can be done on the loader
+ * threads and kept in the texture cache rather than left to gluBuild2DMipmaps on
+ * the main thread. Each level is a 2x2 box filter of the one above, the same as
+ * gluBuild2DMipmaps does for power of two textures.
+ *
+ * With SSE2 four pixels of the level below are made at a time, without it (or when
+ * averaging gamma correctly) it's done a channel at a time.
+ */
+#pragma once
+
+#include "texture_cache.h"
+
+class MipmapGenerator {
+    public:
+        // Average the colours in linear space rather than straight on the sRGB
+        // values, which stops the smaller levels getting darker. Off by default, the
+        // alpha channel is always averaged as it is
+        static bool gammaCorrect;
+
+        // Halve a width by height image of 4 byte pixels into dst, which has to hold
+        // max(width / 2, 1) by max(height / 2, 1) pixels. An edge that is already 1
+        // pixel long stays 1
+        static void halve(const unsigned char * src, int width, int height,
+                unsigned char * dst);
+
+        // Fill in the rest of the levels below level 0, which has to be in the buffer
+        static void build(TextureLevels & levels);
+
+    private:
+        // Halve the pixels from x on each row a channel at a time
+        static void _halveRows(const unsigned char * src, int width, int height, int x,
+                unsigned char * dst);
+
+        // The same with the colours averaged in linear space
+        static void _halveRowsGamma(const unsigned char * src, int width, int height,
+                unsigned char * dst);
+};
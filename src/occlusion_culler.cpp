@@ -0,0 +1,277 @@
+#include "occlusion_culler.h"
+#include "shader.h"
+
+#include <math.h>
+#include <algorithm>
+#include <boost/foreach.hpp>
+
+using namespace std;
+
+bool OcclusionCuller::enabled = false;
+float OcclusionCuller::occluderSize = 10;
+int OcclusionCuller::threads = 0;
+
+// Size of the depth buffer, and of the tiles
+#define OCCLUSION_WIDTH 256
+#define OCCLUSION_HEIGHT 128
+#define OCCLUSION_TILE 8
+
+#define OCCLUSION_TILES_ACROSS (OCCLUSION_WIDTH / OCCLUSION_TILE)
+
+// Anything with a w less than this is too close to the camera to be projected
+#define OCCLUSION_NEAR 0.01
+
+// Draws a band of the depth buffer on one of the pool's threads
+class RasteriseJob : public Job {
+    public:
+        RasteriseJob(OcclusionCuller & culler, int firstRow, int endRow)
+            : culler(culler), firstRow(firstRow), endRow(endRow) {}
+
+        void run() {
+            this->culler._rasterise(this->firstRow, this->endRow);
+        }
+
+        OcclusionCuller & culler;
+        int firstRow;
+        int endRow;
+};
+
+// Put the point through the matrix into x, y, depth and w on the depth buffer. The
+// w is left below OCCLUSION_NEAR if the point can't be projected
+static void project(const float * matrix, const float * point, float * screen) {
+    float x = matrix[0] * point[0] + matrix[4] * point[1] + matrix[8] * point[2] + matrix[12];
+    float y = matrix[1] * point[0] + matrix[5] * point[1] + matrix[9] * point[2] + matrix[13];
+    float z = matrix[2] * point[0] + matrix[6] * point[1] + matrix[10] * point[2] + matrix[14];
+    float w = matrix[3] * point[0] + matrix[7] * point[1] + matrix[11] * point[2] + matrix[15];
+
+    screen[3] = w;
+    if (w < OCCLUSION_NEAR) return;
+    screen[0] = (x / w * 0.5 + 0.5) * OCCLUSION_WIDTH;
+    screen[1] = (y / w * 0.5 + 0.5) * OCCLUSION_HEIGHT;
+    screen[2] = z / w;
+}
+
+OcclusionCuller::OcclusionCuller() {
+    this->nRendered = 0;
+    this->nTested = 0;
+    this->nOccluded = 0;
+    this->_depth.assign(OCCLUSION_WIDTH * OCCLUSION_HEIGHT, 1);
+    this->_tiles.assign(OCCLUSION_TILES_ACROSS * (OCCLUSION_HEIGHT / OCCLUSION_TILE), 1);
+    for (int i = 0; i < 16; ++i) {
+        this->_matrix[i] = (i % 5 == 0) ? 1 : 0;
+    }
+    this->_pool = OcclusionCuller::threads > 0 ? new WorkerPool(OcclusionCuller::threads)
+        : NULL;
+}
+
+OcclusionCuller::~OcclusionCuller() {
+    if (this->_pool != NULL) delete this->_pool;
+}
+
+bool OcclusionCuller::canOcclude(Dof & dof, Geob & geob) {
+    if (geob.material >= dof.getMats().size()) return false;
+    if (geob.nVertices == 0 || geob.nIndices == 0) return false;
+
+    return dof.getMats()[geob.material].isOpaqueSolid();
+}
+
+bool OcclusionCuller::isOccluder(Dof & dof, Geob & geob) {
+    if (!OcclusionCuller::canOcclude(dof, geob)) return false;
+    if (dof.isOccluder()) return true;
+    if (OcclusionCuller::occluderSize <= 0) return false;
+
+    float * box = geob.boundingBox;
+    float across = max(box[1] - box[0], box[5] - box[4]);
+    return across >= OcclusionCuller::occluderSize
+        && box[3] - box[2] >= OcclusionCuller::occluderSize;
+}
+
+void OcclusionCuller::addOccluder(Geob & geob) {
+    Occluder occluder;
+    copy(geob.boundingBox, geob.boundingBox + 6, occluder.boundingBox);
+    occluder.firstVertex = this->_vertices.size() / 3;
+    occluder.nVertices = geob.nVertices;
+    occluder.firstIndex = this->_indices.size();
+
+    this->_vertices.insert(this->_vertices.end(), geob.vertices[0],
+            geob.vertices[0] + geob.nVertices * 3);
+
+    // Only what the bursts cover gets drawn, the same as Geob::draw
+    for (int j = 0; j < geob.nBursts; ++j) {
+        int start = max(geob.burstStarts[j] / 3, 0);
+        int end = min(start + geob.burstsCount[j] / 3, geob.nIndices);
+        for (int i = start; i + 2 < end; i += 3) {
+            for (int k = 0; k < 3; ++k) {
+                this->_indices.push_back(geob.indices[i + k]);
+            }
+        }
+    }
+    occluder.nIndices = this->_indices.size() - occluder.firstIndex;
+
+    if (occluder.nIndices > 0) this->_occluders.push_back(occluder);
+}
+
+void OcclusionCuller::render(ViewFrustumCulling & culler) {
+    copy(culler.getMatrix(), culler.getMatrix() + 16, this->_matrix);
+    this->nRendered = 0;
+    this->nTested = 0;
+    this->nOccluded = 0;
+    this->_screen.clear();
+    this->_triangles.clear();
+
+    // Put the vertices of the occluders in view on the screen
+    BOOST_FOREACH(Occluder & occluder, this->_occluders) {
+        int planes = FRUSTUM_ALL_PLANES;
+        if (culler.testBox(occluder.boundingBox, planes) == FRUSTUM_OUTSIDE) continue;
+        ++this->nRendered;
+
+        int first = this->_screen.size() / 4;
+        this->_screen.resize(this->_screen.size() + occluder.nVertices * 4);
+        for (int i = 0; i < occluder.nVertices; ++i) {
+            project(this->_matrix, &this->_vertices[(occluder.firstVertex + i) * 3],
+                    &this->_screen[(first + i) * 4]);
+        }
+
+        // Triangles that go behind the camera are left out, which only means less
+        // gets hidden
+        for (int i = occluder.firstIndex; i < occluder.firstIndex + occluder.nIndices;
+                i += 3) {
+            bool inFront = true;
+            for (int k = 0; k < 3; ++k) {
+                if (this->_indices[i + k] >= occluder.nVertices
+                        || this->_screen[(first + this->_indices[i + k]) * 4 + 3]
+                            < OCCLUSION_NEAR) {
+                    inFront = false;
+                }
+            }
+            if (!inFront) continue;
+            for (int k = 0; k < 3; ++k) {
+                this->_triangles.push_back(first + this->_indices[i + k]);
+            }
+        }
+    }
+
+    if (this->_pool == NULL) {
+        this->_rasterise(0, OCCLUSION_HEIGHT);
+        return;
+    }
+
+    // A band of whole tiles for each thread
+    int nTileRows = OCCLUSION_HEIGHT / OCCLUSION_TILE;
+    int bandRows = (nTileRows + this->_pool->getNThreads() - 1) / this->_pool->getNThreads();
+    for (int row = 0; row < nTileRows; row += bandRows) {
+        this->_pool->add(new RasteriseJob(*this, row * OCCLUSION_TILE,
+                    min(row + bandRows, nTileRows) * OCCLUSION_TILE));
+    }
+    this->_pool->wait();
+}
+
+void OcclusionCuller::_rasterise(int firstRow, int endRow) {
+    fill(this->_depth.begin() + firstRow * OCCLUSION_WIDTH,
+            this->_depth.begin() + endRow * OCCLUSION_WIDTH, 1.0f);
+
+    for (unsigned int t = 0; t < this->_triangles.size(); t += 3) {
+        const float * a = &this->_screen[this->_triangles[t] * 4];
+        const float * b = &this->_screen[this->_triangles[t + 1] * 4];
+        const float * c = &this->_screen[this->_triangles[t + 2] * 4];
+
+        float area = (b[0] - a[0]) * (c[1] - a[1]) - (c[0] - a[0]) * (b[1] - a[1]);
+        if (area == 0) continue;
+
+        // The pixels whose centres might be in the triangle
+        int minX = max(0, (int)ceilf(min(a[0], min(b[0], c[0])) - 0.5f));
+        int maxX = min(OCCLUSION_WIDTH - 1, (int)floorf(max(a[0], max(b[0], c[0])) - 0.5f));
+        int minY = max(firstRow, (int)ceilf(min(a[1], min(b[1], c[1])) - 0.5f));
+        int maxY = min(endRow - 1, (int)floorf(max(a[1], max(b[1], c[1])) - 0.5f));
+        if (minX > maxX || minY > maxY) continue;
+
+        // The depth is linear across the screen
+        float depthX = ((b[2] - a[2]) * (c[1] - a[1]) - (c[2] - a[2]) * (b[1] - a[1])) / area;
+        float depthY = ((c[2] - a[2]) * (b[0] - a[0]) - (b[2] - a[2]) * (c[0] - a[0])) / area;
+
+        // Either way round, the point is inside if it's on the same side of every edge
+        float side = area > 0 ? 1 : -1;
+        for (int y = minY; y <= maxY; ++y) {
+            float py = y + 0.5f;
+            float * row = &this->_depth[y * OCCLUSION_WIDTH];
+            for (int x = minX; x <= maxX; ++x) {
+                float px = x + 0.5f;
+                if (side * ((c[0] - b[0]) * (py - b[1]) - (c[1] - b[1]) * (px - b[0])) < 0
+                        || side * ((a[0] - c[0]) * (py - c[1]) - (a[1] - c[1]) * (px - c[0])) < 0
+                        || side * ((b[0] - a[0]) * (py - a[1]) - (b[1] - a[1]) * (px - a[0])) < 0) {
+                    continue;
+                }
+                float depth = a[2] + depthX * (px - a[0]) + depthY * (py - a[1]);
+                if (depth < row[x]) row[x] = depth;
+            }
+        }
+    }
+
+    // The furthest depth in each tile
+    for (int tileY = firstRow / OCCLUSION_TILE; tileY < endRow / OCCLUSION_TILE; ++tileY) {
+        for (int tileX = 0; tileX < OCCLUSION_TILES_ACROSS; ++tileX) {
+            float furthest = -1e30f;
+            for (int y = tileY * OCCLUSION_TILE; y < (tileY + 1) * OCCLUSION_TILE; ++y) {
+                float * row = &this->_depth[y * OCCLUSION_WIDTH + tileX * OCCLUSION_TILE];
+                for (int x = 0; x < OCCLUSION_TILE; ++x) {
+                    furthest = max(furthest, row[x]);
+                }
+            }
+            this->_tiles[tileY * OCCLUSION_TILES_ACROSS + tileX] = furthest;
+        }
+    }
+}
+
+bool OcclusionCuller::testBox(const float * boundingBox) {
+    ++this->nTested;
+
+    // The rectangle the box covers on the screen, and its nearest depth
+    float minX = 1e30f, maxX = -1e30f, minY = 1e30f, maxY = -1e30f, nearest = 1e30f;
+    for (int i = 0; i < 8; ++i) {
+        float corner[3] = {
+            boundingBox[i & 1], boundingBox[2 + ((i >> 1) & 1)], boundingBox[4 + (i >> 2)] };
+        float screen[4];
+        project(this->_matrix, corner, screen);
+
+        // Part of it is behind the camera
+        if (screen[3] < OCCLUSION_NEAR) return true;
+
+        minX = min(minX, screen[0]);
+        maxX = max(maxX, screen[0]);
+        minY = min(minY, screen[1]);
+        maxY = max(maxY, screen[1]);
+        nearest = min(nearest, screen[2]);
+    }
+
+    int x0 = max(0, (int)floorf(minX));
+    int x1 = min(OCCLUSION_WIDTH - 1, (int)floorf(maxX));
+    int y0 = max(0, (int)floorf(minY));
+    int y1 = min(OCCLUSION_HEIGHT - 1, (int)floorf(maxY));
+    // Off the screen, that's for the frustum culling to sort out
+    if (x0 > x1 || y0 > y1) return true;
+
+    for (int tileY = y0 / OCCLUSION_TILE; tileY <= y1 / OCCLUSION_TILE; ++tileY) {
+        for (int tileX = x0 / OCCLUSION_TILE; tileX <= x1 / OCCLUSION_TILE; ++tileX) {
+            // Everything drawn in the tile is in front of the box
+            if (this->_tiles[tileY * OCCLUSION_TILES_ACROSS + tileX] < nearest) continue;
+
+            // Otherwise look at the pixels of the tile the box covers
+            int startY = max(y0, tileY * OCCLUSION_TILE);
+            int endY = min(y1, (tileY + 1) * OCCLUSION_TILE - 1);
+            int startX = max(x0, tileX * OCCLUSION_TILE);
+            int endX = min(x1, (tileX + 1) * OCCLUSION_TILE - 1);
+            for (int y = startY; y <= endY; ++y) {
+                for (int x = startX; x <= endX; ++x) {
+                    if (this->_depth[y * OCCLUSION_WIDTH + x] >= nearest) return true;
+                }
+            }
+        }
+    }
+
+    ++this->nOccluded;
+    return false;
+}
+
+int OcclusionCuller::getNOccluders() {
+    return this->_occluders.size();
+}
@@ -0,0 +1,96 @@
+/**
+ * Software occlusion culling. The big occluders (buildings, mostly) in view are
+ * drawn into a small depth buffer on the CPU each frame, and anything whose
+ * bounding box is behind what's been drawn everywhere it covers can be skipped. On
+ * the street tracks the camera is usually boxed in by buildings, so most of what is
+ * in the frustum can't actually be seen.
+ *
+ * There's a second level to the depth buffer with the furthest depth in each tile
+ * of pixels, so a box behind a wall is usually ruled out from the tiles alone.
+ *
+ * A pixel is covered by an occluder if its centre is, so something showing through
+ * a gap thinner than a pixel of the small buffer can be hidden.
+ *
+ * No OpenGL is used, so render and testBox can be called from any thread, and the
+ * drawing itself can be split into bands on a pool of threads.
+ */
+#pragma once
+
+#include "dof.h"
+#include "frustum_culler.h"
+#include "worker_pool.h"
+
+#include <vector>
+
+class OcclusionCuller {
+    public:
+        OcclusionCuller();
+        ~OcclusionCuller();
+
+        // Check if a geob should be used as an occluder: its dof is flagged
+        // DOF_OCCLUDER in geometry.ini, or it's at least occluderSize across and high.
+        // Anything alpha tested is never used, it has holes
+        static bool isOccluder(Dof & dof, Geob & geob);
+
+        // Check the geob is solid enough to hide things, whatever its size
+        static bool canOcclude(Dof & dof, Geob & geob);
+
+        // Take a copy of the geob's triangles to draw as an occluder
+        void addOccluder(Geob & geob);
+
+        // Draw the occluders in the frustum into the depth buffer
+        void render(ViewFrustumCulling & culler);
+
+        // Check if the box can be seen past the occluders drawn in the last render,
+        // false if it is hidden
+        bool testBox(const float * boundingBox);
+
+        // Turn the occlusion culling on, off by default
+        static bool enabled;
+        // How big a geob has to be to be an occluder, 0 to only use flagged dofs
+        static float occluderSize;
+        // Threads to draw the occluders on, 0 draws them on the thread calling render
+        static int threads;
+
+        int getNOccluders();
+
+        // Figures for the last frame: occluders drawn, boxes tested and boxes hidden
+        int nRendered;
+        int nTested;
+        int nOccluded;
+
+    private:
+        class Occluder {
+            public:
+                float boundingBox[6];
+                int firstVertex;
+                int nVertices;
+                int firstIndex;
+                int nIndices;
+        };
+
+        std::vector<Occluder> _occluders;
+        // Positions of the occluders' vertices, and their triangles
+        std::vector<float> _vertices;
+        std::vector<int> _indices;
+
+        // The matrix of the last render, projection and modelview combined
+        float _matrix[16];
+
+        // The vertices of the occluders being drawn on the screen, x, y, depth and w,
+        // and their triangles
+        std::vector<float> _screen;
+        std::vector<int> _triangles;
+
+        // The depth buffer, and the furthest depth in each tile of it
+        std::vector<float> _depth;
+        std::vector<float> _tiles;
+
+        WorkerPool * _pool;
+
+        // Draw the triangles into rows firstRow up to endRow and work out their tiles,
+        // the rows have to start and end on a tile
+        void _rasterise(int firstRow, int endRow);
+
+        friend class RasteriseJob;
+};
@@ -12,153 +12,254 @@ using namespace std;
 
 OpenGLState OpenGLState::global;
 
+OpenGLState::OpenGLState() {
+    // Set up the multi texture stuff, this is done once as reset is called every frame
+    this->maxTextures = 5;
+
+    this->currentTextures = new unsigned int[this->maxTextures];
+    this->enabledTextures = new bool[this->maxTextures];
+    this->texGenRs = new int[this->maxTextures];
+    this->texGenSs = new int[this->maxTextures];
+    this->texGenTs = new int[this->maxTextures];
+
+    this->nIssued = 0;
+    this->nFiltered = 0;
+    this->lastUsedTextures = 0;
+    this->textureCoordArrays = 0;
+}
+
+OpenGLState::~OpenGLState() {
+    delete[] this->currentTextures;
+    delete[] this->enabledTextures;
+    delete[] this->texGenRs;
+    delete[] this->texGenSs;
+    delete[] this->texGenTs;
+}
+
 void OpenGLState::reset() {
     // Set the state for a display list
-    glDisable(GL_TEXTURE_2D);
-    this->texture2d = false;
+    for (int i = 0; i < this->maxTextures; ++i)  {
+        glActiveTexture(GL_TEXTURE0 + i);
+        glDisable(GL_TEXTURE_2D);
+        this->enabledTextures[i] = false;
 
+        glBindTexture(GL_TEXTURE_2D, 0);
+        this->currentTextures[i] = 0;
 
-    glBlendFunc(GL_SRC_ALPHA, GL_ONE_MINUS_SRC_ALPHA);
+        glTexGeni(GL_R, GL_TEXTURE_GEN_MODE, GL_OBJECT_LINEAR);
+        glTexGeni(GL_S, GL_TEXTURE_GEN_MODE, GL_OBJECT_LINEAR);
+        glTexGeni(GL_T, GL_TEXTURE_GEN_MODE, GL_OBJECT_LINEAR);
+        this->texGenRs[i] = GL_OBJECT_LINEAR;
+        this->texGenSs[i] = GL_OBJECT_LINEAR;
+        this->texGenTs[i] = GL_OBJECT_LINEAR;
 
-    glBindTexture(GL_TEXTURE_2D, 0);
-    this->texture = 0;
+        glClientActiveTexture(GL_TEXTURE0 + i);
+        glDisableClientState(GL_TEXTURE_COORD_ARRAY);
+    }
+    glActiveTexture(GL_TEXTURE0);
+    this->activeTexture = 0;
+    glClientActiveTexture(GL_TEXTURE0);
+    this->clientActiveTexture = 0;
+    this->lastUsedTextures = 0;
+    this->textureCoordArrays = 0;
 
-    glDisable(GL_ALPHA_TEST);
-    this->alphaTest = false;
+    glDisableClientState(GL_VERTEX_ARRAY);
+    this->vertexArray = false;
+    glDisableClientState(GL_NORMAL_ARRAY);
+    this->normalArray = false;
+
+    glBlendFunc(GL_SRC_ALPHA, GL_ONE_MINUS_SRC_ALPHA);
+    this->blendSrc = GL_SRC_ALPHA;
+    this->blendDst = GL_ONE_MINUS_SRC_ALPHA;
+
+    glDisable(GL_BLEND);
+    this->blend = false;
 
     glEnable(GL_DEPTH_TEST);
     this->depthTest = true;
 
     glDisable(GL_CULL_FACE);
+    glCullFace(GL_BACK);
     this->culling = 0;
 
-    glDisable(GL_BLEND);
-    //glEnable(GL_BLEND);
-    this->blend = false;
-
-    // NOTE: It looks like it's quicker just to enable this from the start and not
-    // keep enabling / disabling all the time. However, alpha testing seems to be
-    // really slow
-    //glDisable(GL_ALPHA_TEST);
-    glEnable(GL_ALPHA_TEST);
+    // Alpha testing seems to be really slow, so it's only on when it's needed
+    glDisable(GL_ALPHA_TEST);
+    glAlphaFunc(GL_ALWAYS, 0);
+    this->alphaTest = false;
     this->alphaFunction = 1;
+    this->alphaValue = 0;
 
-    // Set up the multi texture stuff
-    this->maxTextures = 5;
+    this->nIssued = 0;
+    this->nFiltered = 0;
+}
 
-    this->multiTextures = new int[this->maxTextures];
-    this->currentTextures = new int[this->maxTextures];
-    this->texGenRs = new int[this->maxTextures];
-    this->texGenSs = new int[this->maxTextures];
-    this->texGenTs = new int[this->maxTextures];
-    this->blendSrcs = new int[this->maxTextures];
-    this->blendDsts = new int[this->maxTextures];
+bool OpenGLState::_count(bool needed) {
+    if (needed) {
+        ++this->nIssued;
+    } else {
+        ++this->nFiltered;
+    }
+    return needed;
+}
 
-    for (int i = 0; i < this->maxTextures; ++i)  {
-        this->multiTextures[i] = GL_TEXTURE0 + i;
-        this->currentTextures[i] = 0;
+void OpenGLState::setCulling(int culling) {
+    if (!this->_count(this->culling != culling)) return;
 
-        this->texGenRs[i] = GL_OBJECT_LINEAR;
-        this->texGenSs[i] = GL_OBJECT_LINEAR;
-        this->texGenTs[i] = GL_OBJECT_LINEAR;
+    // enable or disable culling
+    if (this->culling == 0) {
+        glEnable(GL_CULL_FACE);
+    } else if (culling == 0) {
+        glDisable(GL_CULL_FACE);
+    }
 
-        this->blendSrcs[i] = GL_SRC_ALPHA;
-        this->blendDsts[i] = GL_ONE_MINUS_SRC_ALPHA;
+    // Set the face
+    if (culling == 1) {
+        glCullFace(GL_BACK);
+    } else if (culling == 2) {
+        glCullFace(GL_FRONT);
     }
+
+    // Save the new state
+    this->culling = culling;
 }
 
-void OpenGLState::setCulling(int culling) {
-    if (this->culling != culling) {
-        // enable or disable culling
-        if (this->culling == 0 && (culling == 1 || culling == 2)) {
-            glEnable(GL_CULL_FACE);
-        } else if (culling == 0) {
-            glDisable(GL_CULL_FACE);
+void OpenGLState::setAlpha(int function, int value) {
+    // Decide if we need to enable / disable alphafunc
+    bool alphaTest = function != 1;
+    if (this->_count(alphaTest != this->alphaTest)) {
+        if (alphaTest) {
+            glEnable(GL_ALPHA_TEST);
+        } else {
+            glDisable(GL_ALPHA_TEST);
         }
+        this->alphaTest = alphaTest;
+    }
 
-        // Set the face
-        if (this->culling == 1) {
-            glCullFace(GL_BACK);
-        }
+    // The function doesn't matter while the test is off
+    if (!alphaTest) return;
+    if (!this->_count(function != this->alphaFunction || value != this->alphaValue)) {
+        return;
+    }
 
-        if (this->culling == 2) {
-            glCullFace(GL_FRONT);
-        }
+    // Change the actual function
+    GLenum func;
+    switch (function) {
+        case 0:
+            func = GL_NEVER;
+            break;
+        case 2:
+            func = GL_LESS;
+            break;
+        case 3:
+            func = GL_LEQUAL;
+            break;
+        case 4:
+            func = GL_EQUAL;
+            break;
+        case 5:
+            func = GL_GEQUAL;
+            break;
+        case 6:
+            func = GL_GREATER;
+            break;
+        case 7:
+            func = GL_NOTEQUAL;
+            break;
+        default:
+            func = GL_ALWAYS;
+            Logger::warn << "Bad alphaFunction" << endl;
+    }
+
+    // Set up the new function
+    glAlphaFunc(func, value / 255.0);
+
+    // Reset the current function
+    this->alphaFunction = function;
+    this->alphaValue = value;
+}
 
-        // Save the new state
-        this->culling = culling;
+void OpenGLState::_setActiveTexture(int unit) {
+    if (this->_count(this->activeTexture != unit)) {
+        glActiveTexture(GL_TEXTURE0 + unit);
+        this->activeTexture = unit;
     }
 }
 
-void OpenGLState::setAlpha(int function, int value) {
+void OpenGLState::_enableTexture(int unit, bool enable) {
+    if (!this->_count(this->enabledTextures[unit] != enable)) return;
 
-    // Check if the function is different
-    if (function != this->alphaFunction) {
-        // Decide if we need to enable / disable alphafunc
-        if (this->alphaFunction == 1) {
-            glEnable(GL_ALPHA_TEST);
-        } else if (function == 1) {
-            glDisable(GL_ALPHA_TEST);
-        }
+    this->_setActiveTexture(unit);
+    if (enable) {
+        glEnable(GL_TEXTURE_2D);
+    } else {
+        glDisable(GL_TEXTURE_2D);
+    }
+    this->enabledTextures[unit] = enable;
+}
 
-        // Change the actual function
-        GLenum func;
-        switch (function) {
-            case 0:
-                func = GL_NEVER;
-                break;
-            case 1:
-                func = GL_ALWAYS;
-                break;
-            case 2:
-                func = GL_LESS;
-                break;
-            case 3:
-                func = GL_LEQUAL;
-                break;
-            case 4:
-                func = GL_EQUAL;
-                break;
-            case 5:
-                func = GL_GEQUAL;
-                break;
-            case 6:
-                func = GL_GREATER;
-                break;
-            case 7:
-                func = GL_NOTEQUAL;
-                break;
-            default:
-                func = GL_ALWAYS;
-                Logger::warn << "Bad alphaFunction" << endl;
-        }
+void OpenGLState::_bindTexture(int unit, unsigned int texture) {
+    if (!this->_count(this->currentTextures[unit] != texture)) return;
 
-        // Get the clamp
-        GLclampf ref = value / 255.0;
-        std::cout << "clamp: " << ref << std::endl;
+    this->_setActiveTexture(unit);
+    glBindTexture(GL_TEXTURE_2D, texture);
+    this->currentTextures[unit] = texture;
+}
 
-        // Set up the new function
-        glAlphaFunc(func, ref);
+void OpenGLState::_setTexGen(int unit, int r, int s, int t) {
+    if (this->_count(this->texGenRs[unit] != r)) {
+        this->_setActiveTexture(unit);
+        glTexGeni(GL_R, GL_TEXTURE_GEN_MODE, r);
+        this->texGenRs[unit] = r;
+    }
+    if (this->_count(this->texGenSs[unit] != s)) {
+        this->_setActiveTexture(unit);
+        glTexGeni(GL_S, GL_TEXTURE_GEN_MODE, s);
+        this->texGenSs[unit] = s;
+    }
+    if (this->_count(this->texGenTs[unit] != t)) {
+        this->_setActiveTexture(unit);
+        glTexGeni(GL_T, GL_TEXTURE_GEN_MODE, t);
+        this->texGenTs[unit] = t;
+    }
+}
 
-        // Reset the current function
-        this->alphaFunction = function;
-        this->alphaValue = value;
+void OpenGLState::_setBlend(bool blend, int src, int dst) {
+    if (this->_count(this->blend != blend)) {
+        if (blend) {
+            glEnable(GL_BLEND);
+        } else {
+            glDisable(GL_BLEND);
+        }
+        this->blend = blend;
+    }
+
+    // The function doesn't matter while blending is off
+    if (!blend) return;
+    if (this->_count(this->blendSrc != src || this->blendDst != dst)) {
+        glBlendFunc(src, dst);
+        this->blendSrc = src;
+        this->blendDst = dst;
     }
 }
 
 void OpenGLState::setTexture(int texture) {
-    glActiveTexture(GL_TEXTURE0);
-    glEnable(GL_TEXTURE_2D);
-    glBindTexture(GL_TEXTURE_2D, texture);
+    this->_enableTexture(0, true);
+    this->_bindTexture(0, texture);
 
     // Now go through disabling anything thats left
     for (int i = 1; i < this->lastUsedTextures; ++i) {
-        glActiveTexture(GL_TEXTURE0 + i);
-        glDisable(GL_TEXTURE_2D);
+        this->_enableTexture(i, false);
     }
     this->lastUsedTextures = 1;
 }
 
+void OpenGLState::clearTextures() {
+    for (int i = 0; i < this->lastUsedTextures; ++i) {
+        this->_enableTexture(i, false);
+    }
+    this->lastUsedTextures = 0;
+}
+
 void OpenGLState::setTextures(const list<ShaderLayer *> & layers) {
     int index = 0;
 
@@ -170,32 +271,27 @@ void OpenGLState::setTextures(const list<ShaderLayer *> & layers) {
         if (texture == NULL) {
             continue;
         }
+        if (index >= this->maxTextures) {
+            break;
+        }
 
-        glActiveTexture(GL_TEXTURE0 + index);
-        glEnable(GL_TEXTURE_2D);
-
-        glBindTexture(GL_TEXTURE_2D, texture->texture);
-        this->currentTextures[index] = texture->texture;
+        this->_enableTexture(index, true);
+        this->_bindTexture(index, texture->texture);
 
         // Set the texture environment
         // This should only really be used when we multi-pass
         //glTexEnvf(GL_TEXTURE_ENV, GL_TEXTURE_ENV_MODE, layer->texEnv);
 
         // Set the texgen
-        glTexGeni(GL_R, GL_TEXTURE_GEN_MODE, layer->texGenR);
-        glTexGeni(GL_S, GL_TEXTURE_GEN_MODE, layer->texGenS);
-        glTexGeni(GL_T, GL_TEXTURE_GEN_MODE, layer->texGenT);
+        this->_setTexGen(index, layer->texGenR, layer->texGenS, layer->texGenT);
 
         // Set the wrapping
         // This doesn't seem to help at all
         //glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, layer->wrapT);
 
         // If the bottom layer has a blend function, we use it
-        if (index == 0 && layer->blend) {
-            glEnable(GL_BLEND);
-            glBlendFunc(layer->blendSrc, layer->blendDst);
-        } else {
-            glDisable(GL_BLEND);
+        if (index == 0) {
+            this->_setBlend(layer->blend, layer->blendSrc, layer->blendDst);
         }
 
         ++index;
@@ -203,9 +299,37 @@ void OpenGLState::setTextures(const list<ShaderLayer *> & layers) {
 
     // Now go through disabling anything thats left
     for (int i = index; i < this->lastUsedTextures; ++i) {
-        glActiveTexture(GL_TEXTURE0 + i);
-        glDisable(GL_TEXTURE_2D);
+        this->_enableTexture(i, false);
     }
 
     this->lastUsedTextures = index;
 }
+
+void OpenGLState::setClientActiveTexture(int unit) {
+    if (this->_count(this->clientActiveTexture != unit)) {
+        glClientActiveTexture(GL_TEXTURE0 + unit);
+        this->clientActiveTexture = unit;
+    }
+}
+
+void OpenGLState::setClientArrays(int nTextureCoords) {
+    if (this->_count(!this->vertexArray)) {
+        glEnableClientState(GL_VERTEX_ARRAY);
+        this->vertexArray = true;
+    }
+    if (this->_count(!this->normalArray)) {
+        glEnableClientState(GL_NORMAL_ARRAY);
+        this->normalArray = true;
+    }
+
+    if (!this->_count(this->textureCoordArrays != nTextureCoords)) return;
+    for (int i = this->textureCoordArrays; i < nTextureCoords; ++i) {
+        this->setClientActiveTexture(i);
+        glEnableClientState(GL_TEXTURE_COORD_ARRAY);
+    }
+    for (int i = nTextureCoords; i < this->textureCoordArrays; ++i) {
+        this->setClientActiveTexture(i);
+        glDisableClientState(GL_TEXTURE_COORD_ARRAY);
+    }
+    this->textureCoordArrays = nTextureCoords;
+}
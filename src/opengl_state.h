@@ -1,7 +1,13 @@
 /**
  * Keep track of the openGL state and manage the state changes. This is faster than
- * querying the API all the time and it means we can nicely encapsulate state checks 
+ * querying the API all the time and it means we can nicely encapsulate state checks
  * and changes.
+ *
+ * Everything that the dofs change while drawing goes through here: the textures,
+ * their texgen and enables on each unit, blending, the alpha test, culling and the
+ * client arrays. Only calls that actually change something get to the driver. The
+ * HUD and the setup in main still go straight to OpenGL, reset() puts everything
+ * back to a known state at the start of each frame.
  */
 #pragma once
 
@@ -13,31 +19,32 @@ using namespace std;
 
 class OpenGLState {
     public:
-        bool alphaTest;
-        bool texture2d;
+        OpenGLState();
+        ~OpenGLState();
+
         bool depthTest;
         float ambient[4];
         float diffuse[4];
         float specular[4];
         float emission[4];
-        unsigned int texture;
 
-        // The blending src and dsts
-        int * blendSrcs;
-        int * blendDsts;
+        // The blending function, only the bottom layer's is used
         bool blend;
-
-        // The current texgen values
-        int * texGenRs;
-        int * texGenSs;
-        int * texGenTs;
+        int blendSrc;
+        int blendDst;
 
         // A global openGL state
         static OpenGLState global;
 
-        // Reset the state to default
+        // Reset the state to default, forcing everything out to OpenGL. This also
+        // clears the counters
         void reset();
 
+        // Calls made to OpenGL and calls that were skipped because nothing would
+        // have changed, since the last reset (so for the frame so far)
+        int nIssued;
+        int nFiltered;
+
         // Culling
         // Same as shader: 0: none, 1: back, 2: front
         int culling;
@@ -46,21 +53,52 @@ class OpenGLState {
         // Alpha blending function and value
         // 0: never, 1: always / none, 2: less [value], 3: lequal [value],
         // 4: equal [value], 5: gequal [value], 6: greater [value], 7: notequal [value]
+        // The test is turned off for 1
+        bool alphaTest;
         int alphaFunction;
         int alphaValue;
         void setAlpha(int function, int value);
 
-        // Manage the state of the texture objects. We use multitexturing, so either a 
+        // Manage the state of the texture objects. We use multitexturing, so either a
         // single texture can be set as current, or several can be and multitextuing will
         // be used
         // Keep track of which GL_TEXTUREi_ARB is being used
         int maxTextures;
-        int * multiTextures;
-        int * currentTextures;
-        // So we know which textures we need to disable
+        int activeTexture;
+        // Per texture unit: the bound texture, whether GL_TEXTURE_2D is on and the
+        // texgen modes
+        unsigned int * currentTextures;
+        bool * enabledTextures;
+        int * texGenRs;
+        int * texGenSs;
+        int * texGenTs;
+        // So we know which textures we need to disable, and how many sets of texture
+        // coordinates the geobs need
         int lastUsedTextures;
 
         // Set an array of textures
         void setTextures(const list<ShaderLayer *> & layers);
         void setTexture(int texture);
+        // Turn texturing off, for materials without any
+        void clearTextures();
+
+        // The client arrays. The vertex and normal arrays are always on when drawing,
+        // the texture coordinates are on for the first textureCoordArrays units
+        int clientActiveTexture;
+        bool vertexArray;
+        bool normalArray;
+        int textureCoordArrays;
+        void setClientArrays(int nTextureCoords);
+        // Pick the unit glTexCoordPointer sets
+        void setClientActiveTexture(int unit);
+
+    private:
+        // Count a call that was needed or not, returns needed
+        bool _count(bool needed);
+
+        void _setActiveTexture(int unit);
+        void _enableTexture(int unit, bool enable);
+        void _bindTexture(int unit, unsigned int texture);
+        void _setTexGen(int unit, int r, int s, int t);
+        void _setBlend(bool blend, int src, int dst);
 };
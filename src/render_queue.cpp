@@ -0,0 +1,268 @@
+#include "render_queue.h"
+
+#include <cstring>
+#include <boost/foreach.hpp>
+
+using namespace std;
+
+// Where each part of the key starts, and how many bits it has
+#define KEY_PASS_SHIFT 62
+#define KEY_SHADER_SHIFT 48
+#define KEY_TEXTURE_SHIFT 34
+#define KEY_CULLING_SHIFT 32
+#define KEY_ALPHA_FUNCTION_SHIFT 29
+#define KEY_ALPHA_VALUE_SHIFT 21
+#define KEY_BUFFER_SHIFT 5
+
+#define KEY_ID_BITS 14
+#define KEY_BUFFER_BITS 16
+
+// The depth takes the 32 bits below the pass in the transparent pass
+#define KEY_DEPTH_SHIFT 30
+
+RenderItem::RenderItem() {
+    this->pass = RENDER_PASS_OPAQUE;
+    this->geob = NULL;
+    this->mat = NULL;
+    this->counts = NULL;
+    this->offsets = NULL;
+    this->nRanges = 0;
+    this->boundingBox = NULL;
+}
+
+RenderItem::RenderItem(int pass, Geob & geob, Mat & mat) {
+    this->pass = pass;
+    this->geob = &geob;
+    this->mat = &mat;
+    this->counts = NULL;
+    this->offsets = NULL;
+    this->nRanges = 0;
+    this->boundingBox = geob.boundingBox;
+}
+
+RenderItem::RenderItem(int pass, Geob & geob, Mat & mat, const GLsizei * counts,
+        const GLvoid ** offsets, int nRanges, const float * boundingBox) {
+    this->pass = pass;
+    this->geob = &geob;
+    this->mat = &mat;
+    this->counts = counts;
+    this->offsets = offsets;
+    this->nRanges = nRanges;
+    this->boundingBox = boundingBox;
+}
+
+RenderQueue::RenderQueue() {
+    this->nItems = 0;
+    this->nMaterialChanges = 0;
+    this->nBufferChanges = 0;
+    this->_transform = -1;
+    for (int i = 0; i < 16; ++i) {
+        this->_view[i] = (i % 5 == 0) ? 1 : 0;
+    }
+}
+
+void RenderQueue::clear() {
+    this->_items.clear();
+    this->_transforms.clear();
+    this->_transform = -1;
+    glGetFloatv(GL_MODELVIEW_MATRIX, this->_view);
+}
+
+void RenderQueue::captureTransform() {
+    this->_transform = this->_transforms.size() / 16;
+    this->_transforms.resize(this->_transforms.size() + 16);
+    glGetFloatv(GL_MODELVIEW_MATRIX, &this->_transforms[this->_transform * 16]);
+}
+
+void RenderQueue::releaseTransform() {
+    this->_transform = -1;
+}
+
+float RenderQueue::_depth(const float * box) {
+    float * matrix = this->_transform >= 0 ? &this->_transforms[this->_transform * 16]
+        : this->_view;
+
+    // Only the z of the centre is needed, the matrix is column major
+    float x = (box[0] + box[1]) / 2;
+    float y = (box[2] + box[3]) / 2;
+    float z = (box[4] + box[5]) / 2;
+    return matrix[2] * x + matrix[6] * y + matrix[10] * z + matrix[14];
+}
+
+// Turn a float into an int that sorts in the same order
+static unsigned int sortableFloat(float value) {
+    unsigned int bits;
+    memcpy(&bits, &value, sizeof(bits));
+    return (bits & 0x80000000) ? ~bits : bits | 0x80000000;
+}
+
+int RenderQueue::_id(const void * object) {
+    if (object == NULL) return 0;
+
+    map<const void *, int>::iterator it = this->_ids.find(object);
+    if (it != this->_ids.end()) return it->second;
+
+    // Anything past the number of bits shares an id, which only costs some sorting
+    int id = (this->_ids.size() + 1) & ((1 << KEY_ID_BITS) - 1);
+    this->_ids[object] = id;
+    return id;
+}
+
+unsigned long long RenderQueue::_materialKey(Mat & mat) {
+    // This has to follow what Dof::loadMaterial looks at
+    unsigned long long key = 0;
+    if (mat.shader != NULL) {
+        ShaderLayer * layer = mat.shader->layers[0];
+        key |= (unsigned long long)this->_id(mat.shader) << KEY_SHADER_SHIFT;
+        key |= (unsigned long long)this->_id(layer->texture) << KEY_TEXTURE_SHIFT;
+        key |= (unsigned long long)(layer->culling & 3) << KEY_CULLING_SHIFT;
+        key |= (unsigned long long)(layer->alphaFunction & 7) << KEY_ALPHA_FUNCTION_SHIFT;
+        key |= (unsigned long long)(layer->alphaValue & 255) << KEY_ALPHA_VALUE_SHIFT;
+    } else if (mat.nTextures > 0) {
+        key |= (unsigned long long)this->_id(mat.textures[0]) << KEY_TEXTURE_SHIFT;
+    }
+    return key;
+}
+
+void RenderQueue::add(int pass, Geob & geob, Mat & mat) {
+    this->add(pass, geob, mat, NULL, NULL, 0);
+}
+
+void RenderQueue::add(const RenderItem & item) {
+    this->add(item.pass, *item.geob, *item.mat, item.counts, item.offsets, item.nRanges,
+            item.boundingBox);
+}
+
+void RenderQueue::add(int pass, Geob & geob, Mat & mat, const GLsizei * counts,
+        const GLvoid ** offsets, int nRanges, const float * boundingBox) {
+    if (boundingBox == NULL) boundingBox = geob.boundingBox;
+    Geob & buffers = geob.instanceOf != NULL ? *geob.instanceOf : geob;
+
+    Item item;
+    item.key = (unsigned long long)pass << KEY_PASS_SHIFT;
+    if (pass == RENDER_PASS_TRANSPARENT) {
+        // Furthest away first
+        item.key |= (unsigned long long)sortableFloat(this->_depth(boundingBox))
+            << KEY_DEPTH_SHIFT;
+    } else {
+        item.key |= this->_materialKey(mat)
+            | (unsigned long long)(buffers.vertexVBO & ((1 << KEY_BUFFER_BITS) - 1))
+                << KEY_BUFFER_SHIFT;
+    }
+    item.geob = &geob;
+    item.mat = &mat;
+    item.pass = pass;
+    item.counts = counts;
+    item.offsets = offsets;
+    item.nRanges = nRanges;
+    item.boundingBox = boundingBox;
+    item.transform = this->_transform;
+    this->_items.push_back(item);
+}
+
+void RenderQueue::_sort() {
+    // Least significant byte first, each pass is stable so the order of the earlier
+    // bytes is kept
+    this->_sorted.resize(this->_items.size());
+    for (int shift = 0; shift < 64; shift += 8) {
+        int counts[256] = { 0 };
+        BOOST_FOREACH(Item & item, this->_items) {
+            ++counts[(item.key >> shift) & 255];
+        }
+
+        // Nothing to do if every item has the same byte here
+        if (counts[(this->_items[0].key >> shift) & 255] == (int)this->_items.size()) {
+            continue;
+        }
+
+        int offsets[256];
+        offsets[0] = 0;
+        for (int i = 1; i < 256; ++i) {
+            offsets[i] = offsets[i - 1] + counts[i - 1];
+        }
+        BOOST_FOREACH(Item & item, this->_items) {
+            this->_sorted[offsets[(item.key >> shift) & 255]++] = item;
+        }
+        this->_items.swap(this->_sorted);
+    }
+}
+
+int RenderQueue::execute() {
+    this->nItems = this->_items.size();
+    this->nMaterialChanges = 0;
+    this->nBufferChanges = 0;
+    if (this->_items.empty()) return 0;
+
+    this->_sort();
+
+    void * lastState = NULL;
+    unsigned int lastBuffer = 0;
+    bool first = true;
+    for (unsigned int i = 0; i < this->_items.size(); ++i) {
+        Item & item = this->_items[i];
+        Geob & buffers = item.geob->instanceOf != NULL ? *item.geob->instanceOf
+            : *item.geob;
+
+        // Materials with the same state key load the same thing, the buffers have
+        // to be bound again after a load as the number of texture units can change
+        bool load = first || item.mat->getStateKey() != lastState;
+        if (load) {
+            item.geob->dof->loadMaterial(*item.mat);
+            lastState = item.mat->getStateKey();
+            ++this->nMaterialChanges;
+        }
+        if (load || buffers.vertexVBO != lastBuffer) {
+            item.geob->bind();
+            lastBuffer = buffers.vertexVBO;
+            ++this->nBufferChanges;
+        }
+        first = false;
+
+        i = this->_draw(i);
+    }
+    return this->nItems;
+}
+
+unsigned int RenderQueue::_draw(unsigned int index) {
+    Item & item = this->_items[index];
+
+    if (item.transform >= 0) {
+        glPushMatrix();
+        glLoadMatrixf(&this->_transforms[item.transform * 16]);
+    }
+    if (item.pass == RENDER_PASS_SKY) Dof::pushSkyProjection();
+
+    unsigned int last = index;
+    if (item.nRanges > 0) {
+        // Take the ranges of the same geob from the items after this one too, they
+        // only come after it if nothing else had to be drawn in between
+        this->_counts.assign(item.counts, item.counts + item.nRanges);
+        this->_offsets.assign(item.offsets, item.offsets + item.nRanges);
+        while (last + 1 < this->_items.size()) {
+            Item & next = this->_items[last + 1];
+            if (next.geob != item.geob || next.mat != item.mat || next.nRanges == 0
+                    || next.pass != item.pass || next.transform != item.transform) {
+                break;
+            }
+            this->_counts.insert(this->_counts.end(), next.counts,
+                    next.counts + next.nRanges);
+            this->_offsets.insert(this->_offsets.end(), next.offsets,
+                    next.offsets + next.nRanges);
+            ++last;
+        }
+        item.geob->drawRanges(&this->_counts[0], &this->_offsets[0],
+                this->_counts.size());
+    } else {
+        item.geob->draw();
+    }
+
+    if (item.pass == RENDER_PASS_SKY) Dof::popSkyProjection();
+    if (item.transform >= 0) {
+        glPopMatrix();
+    }
+    return last;
+}
+
+int RenderQueue::getNChangesSaved() {
+    return 2 * this->nItems - this->nMaterialChanges - this->nBufferChanges;
+}
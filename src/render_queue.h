@@ -0,0 +1,126 @@
+/**
+ * Collects everything to be drawn in a frame and draws it sorted by the OpenGL state
+ * it needs, so the material is only loaded and the buffers only bound when they
+ * actually change. Drawing straight from the dofs sets up the material for every
+ * geob in whatever order the dofs were loaded.
+ *
+ * Each item gets a 64 bit key, sorted with a radix sort. From the top bit down:
+ *   pass (2 bits), shader (14), texture set (14), culling (2), alpha function (3),
+ *   alpha value (8), vertex buffer (16), unused (5)
+ * The shaders and textures are numbered as the queue first sees them. Items
+ * with the same key are drawn in the order they were added.
+ *
+ * Transparent items have to be drawn back to front, so in their pass the key is the
+ * pass followed by the depth of the centre of the bounding box in view space. That
+ * covers everything in the queue, so the car's windows sort with the track.
+ *
+ * Items that draw ranges of the same geob and end up next to each other are drawn
+ * together with one glMultiDrawElements.
+ */
+#pragma once
+
+#include "dof.h"
+
+#include <map>
+#include <vector>
+
+// The passes, drawn in this order
+#define RENDER_PASS_SKY 0
+#define RENDER_PASS_OPAQUE 1
+#define RENDER_PASS_TRANSPARENT 2
+
+// Something to draw, kept so it can be added to a queue each frame without working
+// it out again
+class RenderItem {
+    public:
+        RenderItem();
+        RenderItem(int pass, Geob & geob, Mat & mat);
+        RenderItem(int pass, Geob & geob, Mat & mat, const GLsizei * counts,
+                const GLvoid ** offsets, int nRanges, const float * boundingBox);
+
+        int pass;
+        Geob * geob;
+        Mat * mat;
+        // The ranges of the geob to draw, if nRanges is more than 0
+        const GLsizei * counts;
+        const GLvoid ** offsets;
+        int nRanges;
+        // What it covers, for culling and sorting
+        const float * boundingBox;
+};
+
+class RenderQueue {
+    public:
+        RenderQueue();
+
+        // Empty the queue for the next frame. This has to be called with the camera's
+        // modelview matrix set up, the queue is executed with the same one
+        void clear();
+
+        // Items added after this are drawn with the modelview matrix as it is now,
+        // rather than the camera's. This is for things like the car that are moved
+        // into place with the matrix
+        void captureTransform();
+
+        // Go back to drawing with the camera's modelview matrix
+        void releaseTransform();
+
+        // Queue a geob to be drawn with mat
+        void add(int pass, Geob & geob, Mat & mat);
+
+        // Queue nRanges ranges of a geob's index buffer, see Geob::drawRanges. The
+        // arrays have to stay around until the queue has been executed. The ranges
+        // are sorted as if they were at boundingBox if it's given, otherwise the geob's
+        void add(int pass, Geob & geob, Mat & mat, const GLsizei * counts,
+                const GLvoid ** offsets, int nRanges, const float * boundingBox = NULL);
+
+        void add(const RenderItem & item);
+
+        // Sort and draw everything, returns the number of items drawn
+        int execute();
+
+        // Figures for the last execute
+        int nItems;
+        int nMaterialChanges;
+        int nBufferChanges;
+
+        // Material loads and buffer binds saved compared to doing both for every item
+        int getNChangesSaved();
+
+    private:
+        class Item : public RenderItem {
+            public:
+                unsigned long long key;
+                // Index of the modelview matrix in _transforms, -1 for the camera's
+                int transform;
+        };
+
+        std::vector<Item> _items;
+        // Somewhere to sort into
+        std::vector<Item> _sorted;
+
+        // The ranges of items drawn together
+        std::vector<GLsizei> _counts;
+        std::vector<const GLvoid *> _offsets;
+
+        // The numbers given to shaders and textures
+        std::map<const void *, int> _ids;
+
+        // The camera's modelview matrix, and the ones captured for this frame
+        float _view[16];
+        std::vector<float> _transforms;
+        int _transform;
+
+        // The depth of the box's centre in view space, more negative is further away
+        float _depth(const float * box);
+
+        int _id(const void * object);
+        unsigned long long _materialKey(Mat & mat);
+
+        // Sort the items on their keys, keeping the order of items with the same key
+        void _sort();
+
+        // Draw the item, and the ones after it it can be drawn with. Returns the
+        // index of the last item drawn
+        unsigned int _draw(unsigned int index);
+};
@@ -1,5 +1,6 @@
 #include "shader.h"
 #include "lib.h"
+#include "file_index.h"
 
 #include <GL/gl.h>
 #include <boost/filesystem.hpp>
@@ -29,7 +30,7 @@ Shader::Shader() {
 void Shader::parseShaderFile(string shaderPath) {
     list<string> matches;
     list<string>::iterator it;
-    Ini ini(shaderPath);
+    Ini ini(FileIndex::find(shaderPath));
     string name;
     string value;
     vector<string> parts;
@@ -137,9 +138,10 @@ void Shader::_parseLayers(string iniPath, Ini & ini, Shader & shader) {
         }
 
         // See if there is a texgen_{s,t,r}
-        Shader::_checkForTexGen(ini, iniPath + "/" + *it + "/texgen_r", layer->texGenR);
-        Shader::_checkForTexGen(ini, iniPath + "/" + *it + "/texgen_s", layer->texGenS);
-        Shader::_checkForTexGen(ini, iniPath + "/" + *it + "/texgen_t", layer->texGenT);
+        string texGen = iniPath + "/" + *it + "/texgen_";
+        layer->texGen = Shader::_checkForTexGen(ini, texGen + "r", layer->texGenR);
+        layer->texGen |= Shader::_checkForTexGen(ini, texGen + "s", layer->texGenS);
+        layer->texGen |= Shader::_checkForTexGen(ini, texGen + "t", layer->texGenT);
 
         // Get the blending function
         Shader::_checkForBlendFunc(ini[iniPath + "/" + *it + "/blendfunc"], layer);
@@ -218,11 +220,13 @@ void Shader::_checkForBlendFunc(string value, ShaderLayer * layer) {
     }
 }
 
-void Shader::_checkForTexGen(Ini & ini, string type, int & result) {
+bool Shader::_checkForTexGen(Ini & ini, string type, int & result) {
     string value = ini[type];
     if (value == "object_linear") result = GL_OBJECT_LINEAR;
     else if (value == "reflection_map") result = GL_REFLECTION_MAP;
     else if (value == "sphere_map") result = GL_SPHERE_MAP;
+    else return false;
+    return true;
 }
 
 Shader * Shader::getShader(string name) {
@@ -269,6 +273,7 @@ ShaderLayer::ShaderLayer() {
     this->texGenR = GL_OBJECT_LINEAR;
     this->texGenS = GL_OBJECT_LINEAR;
     this->texGenT = GL_OBJECT_LINEAR;
+    this->texGen = false;
 
     //this->blendSrc = GL_SRC_ALPHA;
     //this->blendDst = GL_ONE_MINUS_SRC_ALPHA;
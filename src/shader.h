@@ -51,6 +51,8 @@ class ShaderLayer {
         int texGenS;
         int texGenT;
         int texGenR;
+        // Set when the shader asks for any of them
+        bool texGen;
 
         // The blender parameters
         bool blend;
@@ -87,7 +89,7 @@ class Shader {
         static Shader * getShader(string name);
         static void parseShaderFile(string file);
         static void _parseLayers(string path, Ini & ini, Shader & shader);
-        static void _checkForTexGen(Ini & ini, string type, int & result);
+        static bool _checkForTexGen(Ini & ini, string type, int & result);
         static void _checkForBlendFunc(string value, ShaderLayer * layer);
         static void _checkForTextureWrap(string value, int & result);
         static void _checkForTextureEnv(string value, int & result);
@@ -0,0 +1,279 @@
+#include "static_batcher.h"
+
+#include <math.h>
+#include <algorithm>
+#include <boost/foreach.hpp>
+
+using namespace std;
+
+bool StaticBatcher::enabled = false;
+float StaticBatcher::chunkSize = 100;
+
+// Most vertices a batch can have with short indices
+#define BATCH_MAX_VERTICES 65536
+
+// The geometry for a batch as it's collected
+class BatchGeometry {
+    public:
+        vector<float> vertices;
+        vector<float> normals;
+        vector<float> textureCoords;
+        vector<unsigned short> indices;
+        // Where each chunk starts in indices, and its bounding box
+        vector<int> chunkStarts;
+        vector<float> boundingBoxes;
+
+        int getNVertices() {
+            return this->vertices.size() / 3;
+        }
+
+        void startChunk() {
+            this->chunkStarts.push_back(this->indices.size());
+        }
+
+        // Add the geob to the current chunk
+        void add(Geob & geob);
+
+        // Make a geob out of it all with a burst for each chunk
+        Geob * makeGeob(Geob & first);
+};
+
+void BatchGeometry::add(Geob & geob) {
+    int offset = this->getNVertices();
+
+    // Missing normals and texture coordinates are 0, as they are in the geob's own
+    // vertex data
+    for (unsigned int i = 0; i < geob.nVertices; ++i) {
+        this->vertices.insert(this->vertices.end(), geob.vertices[i], geob.vertices[i] + 3);
+        for (int j = 0; j < 3; ++j) {
+            this->normals.push_back(i < geob.nNormals ? geob.normals[i][j] : 0);
+        }
+        for (int j = 0; j < 2; ++j) {
+            this->textureCoords.push_back(
+                    i < geob.nTextureCoords ? geob.textureCoords[i][j] : 0);
+        }
+    }
+
+    // Only the geob's ranges get drawn, the same as Geob::draw
+    for (int j = 0; j < geob.nRanges; ++j) {
+        int start = (size_t)geob.rangeOffsets[j] / sizeof(unsigned short);
+        for (int i = start; i < start + geob.rangeCounts[j]; ++i) {
+            this->indices.push_back(geob.indices[i] + offset);
+        }
+    }
+
+    // The geob's box goes into the chunk's
+    bool first = this->boundingBoxes.size() < this->chunkStarts.size() * 6;
+    if (first) {
+        this->boundingBoxes.insert(this->boundingBoxes.end(), geob.boundingBox,
+                geob.boundingBox + 6);
+    } else {
+        float * box = &this->boundingBoxes[this->boundingBoxes.size() - 6];
+        for (int i = 0; i < 6; i += 2) {
+            box[i] = min(box[i], geob.boundingBox[i]);
+            box[i + 1] = max(box[i + 1], geob.boundingBox[i + 1]);
+        }
+    }
+}
+
+Geob * BatchGeometry::makeGeob(Geob & first) {
+    Geob * geob = new Geob();
+    geob->dof = first.dof;
+    geob->material = first.material;
+
+    geob->nIndices = this->indices.size();
+    geob->indices = new unsigned short[geob->nIndices];
+    copy(this->indices.begin(), this->indices.end(), geob->indices);
+
+    geob->nVertices = this->getNVertices();
+    geob->nNormals = geob->nVertices;
+    geob->nTextureCoords = geob->nVertices;
+    geob->vertices = new float[geob->nVertices][3];
+    geob->normals = new float[geob->nVertices][3];
+    geob->textureCoords = new float[geob->nVertices][2];
+    copy(this->vertices.begin(), this->vertices.end(), geob->vertices[0]);
+    copy(this->normals.begin(), this->normals.end(), geob->normals[0]);
+    copy(this->textureCoords.begin(), this->textureCoords.end(), geob->textureCoords[0]);
+
+    // The bursts are in thirds of an index like the ones in the dofs
+    geob->nBursts = this->chunkStarts.size();
+    geob->burstStarts = new int[geob->nBursts];
+    geob->burstsCount = new int[geob->nBursts];
+    geob->burstsMaterials = new int[geob->nBursts];
+    for (int i = 0; i < geob->nBursts; ++i) {
+        int end = i + 1 < geob->nBursts ? this->chunkStarts[i + 1] : geob->nIndices;
+        geob->burstStarts[i] = this->chunkStarts[i] * 3;
+        geob->burstsCount[i] = (end - this->chunkStarts[i]) * 3;
+        geob->burstsMaterials[i] = geob->material;
+    }
+    geob->compileBursts();
+
+    for (int i = 0; i < 6; i += 2) {
+        geob->boundingBox[i] = this->boundingBoxes[i];
+        geob->boundingBox[i + 1] = this->boundingBoxes[i + 1];
+        for (unsigned int j = i; j < this->boundingBoxes.size(); j += 6) {
+            geob->boundingBox[i] = min(geob->boundingBox[i], this->boundingBoxes[j]);
+            geob->boundingBox[i + 1] = max(geob->boundingBox[i + 1],
+                    this->boundingBoxes[j + 1]);
+        }
+    }
+    return geob;
+}
+
+StaticBatcher::Batch::Batch() {
+    this->mat = NULL;
+    this->transparent = false;
+    this->geob = NULL;
+}
+
+StaticBatcher::Batch::~Batch() {
+    if (this->geob != NULL) delete this->geob;
+}
+
+StaticBatcher::StaticBatcher() {
+    this->nGeobs = 0;
+    this->_nChunks = 0;
+}
+
+void StaticBatcher::add(Dof & dof) {
+    BOOST_FOREACH(Geob & geob, dof.getGeobs()) {
+        if (geob.nVertices == 0 || geob.nIndices == 0) continue;
+        if (geob.material >= dof.getMats().size()) continue;
+
+        // Copies already share their buffers with the instancer. The geob they are
+        // a copy of has to keep its buffers, it might have been merged already
+        if (geob.instanceOf != NULL) {
+            this->_shared.insert(geob.instanceOf);
+            continue;
+        }
+        if (geob.batched) continue;
+
+        // Geobs with simplified versions draw on their own, so far away they can
+        // use one of them
+        if (geob.nLods > 0) continue;
+
+        // The sky has its own projection, so it's left to the dof
+        Mat & mat = dof.getMats()[geob.material];
+        if (mat.shader != NULL && mat.shader->isSky) continue;
+
+        pair<bool, void *> key(mat.isTransparent(), mat.getStateKey());
+        if (this->_geobsIndex.count(key) == 0) {
+            this->_geobsIndex[key] = this->_geobs.size();
+            this->_geobs.push_back(vector<Geob *>());
+        }
+        this->_geobs[this->_geobsIndex[key]].push_back(&geob);
+
+        geob.merged = true;
+        geob.batched = true;
+        ++this->nGeobs;
+    }
+}
+
+void StaticBatcher::build() {
+    BOOST_FOREACH(vector<Geob *> & geobs, this->_geobs) {
+        // Put back the geobs that turned out to have copies, they get their buffers
+        // now and the dof draws them
+        vector<Geob *> merged;
+        BOOST_FOREACH(Geob * geob, geobs) {
+            if (this->_shared.count(geob) > 0) {
+                geob->merged = false;
+                geob->batched = false;
+                // generateVAO threw its packed vertices away when it was merged
+                geob->packVertexData();
+                geob->generateVAO();
+                --this->nGeobs;
+            } else {
+                merged.push_back(geob);
+            }
+        }
+        this->_build(merged);
+    }
+    this->_geobs.clear();
+    this->_geobsIndex.clear();
+    this->_shared.clear();
+}
+
+void StaticBatcher::_build(vector<Geob *> & geobs) {
+    // Sort the geobs by the chunk their centre is in, keeping them in the order they
+    // were added otherwise
+    vector<pair<pair<int, int>, int> > order;
+    for (unsigned int i = 0; i < geobs.size(); ++i) {
+        float * box = geobs[i]->boundingBox;
+        pair<int, int> chunk(
+                (int)floorf((box[0] + box[1]) / 2 / StaticBatcher::chunkSize),
+                (int)floorf((box[4] + box[5]) / 2 / StaticBatcher::chunkSize));
+        order.push_back(make_pair(chunk, i));
+    }
+    sort(order.begin(), order.end());
+
+    BatchGeometry * geometry = NULL;
+    Geob * first = NULL;
+    for (unsigned int i = 0; i <= order.size(); ++i) {
+        Geob * geob = i < order.size() ? geobs[order[i].second] : NULL;
+
+        // Finish the batch when it's full, or there's nothing left
+        if (geometry != NULL && (geob == NULL
+                    || geometry->getNVertices() + geob->nVertices > BATCH_MAX_VERTICES)) {
+            Batch * batch = new Batch();
+            batch->mat = &first->dof->getMats()[first->material];
+            batch->transparent = batch->mat->isTransparent();
+            batch->geob = geometry->makeGeob(*first);
+            batch->boundingBoxes = geometry->boundingBoxes;
+            this->_batches.push_back(batch);
+
+            this->_nChunks += batch->geob->nBursts;
+
+            batch->geob->buildVertexData();
+            batch->geob->packVertexData();
+            batch->geob->generateVAO();
+
+            for (int j = 0; j < batch->geob->nBursts; ++j) {
+                batch->counts.push_back(batch->geob->burstsCount[j] / 3);
+                batch->offsets.push_back((const GLvoid *)((char *)NULL
+                            + batch->geob->burstStarts[j] / 3 * sizeof(unsigned short)));
+            }
+
+            delete geometry;
+            geometry = NULL;
+        }
+        if (geob == NULL) break;
+
+        if (geometry == NULL) {
+            geometry = new BatchGeometry();
+            first = geob;
+            geometry->startChunk();
+        } else if (order[i].first != order[i - 1].first) {
+            geometry->startChunk();
+        }
+        geometry->add(*geob);
+        this->_chunkGeobs.push_back(
+                make_pair(geob, this->_nChunks + geometry->chunkStarts.size() - 1));
+    }
+}
+
+void StaticBatcher::getItems(vector<RenderItem> & items) {
+    BOOST_FOREACH(Batch & batch, this->_batches) {
+        for (int i = 0; i < batch.geob->nBursts; ++i) {
+            items.push_back(RenderItem(
+                        batch.transparent ? RENDER_PASS_TRANSPARENT : RENDER_PASS_OPAQUE,
+                        *batch.geob, *batch.mat, &batch.counts[i], &batch.offsets[i], 1,
+                        &batch.boundingBoxes[i * 6]));
+        }
+    }
+}
+
+void StaticBatcher::getChunkGeobs(vector<pair<Geob *, int> > & geobs) {
+    geobs.insert(geobs.end(), this->_chunkGeobs.begin(), this->_chunkGeobs.end());
+}
+
+int StaticBatcher::getNBatches() {
+    return this->_batches.size();
+}
+
+int StaticBatcher::getNChunks() {
+    int count = 0;
+    BOOST_FOREACH(Batch & batch, this->_batches) {
+        count += batch.geob->nBursts;
+    }
+    return count;
+}
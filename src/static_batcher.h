@@ -0,0 +1,92 @@
+/**
+ * Merges the static scenery into a few big buffers. Left to themselves the dofs draw
+ * each geob on its own and set up its material first, which for a whole track is
+ * thousands of small draws. Here the opaque geobs that load the same OpenGL state are
+ * copied into shared buffers when the track loads, so a frame is a handful of draws
+ * per material rather than one per geob.
+ *
+ * The geobs are grouped into chunks, squares of chunkSize on the ground, and each
+ * chunk keeps its bounding box so it can still be culled. The chunks are handed to
+ * the track as items of their own, and the render queue draws the visible chunks of
+ * a buffer with a single glMultiDrawElements.
+ *
+ * Transparent geobs are merged as well, the queue sorts their chunks by depth.
+ *
+ * The buffers use short indices like the geobs, so a material with a lot of geometry
+ * is split over several of them. Short positions are spread over a whole buffer
+ * rather than one geob, so they lose some precision.
+ */
+#pragma once
+
+#include "dof.h"
+#include "render_queue.h"
+
+#include <map>
+#include <set>
+#include <vector>
+#include <boost/ptr_container/ptr_vector.hpp>
+
+class StaticBatcher {
+    public:
+        StaticBatcher();
+
+        // Take the geobs that can be merged from the dof. Like MeshInstancer::add
+        // this has to be called before the dof is uploaded, as the merged geobs
+        // don't get buffers
+        void add(Dof & dof);
+
+        // Copy the geobs into the buffers and upload them, once all the dofs have
+        // been added
+        void build();
+
+        // Add an item for each chunk to items, they're culled by the track
+        void getItems(std::vector<RenderItem> & items);
+
+        // Each merged geob, with the index of its chunk in what getItems adds
+        void getChunkGeobs(std::vector<std::pair<Geob *, int> > & geobs);
+
+        // Turn the batching on, off by default. This has to be set before the track
+        // is loaded
+        static bool enabled;
+        // Size of the chunks on the ground
+        static float chunkSize;
+
+        // Geobs merged into the batches
+        int nGeobs;
+
+        int getNBatches();
+        int getNChunks();
+
+    private:
+        // A buffer of geobs with the same state. The geob's bursts are the chunks
+        class Batch {
+            public:
+                Batch();
+                ~Batch();
+
+                Mat * mat;
+                bool transparent;
+                Geob * geob;
+                // Bounding box for each burst
+                std::vector<float> boundingBoxes;
+
+                // The range of each chunk, for the items
+                std::vector<GLsizei> counts;
+                std::vector<const GLvoid *> offsets;
+        };
+
+        // The geobs waiting to be merged, grouped by whether they are transparent and
+        // Mat::getStateKey
+        std::vector<std::vector<Geob *> > _geobs;
+        std::map<std::pair<bool, void *>, int> _geobsIndex;
+        // Geobs that copies draw with, these can't be merged
+        std::set<Geob *> _shared;
+        // The merged geobs and their chunks, counting through all the batches
+        std::vector<std::pair<Geob *, int> > _chunkGeobs;
+        int _nChunks;
+
+        boost::ptr_vector<Batch> _batches;
+
+        // Build the batches for geobs with the same state
+        void _build(std::vector<Geob *> & geobs);
+};
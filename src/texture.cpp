@@ -1,28 +1,68 @@
 #include "texture.h"
 #include "logger.h"
+#include "load_timer.h"
+#include "worker_pool.h"
+#include "texture_cache.h"
+#include "mipmap_generator.h"
+#include "file_index.h"
 #include <SDL/SDL.h>
 #include <SDL/SDL_image.h>
+#include <GL/glext.h>
 #include <iostream>
-#include <boost/filesystem.hpp>
-#include <boost/algorithm/string.hpp>
 
 map<string, Texture * > Texture::textures;
+list<Texture *> Texture::_pendingUploads;
+bool Texture::deferUploads = false;
+bool Texture::asyncDecode = false;
+double Texture::uploadTime = 2;
+unsigned int Texture::placeholder = 0;
+pthread_mutex_t Texture::_mutex = PTHREAD_MUTEX_INITIALIZER;
+WorkerPool * Texture::_pool = NULL;
+
+// Decodes a texture on the pool and queues it for upload
+class TextureDecodeJob : public Job {
+    public:
+        TextureDecodeJob(Texture * texture) : _texture(texture) {}
+
+        void run() {
+            this->_texture->_decode();
+            this->_texture->_queueUpload();
+        }
+
+    private:
+        Texture * _texture;
+};
 
 Texture::Texture(string name, bool isMipmap) {
     this->name = name;
     this->isMipmap = isMipmap;
-    this->_loadTexture(name);
+    this->texture = 0;
+    this->_surface = NULL;
+    this->_levels = NULL;
+    this->_uploaded = false;
+    this->_bytes = 0;
 }
 
-void Texture::_loadTexture(string name) {
+void Texture::_decode() {
     // Try and load the image
     SDL_Surface * surface;
     SDL_Surface * alphaSurface;
-    int nOfColours;
-    GLenum textureFormat = 0;
-    unsigned int error = glGetError();
+    double start = LoadTimer::now();
     
-    std::string realFilename = Texture::findRealFileName(name);
+    std::string realFilename = FileIndex::find(this->name);
+
+    // A warm start doesn't need to decode anything
+    if (!TextureCache::cachePath.empty()) {
+        this->_levels = new TextureLevels();
+        if (TextureCache::read(realFilename, this->isMipmap, *this->_levels)) {
+            TextureCache::count(true, LoadTimer::now() - start);
+            LoadTimer::add("texture cache", LoadTimer::now() - start);
+            return;
+        }
+        delete this->_levels;
+        this->_levels = NULL;
+    }
+
     if ((surface = IMG_Load(realFilename.c_str()))) {
         SDL_SetColorKey(surface, SDL_SRCCOLORKEY, SDL_MapRGB(surface->format, 255, 0, 255));
         alphaSurface = SDL_DisplayFormatAlpha(surface);
@@ -32,147 +72,355 @@ void Texture::_loadTexture(string name) {
 
         // Check that width and height are powers of 2
         if ((surface->w & (surface->w - 1)) != 0 ) {
-            Logger::warn << "Warning: width not power of 2 " << name << endl;
+            this->_warning = "Warning: width not power of 2 " + this->name;
             SDL_FreeSurface(surface);
-            return;
-        }
-        if ((surface->h & (surface->h -1)) != 0) {
-            Logger::warn << "Warning: height not power of 2 " << name << endl;
+            surface = NULL;
+        } else if ((surface->h & (surface->h -1)) != 0) {
+            this->_warning = "Warning: height not power of 2 " + this->name;
             SDL_FreeSurface(surface);
-            return;
+            surface = NULL;
         }
+    } else {
+        const char * error = IMG_GetError();
+        this->_error = "Error loading texture (" + this->name + "): " 
+            + (error != NULL ? error : "");
+    }
 
-        // Get the number of channels in the SDL surface
-        nOfColours = surface->format->BytesPerPixel;
-        if (nOfColours == 4) {
-            if (surface->format->Rmask == 0x000000ff) {
-                textureFormat = GL_RGBA;
-            } else {
-                textureFormat = GL_BGRA;
-            }
-        } else if (nOfColours == 3) {
-            if (surface->format->Rmask == 0x000000ff) {
-                textureFormat = GL_RGB;
-            } else {
-                textureFormat = GL_BGR;
-            }
+    // Mipmaps, and everything for the cache, are made here off the main thread
+    // rather than by gluBuild2DMipmaps when it's uploaded
+    bool cached = !TextureCache::cachePath.empty();
+    if (surface != NULL && surface->format->BytesPerPixel == 4 
+            && (this->isMipmap || cached)) {
+        this->_buildLevels(surface);
+        SDL_FreeSurface(surface);
+        surface = NULL;
+
+        // Compressed entries have to wait for the GL to do the compressing
+        if (cached && !TextureCache::compress) {
+            TextureCache::write(realFilename, this->isMipmap, *this->_levels);
         }
-        // Have opengl generate a texture object
-        glGenTextures(1, &(this->texture));
+    }
+
+    this->_surface = surface;
+    if (cached) {
+        TextureCache::count(false, LoadTimer::now() - start);
+    }
+    LoadTimer::add("texture decode", LoadTimer::now() - start);
+}
 
-        // Bind the texture object
-        glBindTexture(GL_TEXTURE_2D, this->texture);
+void Texture::_buildLevels(SDL_Surface * surface) {
+    TextureLevels * levels = new TextureLevels();
 
-        /* Not sure what this is for yet and whether its needed
-        glPixelStorei(GL_UNPACK_ROW_LENGTH,0);
-        glPixelStorei(GL_UNPACK_SKIP_ROWS,0);
-        glPixelStorei(GL_UNPACK_SKIP_PIXELS,0);
-        */
+    // SDL_DisplayFormatAlpha always gives 4 bytes a pixel
+    levels->format = surface->format->Rmask == 0x000000ff ? GL_RGBA : GL_BGRA;
+    levels->nLevels = 1;
+    levels->widths[0] = surface->w;
+    levels->heights[0] = surface->h;
+    levels->sizes[0] = surface->w * surface->h * 4;
+    levels->offsets[0] = 0;
+    levels->buffer.resize(levels->sizes[0]);
 
-        // mix color with texture
-        //glTexEnvf(GL_TEXTURE_ENV, GL_TEXTURE_ENV_MODE, GL_REPLACE);
-        //glTexEnvf(GL_TEXTURE_ENV, GL_TEXTURE_ENV_MODE, GL_DECAL);
+    // The rows of the surface can be padded
+    SDL_LockSurface(surface);
+    for (int y = 0; y < surface->h; ++y) {
+        memcpy(&levels->buffer[y * surface->w * 4],
+                (unsigned char *)surface->pixels + y * surface->pitch, surface->w * 4);
+    }
+    SDL_UnlockSurface(surface);
 
+    if (this->isMipmap) MipmapGenerator::build(*levels);
+    this->_levels = levels;
+}
 
-        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_REPEAT);
-        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_REPEAT);
-        //glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+void Texture::upload() {
+    SDL_Surface * surface = this->_surface;
+    int nOfColours;
+    GLenum textureFormat = 0;
+    unsigned int error = glGetError();
+    double start = LoadTimer::now();
+    this->_uploaded = true;
 
-        // Write the texture data
-        if ((error = glGetError()) != 0) {
-            Logger::warn << "Error before loading texture: " << 
-                gluErrorString(error) << endl;
-            this->texture = 0;
-        }
+    // Report anything that went wrong in the decode
+    if (!this->_warning.empty()) {
+        Logger::warn << this->_warning << endl;
+    }
+    if (!this->_error.empty()) {
+        std::cout << this->_error << endl;
+        Logger::debug << this->_error << endl;
+    }
 
-        if (this->isMipmap) {
-            // Set the texture's stretching properties
-            glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, 
-                    GL_NEAREST_MIPMAP_NEAREST);
-            glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+    if (this->_levels != NULL) {
+        this->_uploadLevels();
+        LoadTimer::add("texture upload", LoadTimer::now() - start);
+        return;
+    }
 
-            gluBuild2DMipmaps(GL_TEXTURE_2D, nOfColours, surface->w, surface->h, 
-                    textureFormat, GL_UNSIGNED_BYTE, surface->pixels);
-        } else {
-            // Set the texture's stretching properties
-            glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
-            glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+    if (surface == NULL) {
+        this->texture = 0;
+        return;
+    }
+    this->_surface = NULL;
 
-            glTexImage2D(GL_TEXTURE_2D, 0, nOfColours, surface->w, surface->h, 
-                    0, textureFormat, GL_UNSIGNED_BYTE, surface->pixels);
+    // Get the number of channels in the SDL surface
+    nOfColours = surface->format->BytesPerPixel;
+    if (nOfColours == 4) {
+        if (surface->format->Rmask == 0x000000ff) {
+            textureFormat = GL_RGBA;
+        } else {
+            textureFormat = GL_BGRA;
         }
-
-        if ((error = glGetError()) != 0) {
-            Logger::warn << "Error loading texture into OpenGL: " << 
-                gluErrorString(error) << endl;
-            this->texture = 0;
+    } else if (nOfColours == 3) {
+        if (surface->format->Rmask == 0x000000ff) {
+            textureFormat = GL_RGB;
+        } else {
+            textureFormat = GL_BGR;
         }
+    }
+    // Have opengl generate a texture object
+    glGenTextures(1, &(this->texture));
 
-        // Set up the texture
-        this->width = surface->w;
-        this->height = surface->h;
-        this->nOfColours = nOfColours;
-        this->format = textureFormat;
+    // Bind the texture object
+    glBindTexture(GL_TEXTURE_2D, this->texture);
 
-        // Free the surface
-        SDL_FreeSurface(surface);
+    /* Not sure what this is for yet and whether its needed
+    glPixelStorei(GL_UNPACK_ROW_LENGTH,0);
+    glPixelStorei(GL_UNPACK_SKIP_ROWS,0);
+    glPixelStorei(GL_UNPACK_SKIP_PIXELS,0);
+    */
+
+    // mix color with texture
+    //glTexEnvf(GL_TEXTURE_ENV, GL_TEXTURE_ENV_MODE, GL_REPLACE);
+    //glTexEnvf(GL_TEXTURE_ENV, GL_TEXTURE_ENV_MODE, GL_DECAL);
+
+
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_REPEAT);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_REPEAT);
+    //glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+
+    // Write the texture data
+    if ((error = glGetError()) != 0) {
+        Logger::warn << "Error before loading texture: " << 
+            gluErrorString(error) << endl;
+        this->texture = 0;
+    }
+
+    if (this->isMipmap) {
+        // Set the texture's stretching properties
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, 
+                GL_NEAREST_MIPMAP_NEAREST);
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+
+        gluBuild2DMipmaps(GL_TEXTURE_2D, nOfColours, surface->w, surface->h, 
+                textureFormat, GL_UNSIGNED_BYTE, surface->pixels);
     } else {
-        std::cout << "Error loading texture (" << name << "): " << IMG_GetError() << endl;
-        Logger::debug << "Error loading texture (" << name << "): " << IMG_GetError() << endl;
-        texture = 0;
+        // Set the texture's stretching properties
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+
+        glTexImage2D(GL_TEXTURE_2D, 0, nOfColours, surface->w, surface->h, 
+                0, textureFormat, GL_UNSIGNED_BYTE, surface->pixels);
     }
+
+    if ((error = glGetError()) != 0) {
+        Logger::warn << "Error loading texture into OpenGL: " << 
+            gluErrorString(error) << endl;
+        this->texture = 0;
+    }
+
+    // Set up the texture
+    this->width = surface->w;
+    this->height = surface->h;
+    this->nOfColours = nOfColours;
+    this->format = textureFormat;
+    // The mipmaps add another third
+    this->_bytes = surface->w * surface->h * nOfColours;
+    if (this->isMipmap) this->_bytes += this->_bytes / 3;
+
+    // Free the surface
+    SDL_FreeSurface(surface);
+    LoadTimer::add("texture upload", LoadTimer::now() - start);
+}
+
+void Texture::_uploadLevels() {
+    TextureLevels * levels = this->_levels;
+    this->_levels = NULL;
+    unsigned int error;
+
+    // Raw levels are compressed by the GL on the way up when the cache wants them
+    // compressed
+    bool compress = TextureCache::compress && !levels->compressed;
+
+    glGenTextures(1, &(this->texture));
+    glBindTexture(GL_TEXTURE_2D, this->texture);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_REPEAT);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_REPEAT);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, 
+            this->isMipmap ? GL_NEAREST_MIPMAP_NEAREST : GL_NEAREST);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAX_LEVEL, levels->nLevels - 1);
+
+    for (int i = 0; i < levels->nLevels; ++i) {
+        if (levels->compressed) {
+            glCompressedTexImage2D(GL_TEXTURE_2D, i, levels->format, levels->widths[i],
+                    levels->heights[i], 0, levels->sizes[i], levels->getLevel(i));
+        } else {
+            glTexImage2D(GL_TEXTURE_2D, i, 
+                    compress ? GL_COMPRESSED_RGBA_S3TC_DXT5_EXT : GL_RGBA8, 
+                    levels->widths[i], levels->heights[i], 0, levels->format, 
+                    GL_UNSIGNED_BYTE, levels->getLevel(i));
+        }
+    }
+
+    if ((error = glGetError()) != 0) {
+        Logger::warn << "Error loading texture into OpenGL: " << 
+            gluErrorString(error) << endl;
+        this->texture = 0;
+        compress = false;
+    }
+
+    this->width = levels->widths[0];
+    this->height = levels->heights[0];
+    this->nOfColours = 4;
+    this->format = levels->compressed ? GL_RGBA : levels->format;
+    this->_bytes = 0;
+    for (int i = 0; i < levels->nLevels; ++i) this->_bytes += levels->sizes[i];
+
+    // Read back what the GL made of it for next time
+    GLint compressed = 0;
+    if (compress) {
+        glGetTexLevelParameteriv(GL_TEXTURE_2D, 0, GL_TEXTURE_COMPRESSED, &compressed);
+    }
+    if (compressed) {
+        TextureLevels packed;
+        packed.format = GL_COMPRESSED_RGBA_S3TC_DXT5_EXT;
+        packed.compressed = true;
+        packed.nLevels = levels->nLevels;
+        size_t size = 0;
+        for (int i = 0; i < levels->nLevels; ++i) {
+            GLint levelSize = 0;
+            glGetTexLevelParameteriv(GL_TEXTURE_2D, i, GL_TEXTURE_COMPRESSED_IMAGE_SIZE,
+                    &levelSize);
+            packed.widths[i] = levels->widths[i];
+            packed.heights[i] = levels->heights[i];
+            packed.sizes[i] = levelSize;
+            packed.offsets[i] = size;
+            size += levelSize;
+        }
+        packed.buffer.resize(size);
+        for (int i = 0; i < packed.nLevels; ++i) {
+            glGetCompressedTexImage(GL_TEXTURE_2D, i, &packed.buffer[packed.offsets[i]]);
+        }
+        TextureCache::write(FileIndex::find(this->name), this->isMipmap, packed);
+        this->_bytes = size;
+    }
+
+    delete levels;
 }
 
 Texture * Texture::getOrMakeTexture(string name, bool isMipmap) {
     Texture * texture;
+    bool created = false;
 
 	// Check if we have already loaded this name
+    pthread_mutex_lock(&Texture::_mutex);
     if (Texture::textures.count(name) > 0) {
         texture = Texture::textures[name];
     // Otherwise we need to create a new one
     } else {
         texture = new Texture(name, isMipmap);
         Texture::textures[name] = texture;
+        created = true;
+    }
+    pthread_mutex_unlock(&Texture::_mutex);
+
+    // Only the thread that created the texture loads it, and it does it outside the
+    // lock so the other loader threads aren't held up
+    if (created && Texture::asyncDecode) {
+        texture->texture = Texture::placeholder;
+
+        pthread_mutex_lock(&Texture::_mutex);
+        if (Texture::_pool == NULL) Texture::_pool = new WorkerPool();
+        pthread_mutex_unlock(&Texture::_mutex);
+        Texture::_pool->add(new TextureDecodeJob(texture));
+    } else if (created) {
+        texture->_decode();
+
+        if (Texture::deferUploads) {
+            texture->_queueUpload();
+        } else {
+            texture->upload();
+        }
     }
 
     return texture;
 }
 
-std::string Texture::findRealFileName(const std::string originalFile) {
-    // Check if the path exists straight off
-    if (boost::filesystem::exists(originalFile)) {
-        return originalFile;
-    }
+void Texture::_queueUpload() {
+    pthread_mutex_lock(&Texture::_mutex);
+    Texture::_pendingUploads.push_back(this);
+    pthread_mutex_unlock(&Texture::_mutex);
+}
 
-    // Get the path of the file and check it exists
-    boost::filesystem::path originalPath(originalFile);
-    originalPath.remove_filename();
+void Texture::uploadPending() {
+    list<Texture *> pending;
+    double start = LoadTimer::now();
 
-    if (!boost::filesystem::exists(originalPath)) return originalFile;
+    // Take the whole queue so the loader threads can keep adding to it
+    pthread_mutex_lock(&Texture::_mutex);
+    pending.swap(Texture::_pendingUploads);
+    pthread_mutex_unlock(&Texture::_mutex);
 
-    // Create a lower case version of the original path so that we can compare
-    std::string originalLowerPath = originalFile;
-    boost::to_lower(originalLowerPath);
+    for (list<Texture *>::iterator it = pending.begin(); it != pending.end(); ++it) {
+        (*it)->upload();
 
-    // We List the contents of the directory and check each file in lowercase
-    boost::filesystem::directory_iterator endIt;
-    for (boost::filesystem::directory_iterator it(originalPath); it != endIt; ++it) {
-        // Skip if it is a subdirectory
-        if (boost::filesystem::is_directory(it->status())) continue;
+        // Out of time, whatever's left goes back on the front of the queue
+        if (Texture::asyncDecode && LoadTimer::now() - start > Texture::uploadTime) {
+            pending.erase(pending.begin(), ++it);
+            pthread_mutex_lock(&Texture::_mutex);
+            Texture::_pendingUploads.splice(Texture::_pendingUploads.begin(), pending);
+            pthread_mutex_unlock(&Texture::_mutex);
+            return;
+        }
+    }
+}
 
-        // Get lowercase version of this file
-        std::string path = it->path().string();
-        boost::to_lower(path);
+void Texture::createPlaceholder() {
+    unsigned char grey[4] = { 128, 128, 128, 255 };
 
-        //std::cout << path << std::endl;
-        //std::cout << originalLowerPath << std::endl;
+    glGenTextures(1, &Texture::placeholder);
+    glBindTexture(GL_TEXTURE_2D, Texture::placeholder);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+    glTexImage2D(GL_TEXTURE_2D, 0, 4, 1, 1, 0, GL_RGBA, GL_UNSIGNED_BYTE, grey);
+    glBindTexture(GL_TEXTURE_2D, 0);
+}
 
-        if (originalLowerPath == path) {
-            return it->path().string();
-        }
+void Texture::discardPending() {
+    pthread_mutex_lock(&Texture::_mutex);
+    for (list<Texture *>::iterator it = Texture::_pendingUploads.begin(); 
+            it != Texture::_pendingUploads.end(); ++it) {
+        if ((*it)->_surface != NULL) SDL_FreeSurface((*it)->_surface);
+        (*it)->_surface = NULL;
+        delete (*it)->_levels;
+        (*it)->_levels = NULL;
     }
+    Texture::_pendingUploads.clear();
+    pthread_mutex_unlock(&Texture::_mutex);
+}
+
+long Texture::getMemoryUsage() {
+    return this->texture != 0 ? this->_bytes : 0;
+}
+
+bool Texture::release(Texture * texture) {
+    // The decode job or the upload queue still has it
+    if (!texture->_uploaded) return false;
+
+    pthread_mutex_lock(&Texture::_mutex);
+    Texture::textures.erase(texture->name);
+    pthread_mutex_unlock(&Texture::_mutex);
 
-    // If we don't find anything, just return the original path and let 
-    // SDL throw the error
-    return originalFile;
+    if (texture->texture != 0) glDeleteTextures(1, &texture->texture);
+    delete texture;
+    return true;
 }
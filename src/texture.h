@@ -8,12 +8,17 @@
 #pragma once
 
 #include <map>
+#include <list>
 #include <string>
+#include <pthread.h>
 #include <GL/gl.h>
 #include <GL/glu.h>
 
 using namespace std;
 
+struct SDL_Surface;
+class WorkerPool;
+class TextureLevels;
 
 class Texture {
     public:
@@ -31,14 +36,82 @@ class Texture {
         static map<string, Texture * > textures;
 
 	// Check Texture::textures for a texture matching this name, if one is found
-	// return it, otherwise create one and save to textures
+	// return it, otherwise create one and save to textures. This is safe to call
+	// from the loader threads as long as deferUploads is set
 	static Texture * getOrMakeTexture(string name, bool isMipmap=true);
 
+        // Upload the decoded image into a texture object. This is the only part of
+        // loading that touches OpenGL so it has to happen on the main thread
+        void upload();
+
+        // When set, decoded textures are queued up rather than uploaded, so they can
+        // be decoded off the main thread. uploadPending() does the queued uploads
+        static bool deferUploads;
+        static void uploadPending();
+
+        // Decode the textures on a pool of their own, off by default. getOrMakeTexture
+        // then returns straight away with the placeholder standing in for the texture,
+        // and it is uploaded by uploadPending once it has been decoded. Each call to
+        // uploadPending only spends about uploadTime milliseconds uploading, the rest
+        // are left for the next frame
+        static bool asyncDecode;
+        static double uploadTime;
+
+        // A plain grey texture for the ones that haven't been uploaded yet, this has
+        // to be made on the main thread before any textures are asked for
+        static unsigned int placeholder;
+        static void createPlaceholder();
+
+        // Throw the queued uploads away, for tools that load without OpenGL
+        static void discardPending();
+
+        // Roughly how many bytes the texture takes up in OpenGL, 0 until it has been
+        // uploaded
+        long getMemoryUsage();
+
+        // Delete the texture and take it out of textures, so it's loaded again if it
+        // is asked for. Anything still pointing at it has to have gone already. It
+        // can't go while it's being decoded or waiting for upload, that returns false
+        // and leaves it alone. Main thread only
+        static bool release(Texture * texture);
+
     private:
-        // Load a texture into a texture object
-        void _loadTexture(string name);
+        friend class TextureDecodeJob;
+
+        // Decode the image file into _surface, ready for upload
+        void _decode();
+
+        // Queue a decoded texture for upload
+        void _queueUpload();
+
+        // Copy the decoded surface into _levels with a full mip chain, and write them
+        // to the texture cache
+        void _buildLevels(SDL_Surface * surface);
+
+        // Upload _levels a level at a time, reading the levels back for the cache if
+        // the GL has compressed them
+        void _uploadLevels();
+
+        // Set once upload() has been and nothing but the materials has hold of it
+        bool _uploaded;
+        long _bytes;
+
+        // The decoded image, only kept until it has been uploaded
+        SDL_Surface * _surface;
+        // .. or its levels, when the texture cache is on
+        TextureLevels * _levels;
+
+        // Anything that went wrong while decoding. Decoding can happen on a loader
+        // thread, so we hold on to this and log it from upload()
+        string _error;
+        string _warning;
+
+        // Decoded textures waiting for upload
+        static list<Texture *> _pendingUploads;
+
+        // Guards textures and _pendingUploads
+        static pthread_mutex_t _mutex;
 
-        // The filenames given by the shader are case insensitive, so for case-sensitive
-        // filesystems, we need to search for the file
-        static std::string findRealFileName(std::string);
+        // Where the decodes go with asyncDecode, made when the first one is needed
+        static WorkerPool * _pool;
 };
@@ -0,0 +1,273 @@
+#include "texture_atlas.h"
+#include "texture_cache.h"
+#include "mipmap_generator.h"
+
+#include <math.h>
+#include <sstream>
+#include <algorithm>
+#include <GL/gl.h>
+#include <boost/foreach.hpp>
+
+using namespace std;
+
+bool TextureAtlas::enabled = false;
+
+TextureAtlas::Cell::Cell() {
+    this->page = NULL;
+    this->x = 0;
+    this->y = 0;
+}
+
+TextureAtlas::Page::Page() {
+    this->texture = NULL;
+}
+
+TextureAtlas::Page::~Page() {
+    if (this->texture != NULL) {
+        glDeleteTextures(1, &this->texture->texture);
+        delete this->texture;
+    }
+}
+
+TextureAtlas::TextureAtlas() {
+    this->nTextures = 0;
+    this->nGeobs = 0;
+}
+
+TextureAtlas::~TextureAtlas() {
+    BOOST_FOREACH(Shader * shader, this->_shaders) {
+        delete shader->layers[0];
+        delete[] shader->layers;
+        delete shader;
+    }
+}
+
+int TextureAtlas::getNPages() {
+    return this->_pages.size();
+}
+
+Texture * TextureAtlas::_getTexture(Mat & mat) {
+    if (mat.shader == NULL) {
+        return mat.nTextures > 0 ? mat.textures[0] : NULL;
+    }
+
+    // Only plain single layer shaders, generated coordinates would ignore the cells
+    Shader & shader = *mat.shader;
+    if (shader.isSky || shader.nLayers != 1) return NULL;
+    ShaderLayer & layer = *shader.layers[0];
+    if (layer.texGenR != GL_OBJECT_LINEAR || layer.texGenS != GL_OBJECT_LINEAR
+            || layer.texGenT != GL_OBJECT_LINEAR) {
+        return NULL;
+    }
+    return layer.texture;
+}
+
+TextureAtlas::Cell TextureAtlas::_getCell(Texture * texture) {
+    map<Texture *, Cell>::iterator it = this->_cells.find(texture);
+    if (it != this->_cells.end()) return it->second;
+
+    // Only small mipmapped textures that have made it to the GL. The ones still
+    // decoding in the background are left as they are, and not remembered so they
+    // can go in once they're done
+    if (!texture->isMipmap || texture->texture == 0 
+            || texture->texture == Texture::placeholder
+            || texture->width <= 0 || texture->height <= 0
+            || texture->width > TEXTURE_ATLAS_MAX_TEXTURE
+            || texture->height > TEXTURE_ATLAS_MAX_TEXTURE) {
+        return Cell();
+    }
+
+    // Read the texture back and make its levels the same way as if it had been
+    // loaded normally
+    TextureLevels levels;
+    levels.format = GL_RGBA;
+    levels.nLevels = 1;
+    levels.widths[0] = texture->width;
+    levels.heights[0] = texture->height;
+    levels.sizes[0] = texture->width * texture->height * 4;
+    levels.offsets[0] = 0;
+    levels.buffer.resize(levels.sizes[0]);
+    glBindTexture(GL_TEXTURE_2D, texture->texture);
+    glGetTexImage(GL_TEXTURE_2D, 0, GL_RGBA, GL_UNSIGNED_BYTE, &levels.buffer[0]);
+    MipmapGenerator::build(levels);
+
+    int size = max(max(texture->width, texture->height), TEXTURE_ATLAS_MIN_CELL);
+    Cell & cell = this->_cells[texture];
+    this->_allocate(size, cell);
+
+    // Small textures run out of levels before the page does, their last one (a
+    // single pixel) fills the rest
+    glBindTexture(GL_TEXTURE_2D, cell.page->texture);
+    for (int i = 0; i < TEXTURE_ATLAS_LEVELS; ++i) {
+        int level = min(i, levels.nLevels - 1);
+        glTexSubImage2D(GL_TEXTURE_2D, i, cell.x >> i, cell.y >> i, levels.widths[level],
+                levels.heights[level], GL_RGBA, GL_UNSIGNED_BYTE, levels.getLevel(level));
+    }
+
+    ++this->nTextures;
+    return cell;
+}
+
+void TextureAtlas::_allocate(int size, Cell & cell) {
+    // The smallest free square that's big enough, split down to size
+    BOOST_FOREACH(Page & page, this->_pages) {
+        map<int, vector<pair<int, int> > >::iterator it = page.free.lower_bound(size);
+        while (it != page.free.end() && it->second.empty()) ++it;
+        if (it == page.free.end()) continue;
+
+        int square = it->first;
+        pair<int, int> corner = it->second.back();
+        it->second.pop_back();
+        while (square > size) {
+            square /= 2;
+            vector<pair<int, int> > & free = page.free[square];
+            free.push_back(make_pair(corner.first + square, corner.second));
+            free.push_back(make_pair(corner.first, corner.second + square));
+            free.push_back(make_pair(corner.first + square, corner.second + square));
+        }
+
+        cell.page = page.texture;
+        cell.x = corner.first;
+        cell.y = corner.second;
+        return;
+    }
+
+    // Start a new page
+    Page * page = new Page();
+    stringstream name;
+    name << "texture atlas " << this->_pages.size();
+    page->texture = new Texture(name.str(), true);
+    page->texture->width = TEXTURE_ATLAS_SIZE;
+    page->texture->height = TEXTURE_ATLAS_SIZE;
+    page->texture->nOfColours = 4;
+    page->texture->format = GL_RGBA;
+
+    glGenTextures(1, &page->texture->texture);
+    glBindTexture(GL_TEXTURE_2D, page->texture->texture);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST_MIPMAP_NEAREST);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAX_LEVEL, TEXTURE_ATLAS_LEVELS - 1);
+    for (int i = 0; i < TEXTURE_ATLAS_LEVELS; ++i) {
+        glTexImage2D(GL_TEXTURE_2D, i, GL_RGBA8, TEXTURE_ATLAS_SIZE >> i,
+                TEXTURE_ATLAS_SIZE >> i, 0, GL_RGBA, GL_UNSIGNED_BYTE, NULL);
+    }
+
+    page->free[TEXTURE_ATLAS_SIZE].push_back(make_pair(0, 0));
+    this->_pages.push_back(page);
+    this->_allocate(size, cell);
+}
+
+Shader * TextureAtlas::_getShader(Shader & original, Texture * page) {
+    ShaderLayer & layer = *original.layers[0];
+
+    // Everything Dof::loadMaterial and Mat::isTransparent look at has to match
+    BOOST_FOREACH(Shader * shader, this->_shaders) {
+        ShaderLayer & other = *shader->layers[0];
+        if (other.texture == page && shader->blend == original.blend
+                && other.culling == layer.culling
+                && other.alphaFunction == layer.alphaFunction
+                && other.alphaValue == layer.alphaValue && other.blend == layer.blend
+                && other.blendSrc == layer.blendSrc && other.blendDst == layer.blendDst) {
+            return shader;
+        }
+    }
+
+    Shader * shader = new Shader(original);
+    shader->name = page->name;
+    shader->layers = new ShaderLayer *[1];
+    shader->layers[0] = new ShaderLayer(layer);
+    shader->layers[0]->texture = page;
+    shader->layers[0]->textureMapPath = page->name;
+    this->_shaders.push_back(shader);
+    return shader;
+}
+
+bool TextureAtlas::_fits(Geob & geob, float * tile) {
+    if (geob.vertexData == NULL || geob.nVertices == 0) return false;
+
+    // Coordinates are often inset or overshoot a little, which is the same texel
+    for (int j = 0; j < 2; ++j) {
+        float low = geob.vertexData[6 + j];
+        float high = low;
+        for (unsigned int i = 0; i < geob.nVertices; ++i) {
+            float value = geob.vertexData[i * GEOB_VERTEX_SIZE + 6 + j];
+            // Some dofs have junk (NaN) coordinates, leave them be
+            if (value != value) return false;
+            low = min(low, value);
+            high = max(high, value);
+        }
+        tile[j] = floorf(low + 0.001f);
+        if (high - tile[j] > 1.001f) return false;
+    }
+    return true;
+}
+
+void TextureAtlas::_moveCoordinates(Geob & geob, Texture * texture, const Cell & cell,
+        const float * tile) {
+    // The edges of the texture go to the middle of the edge texels, so nothing
+    // from the next cell can be picked up
+    float offset[2] = { cell.x + 0.5f, cell.y + 0.5f };
+    float scale[2] = { texture->width - 1.0f, texture->height - 1.0f };
+
+    for (unsigned int i = 0; i < geob.nVertices; ++i) {
+        float * coordinate = geob.vertexData + i * GEOB_VERTEX_SIZE + 6;
+        for (int j = 0; j < 2; ++j) {
+            float value = min(max(coordinate[j] - tile[j], 0.0f), 1.0f);
+            coordinate[j] = (offset[j] + value * scale[j]) / TEXTURE_ATLAS_SIZE;
+        }
+    }
+    // The instancer compares these
+    for (unsigned int i = 0; i < geob.nTextureCoords && i < geob.nVertices; ++i) {
+        geob.textureCoords[i][0] = geob.vertexData[i * GEOB_VERTEX_SIZE + 6];
+        geob.textureCoords[i][1] = geob.vertexData[i * GEOB_VERTEX_SIZE + 7];
+    }
+}
+
+void TextureAtlas::add(Dof & dof) {
+    boost::ptr_vector<Mat> & mats = dof.getMats();
+    // The copy of each material drawing from the atlas, by the material's index
+    map<unsigned int, unsigned int> copies;
+    bool changed = false;
+
+    BOOST_FOREACH(Geob & geob, dof.getGeobs()) {
+        if (geob.material >= mats.size()) continue;
+        Texture * texture = TextureAtlas::_getTexture(mats[geob.material]);
+        if (texture == NULL) continue;
+
+        float tile[2];
+        if (!TextureAtlas::_fits(geob, tile)) continue;
+        Cell cell = this->_getCell(texture);
+        if (cell.page == NULL) continue;
+
+        map<unsigned int, unsigned int>::iterator it = copies.find(geob.material);
+        if (it == copies.end()) {
+            Mat * copy = new Mat(mats[geob.material]);
+            if (copy->shader != NULL) {
+                copy->shader = this->_getShader(*copy->shader, cell.page);
+            } else {
+                copy->textures = new Texture *[copy->nTextures];
+                copy->textures[0] = cell.page;
+                for (int i = 1; i < copy->nTextures; ++i) {
+                    copy->textures[i] = mats[geob.material].textures[i];
+                }
+            }
+            mats.push_back(copy);
+            it = copies.insert(make_pair(geob.material, mats.size() - 1)).first;
+        }
+
+        TextureAtlas::_moveCoordinates(geob, texture, cell, tile);
+        geob.packVertexData();
+        for (int i = 0; i < geob.nBursts; ++i) {
+            if (geob.burstsMaterials[i] == (int)geob.material) {
+                geob.burstsMaterials[i] = it->second;
+            }
+        }
+        geob.material = it->second;
+        ++this->nGeobs;
+        changed = true;
+    }
+
+    if (changed) dof.sortGeobs();
+}
@@ -0,0 +1,108 @@
+/**
+ * Packs the track's small textures into a few big ones. Most track geobs have a
+ * texture of their own, a sign or a bit of a building, so drawing the track is a lot
+ * of texture binds, and as each texture is a material of its own the static batches
+ * and the render queue's groups stay small.
+ *
+ * A geob goes in the atlas if its texture is small and its texture coordinates stay
+ * within one repeat of the texture, as the atlas can't wrap. Its coordinates are
+ * moved onto the texture's cell and it gets a copy of its material that draws with
+ * the atlas page instead. Geobs whose textures wrap keep the material they had.
+ * Materials that only differ by their texture share the copy, so they batch and
+ * sort together.
+ *
+ * The cells are power of two squares lined up on their size, so each mip level of a
+ * texture has its own part of the page's level. The pages only have as many levels
+ * as the smallest cell can have, after that the cells would run together.
+ *
+ * The textures are read back from the GL, so this has to be done on the main
+ * thread, after the dof's textures have been uploaded. Texture arrays would avoid
+ * moving the coordinates but need shaders, which the fixed function renderer
+ * doesn't have.
+ */
+#pragma once
+
+#include "dof.h"
+
+#include <map>
+#include <vector>
+#include <utility>
+#include <boost/ptr_container/ptr_vector.hpp>
+
+// Size of the atlas pages
+#define TEXTURE_ATLAS_SIZE 1024
+// Largest texture that goes in, either way
+#define TEXTURE_ATLAS_MAX_TEXTURE 128
+// Smallest cell, smaller textures get one this size. The pages have mip levels down
+// to cells of 1 pixel
+#define TEXTURE_ATLAS_MIN_CELL 16
+#define TEXTURE_ATLAS_LEVELS 5
+
+class TextureAtlas {
+    public:
+        TextureAtlas();
+        ~TextureAtlas();
+
+        // Move the geobs of the dof that can be onto the atlas. Like the instancer and
+        // batcher this has to be before the dof is uploaded, and before either of
+        // them see it as it changes the materials
+        void add(Dof & dof);
+
+        // Turn the atlas on, off by default. This has to be set before the track is
+        // loaded
+        static bool enabled;
+
+        // Textures put in the atlas and geobs moved onto it
+        int nTextures;
+        int nGeobs;
+
+        int getNPages();
+
+    private:
+        // Where a texture went in the atlas. Textures that can't go in have no page
+        class Cell {
+            public:
+                Cell();
+
+                Texture * page;
+                int x;
+                int y;
+        };
+
+        // A page and the squares in it that are still free, by size
+        class Page {
+            public:
+                Page();
+                ~Page();
+
+                Texture * texture;
+                std::map<int, std::vector<std::pair<int, int> > > free;
+        };
+
+        boost::ptr_vector<Page> _pages;
+        std::map<Texture *, Cell> _cells;
+
+        // The shaders the material copies draw with, made here
+        std::vector<Shader *> _shaders;
+
+        // The texture the material draws with, if it's one that could go in
+        static Texture * _getTexture(Mat & mat);
+
+        // The cell for the texture, putting it in the atlas if it hasn't been looked
+        // at yet. The page is NULL for textures that can't go in (yet)
+        Cell _getCell(Texture * texture);
+
+        // Find a free square of size for a cell, starting a new page if they're full
+        void _allocate(int size, Cell & cell);
+
+        // A shader like original that draws with the page
+        Shader * _getShader(Shader & original, Texture * page);
+
+        // Whether the geob's texture coordinates are all within one repeat of the
+        // texture, and which repeat (the whole number to take off them)
+        static bool _fits(Geob & geob, float * tile);
+
+        // Move the geob's texture coordinates from the texture to its cell
+        static void _moveCoordinates(Geob & geob, Texture * texture, const Cell & cell,
+                const float * tile);
+};
@@ -0,0 +1,189 @@
+#include "texture_cache.h"
+#include "binary_reader.h"
+#include "mipmap_generator.h"
+
+#include <fstream>
+#include <iostream>
+#include <sstream>
+#include <boost/filesystem.hpp>
+#include <boost/functional/hash.hpp>
+
+using namespace std;
+namespace fs = boost::filesystem;
+
+string TextureCache::cachePath = "cache/textures";
+bool TextureCache::compress = false;
+const int TextureCache::version = 1;
+int TextureCache::hits = 0;
+int TextureCache::misses = 0;
+double TextureCache::hitTime = 0;
+double TextureCache::missTime = 0;
+pthread_mutex_t TextureCache::_countMutex = PTHREAD_MUTEX_INITIALIZER;
+
+TextureLevels::TextureLevels() {
+    this->format = 0;
+    this->compressed = false;
+    this->nLevels = 0;
+}
+
+const unsigned char * TextureLevels::getLevel(int level) {
+    const unsigned char * data = this->file.is_open()
+        ? (const unsigned char *)this->file.data() : &this->buffer[0];
+    return data + this->offsets[level];
+}
+
+// Utility function to write values
+template <class T> static void writeValue(ofstream & file, T value) {
+    file.write((const char *)&value, sizeof(T));
+}
+
+string TextureCache::_entryPath(const string & imagePath) {
+    stringstream name;
+    name << hex << boost::hash<string>()(imagePath) << ".tex";
+    return (fs::path(TextureCache::cachePath) / name.str()).string();
+}
+
+void TextureCache::count(bool hit, double milliseconds) {
+    pthread_mutex_lock(&TextureCache::_countMutex);
+    if (hit) {
+        ++TextureCache::hits;
+        TextureCache::hitTime += milliseconds;
+    } else {
+        ++TextureCache::misses;
+        TextureCache::missTime += milliseconds;
+    }
+    pthread_mutex_unlock(&TextureCache::_countMutex);
+}
+
+int TextureCache::_options(bool isMipmap) {
+    int options = 0;
+    if (isMipmap) options |= 1;
+    if (TextureCache::compress) options |= 2;
+    if (MipmapGenerator::gammaCorrect) options |= 4;
+    return options;
+}
+
+bool TextureCache::read(const string & imagePath, bool isMipmap, TextureLevels & levels) {
+    char token[5];
+
+    if (TextureCache::cachePath.empty()) return false;
+
+    string entryPath = TextureCache::_entryPath(imagePath);
+    if (!fs::exists(entryPath)) return false;
+
+    try {
+        levels.file.open(entryPath);
+    } catch (std::exception & e) {
+        return false;
+    }
+    BinaryReader reader(levels.file.data(), levels.file.size());
+
+    // Check the entry is for this version of this file
+    bool valid;
+    try {
+        reader.readToken(token);
+        valid = strcmp(token, "RTC1") == 0
+            && reader.read<int>() == TextureCache::version
+            && reader.read<int>() == TextureCache::_options(isMipmap)
+            && reader.read<long long>() == (long long)fs::last_write_time(imagePath)
+            && reader.read<long long>() == (long long)fs::file_size(imagePath)
+            && reader.readString() == imagePath;
+    } catch (std::exception & e) {
+        valid = false;
+    }
+    reader.skip((4 - (2 + imagePath.size()) % 4) % 4);
+
+    levels.format = reader.read<int>();
+    levels.compressed = reader.read<int>() != 0;
+    levels.nLevels = reader.read<int>();
+    if (levels.nLevels < 1 || levels.nLevels > TEXTURE_MAX_LEVELS) valid = false;
+
+    for (int i = 0; valid && i < levels.nLevels; ++i) {
+        levels.widths[i] = reader.read<int>();
+        levels.heights[i] = reader.read<int>();
+        levels.sizes[i] = reader.read<int>();
+        if (levels.sizes[i] < 0 || (size_t)levels.sizes[i] > reader.remaining()) {
+            reader.overrun = true;
+            break;
+        }
+
+        // The levels are used where they are in the mapped file
+        levels.offsets[i] = reader.position();
+        reader.skip((levels.sizes[i] + 3) & ~3);
+    }
+
+    if (valid && reader.overrun) {
+        cout << "Corrupt texture cache entry for " << imagePath << endl;
+    }
+    if (!valid || reader.overrun) {
+        levels.file.close();
+        return false;
+    }
+    return true;
+}
+
+void TextureCache::write(const string & imagePath, bool isMipmap, TextureLevels & levels) {
+    if (TextureCache::cachePath.empty()) return;
+
+    string entryPath = TextureCache::_entryPath(imagePath);
+    // Textures are made on several threads, so the temporary file has to be unique
+    // to this one
+    stringstream tmpPath;
+    tmpPath << entryPath << "." << pthread_self() << ".tmp";
+
+    long long mtime, size;
+    try {
+        mtime = fs::last_write_time(imagePath);
+        size = fs::file_size(imagePath);
+        fs::create_directories(TextureCache::cachePath);
+    } catch (std::exception & e) {
+        cout << "Couldn't create texture cache: " << e.what() << endl;
+        return;
+    }
+
+    // Write to a temporary file and move it into place so a half written entry is
+    // never picked up
+    ofstream file(tmpPath.str().c_str(), ios::out | ios::binary | ios::trunc);
+    if (!file.is_open()) {
+        cout << "Couldn't write texture cache entry " << tmpPath.str() << endl;
+        return;
+    }
+
+    file.write("RTC1", 4);
+    writeValue<int>(file, TextureCache::version);
+    writeValue<int>(file, TextureCache::_options(isMipmap));
+    writeValue<long long>(file, mtime);
+    writeValue<long long>(file, size);
+    writeValue<unsigned short>(file, imagePath.size());
+    file.write(imagePath.c_str(), imagePath.size());
+    // Pad the path so the levels are 4 byte aligned
+    const char padding[3] = { 0, 0, 0 };
+    file.write(padding, (4 - (2 + imagePath.size()) % 4) % 4);
+    writeValue<int>(file, levels.format);
+    writeValue<int>(file, levels.compressed ? 1 : 0);
+    writeValue<int>(file, levels.nLevels);
+
+    for (int i = 0; i < levels.nLevels; ++i) {
+        writeValue<int>(file, levels.widths[i]);
+        writeValue<int>(file, levels.heights[i]);
+        writeValue<int>(file, levels.sizes[i]);
+        file.write((const char *)levels.getLevel(i), levels.sizes[i]);
+
+        // Keep the next level 4 byte aligned
+        file.write(padding, ((levels.sizes[i] + 3) & ~3) - levels.sizes[i]);
+    }
+
+    file.close();
+
+    try {
+        if (file.fail()) {
+            cout << "Failed writing texture cache entry " << tmpPath.str() << endl;
+            fs::remove(tmpPath.str());
+            return;
+        }
+
+        fs::rename(tmpPath.str(), entryPath);
+    } catch (std::exception & e) {
+        cout << "Failed writing texture cache entry: " << e.what() << endl;
+    }
+}
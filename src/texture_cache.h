@@ -0,0 +1,97 @@
+/**
+ * An on-disk cache of the decoded textures, like the geometry cache is for the dofs.
+ * Each texture gets a file holding its full mip chain, ready to go straight to
+ * glTexImage2D a level at a time, so a warm start is a memory map rather than an image
+ * decode, a colour key pass and building the mipmaps.
+ *
+ * With compress set the levels are kept S3TC (DXT5) compressed instead. The driver
+ * does the compressing when the texture is first uploaded and the result is read
+ * back for the cache, so after that it's glCompressedTexImage2D and a quarter of the
+ * memory.
+ *
+ * Entries are keyed by the image's path, modification time and size, anything else
+ * is treated as a miss and the entry gets rewritten.
+ *
+ * Textures are decoded on worker threads, so this only reports problems on cout and
+ * the counters are kept behind a mutex.
+ *
+ * Format (all little-endian):
+ *  header: "RTC1", int version, int options, int64 mtime, int64 size, string path
+ *          (padded to 4 bytes), int format, int compressed, int nLevels
+ *  level:  int width, int height, int size, unsigned char data[size] (padded to 4)
+ */
+#pragma once
+
+#include <string>
+#include <vector>
+#include <pthread.h>
+#include <GL/gl.h>
+#include <boost/iostreams/device/mapped_file.hpp>
+
+// Enough levels for a 32768 pixel texture
+#define TEXTURE_MAX_LEVELS 16
+
+// A texture's mip chain, either read from the cache or built from the decoded image
+class TextureLevels {
+    public:
+        TextureLevels();
+
+        // GL_RGBA or GL_BGRA for 4 byte pixels, or the compressed format
+        GLenum format;
+        bool compressed;
+        int nLevels;
+        int widths[TEXTURE_MAX_LEVELS];
+        int heights[TEXTURE_MAX_LEVELS];
+        int sizes[TEXTURE_MAX_LEVELS];
+        size_t offsets[TEXTURE_MAX_LEVELS];
+
+        // Where the level's data starts
+        const unsigned char * getLevel(int level);
+
+        // The levels are in one or the other of these: the mapped cache entry, or a
+        // buffer they were built in
+        boost::iostreams::mapped_file_source file;
+        std::vector<unsigned char> buffer;
+};
+
+class TextureCache {
+    public:
+        // Where the cache files live, an empty path disables the cache
+        static std::string cachePath;
+
+        // Keep the textures compressed, off by default. Main turns it off again if
+        // the GL can't do S3TC
+        static bool compress;
+
+        // Map the levels for the image at imagePath into levels. Returns false if
+        // there is no valid entry
+        static bool read(const std::string & imagePath, bool isMipmap,
+                TextureLevels & levels);
+
+        // Write an entry for the image at imagePath
+        static void write(const std::string & imagePath, bool isMipmap,
+                TextureLevels & levels);
+
+        // Bump this whenever the layout or the processing of the textures changes
+        static const int version;
+
+        // Counters for reporting how well the cache is doing: how many textures
+        // came from it and how many had to be decoded, and the milliseconds each took
+        static int hits;
+        static int misses;
+        static double hitTime;
+        static double missTime;
+
+        // Add a load to the counters
+        static void count(bool hit, double milliseconds);
+
+    private:
+        static pthread_mutex_t _countMutex;
+
+        // The file an entry for imagePath is kept in
+        static std::string _entryPath(const std::string & imagePath);
+
+        // Options that change the cached levels, entries written with different
+        // options are misses
+        static int _options(bool isMipmap);
+};
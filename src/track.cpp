@@ -1,7 +1,16 @@
 #include "track.h"
 #include "shader.h"
 #include "closest_point.h"
+#include "frustum_culler.h"
 #include "logger.h"
+#include "geometry_cache.h"
+#include "texture_cache.h"
+#include "texture.h"
+#include "worker_pool.h"
+#include "load_timer.h"
+#include "file_index.h"
+#include "mesh_optimiser.h"
+#include "mesh_simplifier.h"
 
 #include <GL/gl.h>
 #include <unistd.h>
@@ -11,6 +20,7 @@
 #include <iostream>
 #include <vector>
 #include <fstream>
+#include <sstream>
 
 using namespace boost;
 using namespace boost::filesystem;
@@ -18,6 +28,31 @@ namespace fs = boost::filesystem;
 
 dWorldID Track::worldId;
 dSpaceID Track::spaceId;
+int Track::loaderThreads = 0;
+bool Track::streaming = false;
+
+// Loads one dof on a worker thread and reports back with its index
+class DofLoadJob : public Job {
+    public:
+        DofLoadJob(string path, int flags, int index, vector<Dof *> & loaded,
+                BlockingQueue<int> & done) 
+            : _path(path), _flags(flags), _index(index), _loaded(loaded), _done(done) {}
+
+        void run() {
+            Dof * dof = new Dof(this->_path, this->_flags, true, true);
+            // Each job has its own slot so this doesn't need locking, the queue
+            // makes sure the main thread sees it
+            this->_loaded[this->_index] = dof;
+            this->_done.push(this->_index);
+        }
+
+    private:
+        string _path;
+        int _flags;
+        int _index;
+        vector<Dof *> & _loaded;
+        BlockingQueue<int> & _done;
+};
 
 Track::Track(string trackPath) {
     path currentDir("./");
@@ -27,7 +62,7 @@ Track::Track(string trackPath) {
     Shader::parseShaderFile((currentDir / trackPath / "track.shd").string().c_str());
 
     // Look for a geometry.ini file, and use this to load the dofs
-    if (!exists(currentDir / trackPath / "geometry.ini")) {
+    if (!exists(FileIndex::find((currentDir / trackPath / "geometry.ini").string()))) {
         cout << "Warning: couldn't find geometry.ini" << endl;
         return;
     }
@@ -97,7 +132,7 @@ void Track::initCollisionDetection() {
 void Track::loadSpecialIni() {
     string value;
     path currentDir("./");
-    Ini ini((currentDir / this->iniPath / "special.ini").string());
+    Ini ini(FileIndex::find((currentDir / this->iniPath / "special.ini").string()));
 
     // Get the starting position
     value = ini["/grid/pos0/from/x"];
@@ -108,21 +143,21 @@ void Track::loadSpecialIni() {
     this->startPosition[2] = atof(value.c_str());
 }
 
-void Track::loadGeometryIni() { 
+bool Track::readGeometryIni(const string & trackPath, map<string, string> & dofFiles,
+        map<string, int> & flags) {
     bool nextTagIsObjectName = true;
     bool foundObjects = false;
     string currentObject;
     string line;
     vector<string> parts;
     vector<string> filenameParts;
-    //vector<string> dofFiles;
-    map<string, int> flags;
-    map<string, string> dofFiles;
     path currentDir("./");
-    ifstream file((currentDir / this->iniPath / "geometry.ini").string().c_str());
+    string geometryPath = 
+        FileIndex::find((currentDir / trackPath / "geometry.ini").string());
+    ifstream file(geometryPath.c_str());
     if (!file.is_open()) {
         Logger::debug << "Error opening geometry.ini" << endl;
-        return;
+        return false;
     }
 
     // Look for objects definition, basically get us to the point "object {"
@@ -169,7 +204,8 @@ void Track::loadGeometryIni() {
             if (filenameParts[1] != "dof") continue;
 
             // Load this file because it is a DOF file
-            dofFiles[currentObject] = (currentDir / this->iniPath / parts[1]).string();
+            dofFiles[currentObject] = 
+                FileIndex::find((currentDir / trackPath / parts[1]).string());
         } else if (parts[0] == "flags") {
             // Convert the flags to an int
             int f = atoi(parts[1].c_str());
@@ -179,39 +215,288 @@ void Track::loadGeometryIni() {
     }
 
     file.close();
+    return true;
+}
 
-    // Load the dof files using the paths and flags
-    map<string, string>::iterator it;
-    int currentFlags;
-    for (it = dofFiles.begin(); it != dofFiles.end(); ++it) {
-        // Check to see if there are any flags
-        if (flags.count(it->first) > 0) {
-            currentFlags = flags[it->first];
-        } else {
-            currentFlags = 0;
+void Track::loadGeometryIni() { 
+    map<string, int> flags;
+    map<string, string> dofFiles;
+    if (!Track::readGeometryIni(this->iniPath, dofFiles, flags)) return;
+
+    // Load the dofs on the worker pool. The workers do everything that doesn't need
+    // OpenGL and hand each dof back through the queue, the VBOs and textures are then
+    // uploaded here on the main thread while the workers carry on with the next ones
+    double start = LoadTimer::now();
+    LoadTimer::reset();
+    Texture::deferUploads = true;
+
+    vector<Dof *> loaded(dofFiles.size(), (Dof *)NULL);
+    BlockingQueue<int> done;
+    int nThreads;
+    {
+        WorkerPool pool(Track::loaderThreads);
+        nThreads = pool.getNThreads();
+
+        map<string, string>::iterator it;
+        int currentFlags;
+        int i = 0;
+        int nJobs = 0;
+        for (it = dofFiles.begin(); it != dofFiles.end(); ++it, ++i) {
+            // Check to see if there are any flags
+            if (flags.count(it->first) > 0) {
+                currentFlags = flags[it->first];
+            } else {
+                currentFlags = 0;
+            }
+
+            // When streaming only the collision surfaces are loaded up front, the
+            // physics needs all of those
+            if (Track::streaming && !(currentFlags & (DOF_SURFACE | DOF_COLLISION))) {
+                this->_streamer.add(it->second, currentFlags);
+                continue;
+            }
+
+            pool.add(new DofLoadJob(it->second, currentFlags, i, loaded, done));
+            ++nJobs;
         }
 
-        // Attempt to create a dof
-        Dof * tmpDof = new Dof(it->second, currentFlags);
+        for (int j = 0; j < nJobs; ++j) {
+            int index = done.pop();
+            Texture::uploadPending();
+
+            // Check that it loaded properly, if not throw it away
+            if (loaded[index]->isValid) {
+                if (TextureAtlas::enabled) this->_atlas.add(*loaded[index]);
+                this->_instancer.add(*loaded[index]);
+                if (StaticBatcher::enabled) this->_batcher.add(*loaded[index]);
+                loaded[index]->upload();
+            } else {
+                delete loaded[index];
+                loaded[index] = NULL;
+            }
+        }
+    }
 
-        tmpDof->isTransparent();
+    this->_batcher.build();
 
-        // Check that it loaded properly, if so add it to the list
-        if (tmpDof->isValid) {
-            this->dofs.push_back(tmpDof);
-        } else {
-            delete tmpDof;
+    // The streamer loads dofs on its own threads for as long as the track is around,
+    // so textures stay deferred and get uploaded in update()
+    if (Track::streaming) {
+        this->_streamer.index();
+    } else {
+        Texture::deferUploads = false;
+    }
+
+    // Add them in the order they are in geometry.ini (well, the map) so the track
+    // renders the same whichever order the workers finished in
+    BOOST_FOREACH(Dof * dof, loaded) {
+        if (dof != NULL) this->dofs.push_back(dof);
+    }
+    this->_buildCullingTree();
+
+    stringstream timings;
+    LoadTimer::report(timings);
+    Logger::debug << "Loaded " << this->dofs.size() << " dofs in " 
+        << (LoadTimer::now() - start) << "ms on " << nThreads << " threads" << endl
+        << timings.str();
+    Logger::debug << "Instancing: " << this->_instancer.nInstances 
+        << " geobs share buffers, saving " << this->_instancer.savedBytes / 1024 
+        << "KB in " << this->_instancer.getNBatches() << " batches" << endl;
+    if (StaticBatcher::enabled) {
+        Logger::debug << "Static batching: " << this->_batcher.nGeobs << " geobs in "
+            << this->_batcher.getNBatches() << " batches, "
+            << this->_batcher.getNChunks() << " chunks" << endl;
+    }
+    if (TextureAtlas::enabled) {
+        Logger::debug << "Texture atlas: " << this->_atlas.nTextures << " textures in "
+            << this->_atlas.getNPages() << " pages, drawn by " << this->_atlas.nGeobs 
+            << " geobs" << endl;
+    }
+    Logger::debug << "Culling tree: " << this->_cullingTree.getNBoxes() << " items in "
+        << this->_cullingTree.getNNodes() << " nodes" << endl;
+    if (OcclusionCuller::enabled) {
+        Logger::debug << "Occlusion culling: " << this->_occlusionCuller.getNOccluders()
+            << " occluders" << endl;
+    }
+
+    if (MeshSimplifier::geobs > 0) {
+        Logger::debug << "Mesh simplifier: " << MeshSimplifier::geobs << " geobs, "
+            << MeshSimplifier::triangles << " triangles";
+        for (int i = 0; i < GEOB_MAX_LODS; ++i) {
+            Logger::debug << " -> " << MeshSimplifier::lodTriangles[i];
         }
+        Logger::debug << endl;
+    }
+
+    if (MeshOptimiser::triangles > 0) {
+        Logger::debug << "Mesh optimiser ACMR: " 
+            << (float)MeshOptimiser::transformsBefore / MeshOptimiser::triangles << " -> "
+            << (float)MeshOptimiser::transformsAfter / MeshOptimiser::triangles 
+            << " over " << MeshOptimiser::triangles << " triangles" << endl;
     }
+
+    Logger::debug << "Geometry cache: " << GeometryCache::hits << " hits, " 
+        << GeometryCache::misses << " misses" << endl;
+    // The textures can still be decoding in the background, so this is only so far
+    Logger::debug << "Texture cache: " << TextureCache::hits << " hits in " 
+        << (int)TextureCache::hitTime << "ms, " << TextureCache::misses << " misses in "
+        << (int)TextureCache::missTime << "ms" << endl;
 }
 
-void Track::render() {
-    // We do this in two passes, first for non-transparent, then for transparent
+void Track::update(Vector position) {
+    if (Track::streaming) {
+        this->_streamer.update(position);
+    }
+}
+
+void Track::_buildCullingTree() {
+    vector<RenderItem> items;
     BOOST_FOREACH(Dof & dof, this->dofs) {
-        if (!dof.isTransparent()) dof.render();
-    }    
+        dof.getItems(items);
+    }
+    this->_instancer.getItems(items);
+    int firstChunk = items.size();
+    this->_batcher.getItems(items);
+
+    // Where each of them ends up in _items
+    vector<int> indices(items.size(), -1);
+    for (unsigned int i = 0; i < items.size(); ++i) {
+        if (items[i].pass == RENDER_PASS_SKY) {
+            this->_skyItems.push_back(items[i]);
+        } else {
+            indices[i] = this->_cullingTree.add(items[i].boundingBox);
+            this->_items.push_back(items[i]);
+        }
+    }
+    this->_cullingTree.build();
+
+    if (VisibilitySets::enabled) {
+        map<Geob *, int> itemOf;
+        for (int i = 0; i < firstChunk; ++i) {
+            if (indices[i] >= 0) itemOf[items[i].geob] = indices[i];
+        }
+        vector<pair<Geob *, int> > chunkGeobs;
+        this->_batcher.getChunkGeobs(chunkGeobs);
+        for (unsigned int i = 0; i < chunkGeobs.size(); ++i) {
+            itemOf[chunkGeobs[i].first] = indices[firstChunk + chunkGeobs[i].second];
+        }
+        this->_loadVisibilitySets(itemOf);
+    }
+
+    if (OcclusionCuller::enabled) {
+        BOOST_FOREACH(Dof & dof, this->dofs) {
+            BOOST_FOREACH(Geob & geob, dof.getGeobs()) {
+                if (OcclusionCuller::isOccluder(dof, geob)) {
+                    this->_occlusionCuller.addOccluder(geob);
+                }
+            }
+        }
+    }
+}
 
+void Track::_loadVisibilitySets(map<Geob *, int> & itemOf) {
+    string file = (path(this->iniPath) / VisibilitySets::fileName).string();
+    if (!exists(file)) return;
+    if (!this->_visibilitySets.load(file)) {
+        Logger::debug << "Couldn't read " << file << endl;
+        return;
+    }
+
+    // The geobs of each dof by file name, as the sets name them
+    map<string, vector<Geob *> > geobs;
     BOOST_FOREACH(Dof & dof, this->dofs) {
-        if (dof.isTransparent()) dof.render();
-    }    
+        vector<Geob *> & dofGeobs = geobs[path(dof.getFilePath()).filename().string()];
+        BOOST_FOREACH(Geob & geob, dof.getGeobs()) {
+            dofGeobs.push_back(&geob);
+        }
+    }
+
+    this->_sectorItems.resize(this->_visibilitySets.getNSectors());
+    for (int i = 0; i < this->_visibilitySets.getNSectors(); ++i) {
+        vector<int> & sectorItems = this->_sectorItems[i];
+        map<string, set<int> > & visible = this->_visibilitySets.getVisible(i);
+        for (map<string, set<int> >::iterator it = visible.begin(); it != visible.end();
+                ++it) {
+            if (geobs.count(it->first) == 0) continue;
+            vector<Geob *> & dofGeobs = geobs[it->first];
+            BOOST_FOREACH(int index, it->second) {
+                if (index < 0 || index >= (int)dofGeobs.size()) continue;
+                map<Geob *, int>::iterator item = itemOf.find(dofGeobs[index]);
+                if (item != itemOf.end()) sectorItems.push_back(item->second);
+            }
+        }
+
+        // Geobs merged into the same chunk share an item
+        sort(sectorItems.begin(), sectorItems.end());
+        sectorItems.erase(unique(sectorItems.begin(), sectorItems.end()),
+                sectorItems.end());
+    }
+    Logger::debug << "Visibility sets: " << this->_sectorItems.size() << " sectors"
+        << endl;
+}
+
+void Track::submit(RenderQueue & queue) {
+    BOOST_FOREACH(RenderItem & item, this->_skyItems) {
+        queue.add(item);
+    }
+
+    this->_visible.clear();
+    float position[3];
+    ViewFrustumCulling::culler->getCameraPosition(position);
+
+    // Only what can be seen from the camera's sector needs testing against the
+    // frustum, away from the sectors the whole track goes through the tree
+    int sector = -1;
+    if (!this->_sectorItems.empty()) {
+        sector = this->_visibilitySets.findSector(position);
+    }
+    if (sector >= 0) {
+        BOOST_FOREACH(int index, this->_sectorItems[sector]) {
+            int planes = FRUSTUM_ALL_PLANES;
+            if (ViewFrustumCulling::culler->testBox(this->_items[index].boundingBox, planes)
+                    != FRUSTUM_OUTSIDE) {
+                this->_visible.push_back(index);
+            }
+        }
+    } else {
+        this->_cullingTree.cull(*ViewFrustumCulling::culler, this->_visible);
+    }
+
+    if (OcclusionCuller::enabled) {
+        this->_occlusionCuller.render(*ViewFrustumCulling::culler);
+    }
+    float pixelScale = ViewFrustumCulling::culler->getProjectionScale()
+        * MeshSimplifier::screenHeight / 2;
+    BOOST_FOREACH(int index, this->_visible) {
+        RenderItem & item = this->_items[index];
+        if (OcclusionCuller::enabled && !this->_occlusionCuller.testBox(item.boundingBox)) {
+            continue;
+        }
+
+        // Far enough away a simplified version will do. Copies use the levels of the
+        // geob they're a copy of, they draw with its buffers
+        if (item.nRanges == 0) {
+            Geob & buffers = item.geob->instanceOf != NULL ? *item.geob->instanceOf
+                : *item.geob;
+            int level = MeshSimplifier::selectLod(buffers, item.boundingBox, position,
+                    pixelScale);
+            if (level >= 0) {
+                queue.add(item.pass, *item.geob, *item.mat, &buffers.lodCounts[level],
+                        &buffers.lodOffsets[level], 1);
+                continue;
+            }
+        }
+        queue.add(item);
+    }
+
+    // The streamed dofs come and go, so they aren't in the tree
+    this->_streamer.submit(queue);
+}
+
+BoundingVolumeTree & Track::getCullingTree() {
+    return this->_cullingTree;
+}
+
+OcclusionCuller & Track::getOcclusionCuller() {
+    return this->_occlusionCuller;
 }
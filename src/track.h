@@ -7,12 +7,22 @@
  */
 #pragma once
 
+#include <map>
 #include <string>
 #include <ode/ode.h>
 #include <boost/foreach.hpp>
 #include <boost/ptr_container/ptr_vector.hpp>
 
+#include "bounding_volume_tree.h"
 #include "dof.h"
+#include "mesh_instancer.h"
+#include "occlusion_culler.h"
+#include "render_queue.h"
+#include "static_batcher.h"
+#include "texture_atlas.h"
+#include "track_streamer.h"
+#include "visibility_sets.h"
+#include "vector.h"
 
 using namespace std;
 
@@ -22,8 +32,16 @@ class Track {
         Track(string path);
         ~Track();
         
-        // Render a track
-        void render();
+        // Keep the track up to date with where the car is, called once a frame
+        void update(Vector position);
+
+        // Add what's visible of the track to the queue
+        void submit(RenderQueue & queue);
+
+        // The tree the track is culled with, its counts are for the last frame
+        BoundingVolumeTree & getCullingTree();
+
+        OcclusionCuller & getOcclusionCuller();
 
         // Start position
         float startPosition[3];
@@ -31,6 +49,18 @@ class Track {
         // The ODE world ID
         static dWorldID worldId;
         static dSpaceID spaceId;
+
+        // Read the dofs (object name to file) and their flags from the track's
+        // geometry.ini, returns false if it couldn't be opened
+        static bool readGeometryIni(const string & trackPath,
+                map<string, string> & dofFiles, map<string, int> & flags);
+
+        // Number of threads used to load the dofs, 0 means one per CPU
+        static int loaderThreads;
+
+        // Only keep the scenery around the car loaded, see TrackStreamer. This has to
+        // be set before the track is loaded
+        static bool streaming;
         dGeomID planeId;
 
     private:
@@ -39,6 +69,41 @@ class Track {
         // List of dof objects which make up the track model
         boost::ptr_list<Dof> dofs;
 
+        // Shares the buffers between copies of the same geob, and draws the batches
+        MeshInstancer _instancer;
+
+        // The opaque geobs merged into big buffers by material
+        StaticBatcher _batcher;
+
+        // The small textures packed together, if TextureAtlas::enabled
+        TextureAtlas _atlas;
+
+        // The scenery when streaming
+        TrackStreamer _streamer;
+
+        // Everything on the track that gets culled, by its index in _cullingTree. The
+        // sky is always drawn so it's kept apart
+        std::vector<RenderItem> _items;
+        std::vector<RenderItem> _skyItems;
+        BoundingVolumeTree _cullingTree;
+        // The items in view this frame
+        std::vector<int> _visible;
+
+        // Hides what's behind the buildings, if OcclusionCuller::enabled
+        OcclusionCuller _occlusionCuller;
+
+        // What can be seen from each sector, if the track has them and
+        // VisibilitySets::enabled. The sets are turned into lists of items
+        VisibilitySets _visibilitySets;
+        std::vector<std::vector<int> > _sectorItems;
+
+        // Collect the items from the dofs, instancer and batcher and build the tree,
+        // and pick out the occluders
+        void _buildCullingTree();
+
+        // Load the visibility sets, itemOf is the item each geob is drawn by
+        void _loadVisibilitySets(std::map<Geob *, int> & itemOf);
+
         // Load the geometry.ini file which points to the globs.
         // NOTE: this is ultra simplified at the moment and will almost certainly need 
         // expanding. It just looks for lines with a dof file and loads it.
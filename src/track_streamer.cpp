@@ -0,0 +1,349 @@
+#include "track_streamer.h"
+#include "texture.h"
+#include "logger.h"
+
+#include <map>
+#include <set>
+#include <math.h>
+#include <algorithm>
+#include <boost/foreach.hpp>
+
+using namespace std;
+
+float TrackStreamer::radius = 500;
+float TrackStreamer::cellSize = 250;
+long TrackStreamer::budget = 0;
+
+// Cells are kept until they are this much further away than radius
+#define STREAMING_HYSTERESIS 1.25f
+
+// Loads a dof's geometry just to find out where it is, how big it is and which
+// textures it uses
+class StreamIndexJob : public Job {
+    public:
+        StreamIndexJob(string path, int flags, float * boundingBox, long * bytes,
+                vector<string> * textures)
+            : _path(path), _flags(flags), _boundingBox(boundingBox), _bytes(bytes),
+            _textures(textures) {}
+
+        void run() {
+            Dof * dof = new Dof(this->_path, this->_flags | DOF_NO_TEXTURES, true, true);
+            bool first = true;
+
+            // Skip anything that doesn't load, or doesn't have anything to draw
+            *this->_bytes = -1;
+            if (dof->isValid) {
+                BOOST_FOREACH(Geob & geob, dof->getGeobs()) {
+                    // The bounding box only covers the indexed vertices
+                    if (geob.nIndices == 0) continue;
+                    for (int i = 0; i < 6; i += 2) {
+                        if (first || geob.boundingBox[i] < this->_boundingBox[i]) {
+                            this->_boundingBox[i] = geob.boundingBox[i];
+                        }
+                        if (first || geob.boundingBox[i + 1] > this->_boundingBox[i + 1]) {
+                            this->_boundingBox[i + 1] = geob.boundingBox[i + 1];
+                        }
+                    }
+                    first = false;
+                }
+                if (!first) *this->_bytes = dof->getMemoryUsage();
+                *this->_textures = dof->getTextureNames();
+            }
+            delete dof;
+        }
+
+    private:
+        string _path;
+        int _flags;
+        float * _boundingBox;
+        long * _bytes;
+        vector<string> * _textures;
+};
+
+// Loads a dof for real, the main thread picks it up from done
+class StreamLoadJob : public Job {
+    public:
+        StreamLoadJob(string path, int flags, int index, Dof ** dof,
+                BlockingQueue<int> & done)
+            : _path(path), _flags(flags), _index(index), _dof(dof), _done(done) {}
+
+        void run() {
+            *this->_dof = new Dof(this->_path, this->_flags, true, true);
+            this->_done.push(this->_index);
+        }
+
+    private:
+        string _path;
+        int _flags;
+        int _index;
+        Dof ** _dof;
+        BlockingQueue<int> & _done;
+};
+
+TrackStreamer::StreamedTexture::StreamedTexture() {
+    this->users = 0;
+    this->texture = NULL;
+    this->bytes = 0;
+}
+
+TrackStreamer::TrackStreamer() {
+    this->_pool = NULL;
+    this->residentBytes = 0;
+    this->_geometryBytes = 0;
+}
+
+TrackStreamer::~TrackStreamer() {
+    // Let any loads finish so nothing is writing to the entries
+    if (this->_pool != NULL) delete this->_pool;
+
+    BOOST_FOREACH(Entry & entry, this->_entries) {
+        if (entry.dof != NULL) delete entry.dof;
+    }
+}
+
+void TrackStreamer::add(const string & path, int flags) {
+    Entry entry;
+    entry.path = path;
+    entry.flags = flags;
+    entry.bytes = 0;
+    entry.dof = NULL;
+    entry.ready = false;
+    this->_entries.push_back(entry);
+}
+
+void TrackStreamer::index() {
+    if (this->_pool == NULL) this->_pool = new WorkerPool();
+
+    for (unsigned int i = 0; i < this->_entries.size(); ++i) {
+        Entry & entry = this->_entries[i];
+        this->_pool->add(new StreamIndexJob(entry.path, entry.flags,
+                    entry.boundingBox, &entry.bytes, &entry.textures));
+    }
+    this->_pool->wait();
+
+    // Leave out the textures the rest of the track has already loaded, they stay
+    BOOST_FOREACH(Entry & entry, this->_entries) {
+        vector<string> textures;
+        sort(entry.textures.begin(), entry.textures.end());
+        entry.textures.erase(unique(entry.textures.begin(), entry.textures.end()),
+                entry.textures.end());
+        BOOST_FOREACH(string & texture, entry.textures) {
+            if (Texture::textures.count(texture) == 0) textures.push_back(texture);
+        }
+        entry.textures.swap(textures);
+    }
+
+    // Put each dof in the cell its centre is in
+    map<pair<int, int>, int> cells;
+    long totalBytes = 0;
+    this->_entryCells.assign(this->_entries.size(), -1);
+    for (unsigned int i = 0; i < this->_entries.size(); ++i) {
+        Entry & entry = this->_entries[i];
+        if (entry.bytes < 0) continue;
+
+        pair<int, int> key(
+            (int)floorf((entry.boundingBox[0] + entry.boundingBox[1]) / 2 / TrackStreamer::cellSize),
+            (int)floorf((entry.boundingBox[4] + entry.boundingBox[5]) / 2 / TrackStreamer::cellSize));
+        if (cells.count(key) == 0) {
+            Cell cell;
+            cell.bounds[0] = entry.boundingBox[0];
+            cell.bounds[1] = entry.boundingBox[1];
+            cell.bounds[2] = entry.boundingBox[4];
+            cell.bounds[3] = entry.boundingBox[5];
+            cell.bytes = 0;
+            cell.loading = false;
+            cell.loaded = false;
+            cell.cancelled = false;
+            cell.nLoading = 0;
+            cells[key] = this->_cells.size();
+            this->_cells.push_back(cell);
+        }
+
+        Cell & cell = this->_cells[cells[key]];
+        cell.bounds[0] = min(cell.bounds[0], entry.boundingBox[0]);
+        cell.bounds[1] = max(cell.bounds[1], entry.boundingBox[1]);
+        cell.bounds[2] = min(cell.bounds[2], entry.boundingBox[4]);
+        cell.bounds[3] = max(cell.bounds[3], entry.boundingBox[5]);
+        cell.bytes += entry.bytes;
+        cell.entries.push_back(i);
+        this->_entryCells[i] = cells[key];
+        totalBytes += entry.bytes;
+    }
+
+    Logger::debug << "Streaming " << this->_entries.size() << " dofs in "
+        << this->_cells.size() << " cells, " << totalBytes / 1024 << "KB" << endl;
+}
+
+float TrackStreamer::_distance(Cell & cell, Vector & position) {
+    float x = max(0.0f, max(cell.bounds[0] - position[0], position[0] - cell.bounds[1]));
+    float z = max(0.0f, max(cell.bounds[2] - position[2], position[2] - cell.bounds[3]));
+    return sqrtf(x * x + z * z);
+}
+
+void TrackStreamer::update(Vector & position) {
+    int entry;
+    if (this->_pool == NULL) return;
+
+    // Take the dofs that have loaded, their textures need to go up first. When
+    // they're decoded in the background the main loop puts them up a bit at a time
+    if (!Texture::asyncDecode) Texture::uploadPending();
+    while (this->_done.tryPop(entry)) {
+        this->_finishLoading(entry);
+    }
+
+    // Throw away the cells that are out of range, and find the ones that need loading
+    vector<pair<float, int> > wanted;
+    vector<pair<float, int> > resident;
+    for (unsigned int i = 0; i < this->_cells.size(); ++i) {
+        Cell & cell = this->_cells[i];
+        float distance = this->_distance(cell, position);
+        bool active = (cell.loaded || cell.loading) && !cell.cancelled;
+
+        if (active && distance > TrackStreamer::radius * STREAMING_HYSTERESIS) {
+            this->_evict(cell);
+        } else if (active) {
+            resident.push_back(make_pair(distance, i));
+        } else if (distance <= TrackStreamer::radius && !cell.loading) {
+            wanted.push_back(make_pair(distance, i));
+        }
+    }
+    this->_releaseTextures();
+
+    // Load the nearest first. If one doesn't fit in the budget make space by
+    // throwing away cells that are further away
+    sort(wanted.begin(), wanted.end());
+    sort(resident.begin(), resident.end());
+    for (unsigned int i = 0; i < wanted.size(); ++i) {
+        Cell & cell = this->_cells[wanted[i].second];
+        long bytes = cell.bytes + this->_newTextureBytes(cell);
+
+        if (TrackStreamer::budget > 0) {
+            while (this->residentBytes + bytes > TrackStreamer::budget
+                    && !resident.empty() && resident.back().first > wanted[i].first) {
+                this->_evict(this->_cells[resident.back().second]);
+                resident.pop_back();
+                // That might have been the last user of some of this cell's textures
+                this->_releaseTextures();
+                bytes = cell.bytes + this->_newTextureBytes(cell);
+            }
+            // Everything else is further away
+            if (this->residentBytes + bytes > TrackStreamer::budget) break;
+        }
+
+        cell.loading = true;
+        cell.nLoading = cell.entries.size();
+        this->_geometryBytes += cell.bytes;
+        this->residentBytes += bytes;
+        BOOST_FOREACH(int j, cell.entries) {
+            this->_useTextures(this->_entries[j], 1);
+            this->_pool->add(new StreamLoadJob(this->_entries[j].path,
+                        this->_entries[j].flags, j, &this->_entries[j].dof, this->_done));
+        }
+    }
+}
+
+void TrackStreamer::_finishLoading(int index) {
+    Entry & entry = this->_entries[index];
+    Cell & cell = this->_cells[this->_entryCells[index]];
+
+    // Note the textures it loaded, even if it's thrown away they've been made
+    BOOST_FOREACH(Mat & mat, entry.dof->getMats()) {
+        for (int i = 0; i < mat.nTextures; ++i) {
+            if (mat.textures[i] == NULL) continue;
+            map<string, StreamedTexture>::iterator it =
+                this->_textures.find(mat.textures[i]->name);
+            if (it != this->_textures.end()) it->second.texture = mat.textures[i];
+        }
+    }
+
+    if (cell.cancelled || !entry.dof->isValid) {
+        this->_useTextures(entry, -1);
+        delete entry.dof;
+        entry.dof = NULL;
+    } else {
+        entry.dof->upload();
+        entry.ready = true;
+    }
+
+    if (--cell.nLoading == 0) {
+        cell.loading = false;
+        cell.loaded = !cell.cancelled;
+        cell.cancelled = false;
+    }
+}
+
+void TrackStreamer::_evict(Cell & cell) {
+    // Anything still loading gets thrown away when it arrives
+    if (cell.loading) cell.cancelled = true;
+    cell.loaded = false;
+    this->_geometryBytes -= cell.bytes;
+    this->residentBytes -= cell.bytes;
+
+    // Their textures go in _releaseTextures
+    BOOST_FOREACH(int i, cell.entries) {
+        Entry & entry = this->_entries[i];
+        if (entry.ready) {
+            this->_useTextures(entry, -1);
+            delete entry.dof;
+            entry.dof = NULL;
+            entry.ready = false;
+        }
+    }
+}
+
+void TrackStreamer::_useTextures(Entry & entry, int users) {
+    BOOST_FOREACH(string & texture, entry.textures) {
+        this->_textures[texture].users += users;
+    }
+}
+
+void TrackStreamer::_releaseTextures() {
+    long bytes = 0;
+    map<string, StreamedTexture>::iterator it;
+    for (it = this->_textures.begin(); it != this->_textures.end(); ++it) {
+        StreamedTexture & texture = it->second;
+        if (texture.texture != NULL) {
+            long size = texture.texture->getMemoryUsage();
+            if (size > 0) texture.bytes = size;
+
+            // Ones still decoding are tried again next time
+            if (texture.users == 0 && Texture::release(texture.texture)) {
+                texture.texture = NULL;
+            }
+        }
+        if (texture.users > 0 || texture.texture != NULL) bytes += texture.bytes;
+    }
+    this->residentBytes = this->_geometryBytes + bytes;
+}
+
+long TrackStreamer::_newTextureBytes(Cell & cell) {
+    // Textures that have never been loaded aren't counted until they have
+    set<string> counted;
+    long bytes = 0;
+    BOOST_FOREACH(int i, cell.entries) {
+        BOOST_FOREACH(string & name, this->_entries[i].textures) {
+            StreamedTexture & texture = this->_textures[name];
+            if (texture.users == 0 && texture.texture == NULL
+                    && counted.insert(name).second) {
+                bytes += texture.bytes;
+            }
+        }
+    }
+    return bytes;
+}
+
+int TrackStreamer::submit(RenderQueue & queue) {
+    int count = 0;
+    BOOST_FOREACH(Entry & entry, this->_entries) {
+        if (entry.ready) count += entry.dof->submit(queue);
+    }
+    return count;
+}
+
+int TrackStreamer::getNResidentDofs() {
+    int count = 0;
+    BOOST_FOREACH(Entry & entry, this->_entries) {
+        if (entry.ready) ++count;
+    }
+    return count;
+}
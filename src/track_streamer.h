@@ -0,0 +1,123 @@
+/**
+ * Streams the track scenery in and out around the car, so only the dofs near it
+ * are kept in memory. The dofs are grouped into square cells on the ground plane,
+ * cells within radius of the car are loaded on a pool of worker threads and cells
+ * that move out of range are thrown away.
+ *
+ * The loaded geometry (CPU arrays and VBOs) and textures are kept under budget by
+ * loading the nearest cells first and not starting a load that would go over.
+ * Textures are shared between dofs, so each one goes once the last cell using it
+ * has. Ones the rest of the track uses stay, and aren't counted.
+ *
+ * Collision surfaces aren't streamed, the physics needs the whole track.
+ */
+#pragma once
+
+#include "dof.h"
+#include "render_queue.h"
+#include "vector.h"
+#include "worker_pool.h"
+
+#include <map>
+#include <string>
+#include <vector>
+
+class TrackStreamer {
+    public:
+        TrackStreamer();
+        ~TrackStreamer();
+
+        // Add a dof to be streamed
+        void add(const std::string & path, int flags);
+
+        // Work out where the dofs are and split them into cells. This reads every
+        // dof's geometry once (but not its textures), so call it after they have all
+        // been added, and after the rest of the track has loaded
+        void index();
+
+        // Start loading the cells that have come into range, hand over the ones that
+        // have finished loading and throw away the ones out of range. Call once a
+        // frame from the main thread
+        void update(Vector & position);
+
+        // Add the loaded dofs to the queue
+        int submit(RenderQueue & queue);
+
+        // Cells closer than this are loaded, and they are kept until they are a bit
+        // further away so they don't flicker in and out
+        static float radius;
+        // Size of a cell
+        static float cellSize;
+        // Most bytes of geometry and textures to have loaded, 0 for no limit
+        static long budget;
+
+        // The geometry and textures currently loaded (or loading)
+        long residentBytes;
+        int getNResidentDofs();
+
+    private:
+        class Entry {
+            public:
+                std::string path;
+                int flags;
+                float boundingBox[6];
+                long bytes;
+                // The textures only the streamed dofs use
+                std::vector<std::string> textures;
+                // Set by the loader thread, so only look at it once the entry has come
+                // off _done
+                Dof * dof;
+                // Loaded and uploaded
+                bool ready;
+        };
+
+        class Cell {
+            public:
+                // x min, x max, z min, z max of the dofs in the cell
+                float bounds[4];
+                std::vector<int> entries;
+                long bytes;
+                bool loading;
+                bool loaded;
+                // Set when the cell went out of range while it was loading
+                bool cancelled;
+                int nLoading;
+        };
+
+        class StreamedTexture {
+            public:
+                StreamedTexture();
+                // Entries loaded or loading that use it. The workers look textures up
+                // by name, so it can't go until this is 0
+                int users;
+                // Set once a dof using it has come back, NULL once it's gone
+                Texture * texture;
+                // How big it was last time it was loaded, 0 until then
+                long bytes;
+        };
+
+        std::vector<Entry> _entries;
+        std::vector<Cell> _cells;
+        // The cell each entry is in
+        std::vector<int> _entryCells;
+        std::map<std::string, StreamedTexture> _textures;
+        long _geometryBytes;
+
+        WorkerPool * _pool;
+        // Entries that have finished loading
+        BlockingQueue<int> _done;
+
+        // Distance on the ground from position to the cell
+        float _distance(Cell & cell, Vector & position);
+
+        // Make a cell's dofs ready to render, or throw them away
+        void _finishLoading(int entry);
+        void _evict(Cell & cell);
+
+        // Count an entry's textures in or out of use
+        void _useTextures(Entry & entry, int users);
+        // Throw away the textures nothing uses any more, and work out residentBytes
+        void _releaseTextures();
+        // Bytes of textures that loading the cell would add, as far as we know
+        long _newTextureBytes(Cell & cell);
+};
@@ -0,0 +1,104 @@
+#include "visibility_sets.h"
+
+#include <fstream>
+#include <sstream>
+#include <boost/foreach.hpp>
+
+using namespace std;
+
+bool VisibilitySets::enabled = false;
+float VisibilitySets::maxDistance = 50;
+string VisibilitySets::fileName = "visibility.pvs";
+
+bool VisibilitySets::load(const string & path) {
+    ifstream file(path.c_str());
+    if (!file.is_open()) return false;
+
+    this->_sectors.clear();
+    string line;
+    while (getline(file, line)) {
+        istringstream words(line);
+        string first;
+        if (!(words >> first)) continue;
+
+        if (first == "sector") {
+            float position[3];
+            if (!(words >> position[0] >> position[1] >> position[2])) return false;
+            this->addSector(position);
+            continue;
+        }
+
+        // Geobs of a dof, these have to be in a sector
+        if (this->_sectors.empty()) return false;
+        int geob;
+        while (words >> geob) {
+            this->addVisible(this->_sectors.size() - 1, first, geob);
+        }
+    }
+    return true;
+}
+
+bool VisibilitySets::save(const string & path) {
+    ofstream file(path.c_str());
+    if (!file.is_open()) return false;
+
+    BOOST_FOREACH(Sector & sector, this->_sectors) {
+        file << "sector " << sector.position[0] << " " << sector.position[1] << " "
+            << sector.position[2] << endl;
+        for (map<string, set<int> >::iterator it = sector.visible.begin();
+                it != sector.visible.end(); ++it) {
+            file << it->first;
+            BOOST_FOREACH(int geob, it->second) {
+                file << " " << geob;
+            }
+            file << endl;
+        }
+    }
+    return file.good();
+}
+
+int VisibilitySets::addSector(const float * position) {
+    Sector sector;
+    for (int i = 0; i < 3; ++i) {
+        sector.position[i] = position[i];
+    }
+    this->_sectors.push_back(sector);
+    return this->_sectors.size() - 1;
+}
+
+void VisibilitySets::addVisible(int sector, const string & dofFile, int geob) {
+    this->_sectors[sector].visible[dofFile].insert(geob);
+}
+
+void VisibilitySets::merge(int sector, VisibilitySets & sets, int from) {
+    map<string, set<int> > & visible = sets._sectors[from].visible;
+    for (map<string, set<int> >::iterator it = visible.begin(); it != visible.end(); ++it) {
+        this->_sectors[sector].visible[it->first].insert(it->second.begin(),
+                it->second.end());
+    }
+}
+
+int VisibilitySets::findSector(const float * position) {
+    int nearest = -1;
+    float nearestDistance = VisibilitySets::maxDistance * VisibilitySets::maxDistance;
+    for (unsigned int i = 0; i < this->_sectors.size(); ++i) {
+        float distance = 0;
+        for (int j = 0; j < 3; ++j) {
+            float d = this->_sectors[i].position[j] - position[j];
+            distance += d * d;
+        }
+        if (distance <= nearestDistance) {
+            nearest = i;
+            nearestDistance = distance;
+        }
+    }
+    return nearest;
+}
+
+map<string, set<int> > & VisibilitySets::getVisible(int sector) {
+    return this->_sectors[sector].visible;
+}
+
+int VisibilitySets::getNSectors() {
+    return this->_sectors.size();
+}
@@ -0,0 +1,62 @@
+/**
+ * Potentially visible sets: for sectors along the track, the geobs that can be seen
+ * from somewhere in the sector. A race track is mostly a corridor, so from any
+ * point on it only a small part of the scenery can ever be seen, and everything
+ * else can be skipped without testing it against the frustum.
+ *
+ * The sets are worked out offline by raceya-pvsgen and saved next to geometry.ini.
+ * The geobs are named by their dof's file and their index in it, so the file has to
+ * be made again if the dofs change. It's text, one sector after another:
+ *   sector x y z
+ *   bldg01.dof 0 1 2 5
+ *   ...
+ */
+#pragma once
+
+#include <map>
+#include <set>
+#include <string>
+#include <vector>
+
+class VisibilitySets {
+    public:
+        // Read the sets from the file, returns false if it couldn't
+        bool load(const std::string & path);
+
+        // Write them out, returns false if it couldn't
+        bool save(const std::string & path);
+
+        // Start a sector centred on position, returns its index
+        int addSector(const float * position);
+
+        // Mark the geob at index in the dof file as visible from the sector
+        void addVisible(int sector, const std::string & dofFile, int geob);
+
+        // Add everything visible from a sector of sets, which can be these, to one
+        // of these
+        void merge(int sector, VisibilitySets & sets, int from);
+
+        // The sector nearest to position, -1 if none is within maxDistance
+        int findSector(const float * position);
+
+        // The geobs visible from the sector, by dof file
+        std::map<std::string, std::set<int> > & getVisible(int sector);
+
+        int getNSectors();
+
+        // Use the sets if the track has them, off by default
+        static bool enabled;
+        // How far the camera can be from a sector and still use it
+        static float maxDistance;
+        // Name of the file in the track's directory
+        static std::string fileName;
+
+    private:
+        class Sector {
+            public:
+                float position[3];
+                std::map<std::string, std::set<int> > visible;
+        };
+
+        std::vector<Sector> _sectors;
+};
@@ -36,7 +36,7 @@ Wheel::~Wheel() {
     dJointDestroy(this->suspensionJointId);
 }
 
-void Wheel::render() {
+void Wheel::submit(RenderQueue & queue) {
     glPushMatrix();
 
     const dReal * position = dBodyGetPosition(this->bodyId);
@@ -63,7 +63,8 @@ void Wheel::render() {
     // Rotate the wheel around the axis
     glRotatef(rad_2_deg(this->rotation), 1, 0, 0);
 
-    this->_dof->render(true);
+    queue.captureTransform();
+    this->_dof->submit(queue, true);
 
     glPopMatrix();
 }
@@ -8,6 +8,7 @@
 
 #include "dof.h"
 #include "matrix.h"
+#include "render_queue.h"
 #include "car.h"
 
 class Car;
@@ -16,7 +17,9 @@ class Wheel {
     public:
         Wheel(int position, Dof * dof, Car & car);
         ~Wheel();
-        void render();
+
+        // Add the wheel to the queue where it is now
+        void submit(RenderQueue & queue);
 
         // Turn the wheel around its axis
         void turn(float turn);
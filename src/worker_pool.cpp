@@ -0,0 +1,94 @@
+#include "worker_pool.h"
+
+#include <unistd.h>
+
+WorkerPool::WorkerPool(int nThreads) {
+    if (nThreads <= 0) nThreads = WorkerPool::cpuCount();
+    this->_nThreads = nThreads;
+    this->_running = 0;
+    this->_stopping = false;
+
+    pthread_mutex_init(&this->_mutex, NULL);
+    pthread_cond_init(&this->_jobAdded, NULL);
+    pthread_cond_init(&this->_jobsDone, NULL);
+
+    this->_threads = new pthread_t[this->_nThreads];
+    for (int i = 0; i < this->_nThreads; ++i) {
+        pthread_create(&this->_threads[i], NULL, &WorkerPool::_work, this);
+    }
+}
+
+WorkerPool::~WorkerPool() {
+    this->wait();
+
+    // Wake everyone up so they see we're stopping
+    pthread_mutex_lock(&this->_mutex);
+    this->_stopping = true;
+    pthread_cond_broadcast(&this->_jobAdded);
+    pthread_mutex_unlock(&this->_mutex);
+
+    for (int i = 0; i < this->_nThreads; ++i) {
+        pthread_join(this->_threads[i], NULL);
+    }
+    delete[] this->_threads;
+
+    pthread_cond_destroy(&this->_jobsDone);
+    pthread_cond_destroy(&this->_jobAdded);
+    pthread_mutex_destroy(&this->_mutex);
+}
+
+void WorkerPool::add(Job * job) {
+    pthread_mutex_lock(&this->_mutex);
+    this->_jobs.push_back(job);
+    pthread_cond_signal(&this->_jobAdded);
+    pthread_mutex_unlock(&this->_mutex);
+}
+
+void WorkerPool::wait() {
+    pthread_mutex_lock(&this->_mutex);
+    while (!this->_jobs.empty() || this->_running > 0) {
+        pthread_cond_wait(&this->_jobsDone, &this->_mutex);
+    }
+    pthread_mutex_unlock(&this->_mutex);
+}
+
+int WorkerPool::getNThreads() {
+    return this->_nThreads;
+}
+
+int WorkerPool::cpuCount() {
+    long count = sysconf(_SC_NPROCESSORS_ONLN);
+    if (count < 1) count = 1;
+    return count;
+}
+
+void * WorkerPool::_work(void * p) {
+    WorkerPool * pool = (WorkerPool *)p;
+
+    pthread_mutex_lock(&pool->_mutex);
+    while (true) {
+        // Sleep until there's something to do
+        while (pool->_jobs.empty() && !pool->_stopping) {
+            pthread_cond_wait(&pool->_jobAdded, &pool->_mutex);
+        }
+        if (pool->_jobs.empty() && pool->_stopping) break;
+
+        Job * job = pool->_jobs.front();
+        pool->_jobs.pop_front();
+        ++pool->_running;
+
+        // Run the job without holding the lock
+        pthread_mutex_unlock(&pool->_mutex);
+        job->run();
+        delete job;
+        pthread_mutex_lock(&pool->_mutex);
+
+        --pool->_running;
+        if (pool->_jobs.empty() && pool->_running == 0) {
+            pthread_cond_broadcast(&pool->_jobsDone);
+        }
+    }
+    pthread_mutex_unlock(&pool->_mutex);
+
+    return NULL;
+}
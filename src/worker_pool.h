@@ -0,0 +1,107 @@
+/**
+ * A simple pool of worker threads for running loading jobs in the background, plus a
+ * blocking queue for handing the results back.
+ *
+ * Nothing that runs on a worker may touch OpenGL, the context belongs to the main
+ * thread. Jobs should hand anything that needs uploading back to the main thread.
+ */
+#pragma once
+
+#include <list>
+#include <pthread.h>
+
+using namespace std;
+
+class Job {
+    public:
+        virtual ~Job() {}
+
+        // Do the work, called on one of the worker threads
+        virtual void run() = 0;
+};
+
+class WorkerPool {
+    public:
+        // Start nThreads workers, 0 means one per CPU
+        WorkerPool(int nThreads = 0);
+
+        // Waits for the queued jobs to finish and stops the workers
+        ~WorkerPool();
+
+        // Queue a job, the pool takes ownership and deletes it once it has run
+        void add(Job * job);
+
+        // Block until every queued job has run
+        void wait();
+
+        int getNThreads();
+
+        // The number of CPUs available
+        static int cpuCount();
+
+    private:
+        int _nThreads;
+        pthread_t * _threads;
+
+        list<Job *> _jobs;
+        // Jobs that have been taken off the queue but haven't finished yet
+        int _running;
+        bool _stopping;
+
+        pthread_mutex_t _mutex;
+        pthread_cond_t _jobAdded;
+        pthread_cond_t _jobsDone;
+
+        // The worker thread loop
+        static void * _work(void * pool);
+};
+
+// A thread safe FIFO, pop blocks until there is something to return
+template <class T> class BlockingQueue {
+    public:
+        BlockingQueue() {
+            pthread_mutex_init(&this->_mutex, NULL);
+            pthread_cond_init(&this->_pushed, NULL);
+        }
+
+        ~BlockingQueue() {
+            pthread_cond_destroy(&this->_pushed);
+            pthread_mutex_destroy(&this->_mutex);
+        }
+
+        void push(const T & item) {
+            pthread_mutex_lock(&this->_mutex);
+            this->_items.push_back(item);
+            pthread_cond_signal(&this->_pushed);
+            pthread_mutex_unlock(&this->_mutex);
+        }
+
+        T pop() {
+            pthread_mutex_lock(&this->_mutex);
+            while (this->_items.empty()) {
+                pthread_cond_wait(&this->_pushed, &this->_mutex);
+            }
+            T item = this->_items.front();
+            this->_items.pop_front();
+            pthread_mutex_unlock(&this->_mutex);
+            return item;
+        }
+
+        // Pop without blocking, returns false if the queue was empty
+        bool tryPop(T & item) {
+            bool found = false;
+            pthread_mutex_lock(&this->_mutex);
+            if (!this->_items.empty()) {
+                item = this->_items.front();
+                this->_items.pop_front();
+                found = true;
+            }
+            pthread_mutex_unlock(&this->_mutex);
+            return found;
+        }
+
+    private:
+        list<T> _items;
+        pthread_mutex_t _mutex;
+        pthread_cond_t _pushed;
+};
@@ -0,0 +1,191 @@
+/**
+ * Microbenchmark of the frustum culling. Loads the dofs under the given directories
+ * (resources/tracks/Monaco_AM by default), takes the bounding box of every geob and
+ * culls them all from a set of views around the track with:
+ *   sphere: ViewFrustumCulling::testObject, one box at a time
+ *   box: ViewFrustumCulling::testBox, one box at a time
+ *   simd: BoxCuller, four boxes at a time
+ *   tree: BoundingVolumeTree
+ * and prints the time per view and the number of boxes found visible.
+ *
+ * Usage: raceya-cullbench [--views n] [--repeats n] [directories...]
+ *
+ * The views are from a couple of metres above random geobs, looking in a random
+ * direction, with the projection main.cpp uses.
+ */
+#include "../src/dof.h"
+#include "../src/frustum_culler.h"
+#include "../src/box_culler.h"
+#include "../src/bounding_volume_tree.h"
+#include "../src/texture.h"
+#include "../src/load_timer.h"
+#include "../src/logger.h"
+
+#include <vector>
+#include <string>
+#include <iostream>
+#include <stdlib.h>
+#include <math.h>
+#include <SDL/SDL.h>
+#include <boost/filesystem.hpp>
+#include <boost/ptr_container/ptr_vector.hpp>
+#include <boost/algorithm/string.hpp>
+#include <boost/foreach.hpp>
+
+using namespace std;
+namespace fs = boost::filesystem;
+
+// glFrustum(-width, width, -1, 1, near, far), as set up in main.cpp
+static void makeProjection(float * matrix, float width, float near, float far) {
+    for (int i = 0; i < 16; ++i) matrix[i] = 0;
+    matrix[0] = near / width;
+    matrix[5] = near;
+    matrix[10] = -(far + near) / (far - near);
+    matrix[11] = -1;
+    matrix[14] = -2 * far * near / (far - near);
+}
+
+// Looking from position, turned yaw radians around the y axis
+static void makeView(float * matrix, float * position, float yaw) {
+    float c = cos(yaw);
+    float s = sin(yaw);
+    for (int i = 0; i < 16; ++i) matrix[i] = 0;
+    matrix[0] = c;
+    matrix[2] = s;
+    matrix[5] = 1;
+    matrix[8] = -s;
+    matrix[10] = c;
+    matrix[15] = 1;
+    matrix[12] = -(c * position[0] - s * position[2]);
+    matrix[13] = -position[1];
+    matrix[14] = -(s * position[0] + c * position[2]);
+}
+
+// Time one way of culling over all the views, prints the milliseconds per view and
+// the average number visible
+template <class F> static void timeCulling(const string & name,
+        vector<ViewFrustumCulling> & views, int repeats, F cull) {
+    long visible = 0;
+    double start = LoadTimer::now();
+    for (int i = 0; i < repeats; ++i) {
+        BOOST_FOREACH(ViewFrustumCulling & view, views) {
+            visible += cull(view);
+        }
+    }
+    double milliseconds = (LoadTimer::now() - start) / repeats / views.size();
+    cout << name << ": " << milliseconds * 1000 << "us per view, "
+        << (float)visible / repeats / views.size() << " visible" << endl;
+}
+
+static vector<float *> boxes;
+static BoxCuller boxCuller;
+static BoundingVolumeTree tree;
+static vector<int> visible;
+
+static int cullSpheres(ViewFrustumCulling & view) {
+    int count = 0;
+    BOOST_FOREACH(float * box, boxes) {
+        if (view.testObject(box)) ++count;
+    }
+    return count;
+}
+
+static int cullBoxes(ViewFrustumCulling & view) {
+    int count = 0;
+    BOOST_FOREACH(float * box, boxes) {
+        int planes = FRUSTUM_ALL_PLANES;
+        if (view.testBox(box, planes) != FRUSTUM_OUTSIDE) ++count;
+    }
+    return count;
+}
+
+static int cullSimd(ViewFrustumCulling & view) {
+    visible.clear();
+    return boxCuller.cull(view, visible);
+}
+
+static int cullTree(ViewFrustumCulling & view) {
+    visible.clear();
+    return tree.cull(view, visible);
+}
+
+int main(int argc, char ** argv) {
+    int nViews = 200;
+    int repeats = 50;
+    vector<string> roots;
+
+    for (int i = 1; i < argc; ++i) {
+        string argument(argv[i]);
+        if (argument == "--views" && i + 1 < argc) {
+            nViews = atoi(argv[++i]);
+        } else if (argument == "--repeats" && i + 1 < argc) {
+            repeats = atoi(argv[++i]);
+        } else {
+            roots.push_back(argument);
+        }
+    }
+    if (roots.empty()) roots.push_back("resources/tracks/Monaco_AM");
+
+    // The materials load their textures, and SDL needs a video mode to convert them
+    setenv("SDL_VIDEODRIVER", "dummy", 1);
+    if (SDL_Init(SDL_INIT_VIDEO) < 0 || SDL_SetVideoMode(16, 16, 32, SDL_SWSURFACE) == NULL) {
+        cout << "Unable to init SDL: " << SDL_GetError() << endl;
+        return 1;
+    }
+    Texture::deferUploads = true;
+
+    boost::ptr_vector<Dof> dofs;
+    BOOST_FOREACH(string & root, roots) {
+        if (!fs::exists(root)) {
+            cout << "Warning: " << root << " doesn't exist" << endl;
+            continue;
+        }
+        for (fs::recursive_directory_iterator it(root), end; it != end; ++it) {
+            if (!fs::is_regular_file(it->path())) continue;
+            if (boost::to_lower_copy(it->path().extension().string()) != ".dof") continue;
+
+            Dof * dof = new Dof(it->path().string(), 0, true, true);
+            Texture::discardPending();
+            Logger::maintain();
+            if (!dof->isValid) {
+                delete dof;
+                continue;
+            }
+            dofs.push_back(dof);
+            BOOST_FOREACH(Geob & geob, dof->getGeobs()) {
+                boxes.push_back(geob.boundingBox);
+                boxCuller.add(geob.boundingBox);
+                tree.add(geob.boundingBox);
+            }
+        }
+    }
+    if (boxes.empty()) {
+        cout << "No geobs found" << endl;
+        return 1;
+    }
+    tree.build();
+    cout << boxes.size() << " boxes from " << dofs.size() << " dofs, "
+        << tree.getNNodes() << " tree nodes" << endl;
+
+    // The same views for everything
+    float projection[16];
+    makeProjection(projection, 800.0 / 600.0, 1.5, 150);
+    srand(1);
+    vector<ViewFrustumCulling> views(nViews);
+    BOOST_FOREACH(ViewFrustumCulling & view, views) {
+        float * box = boxes[rand() % boxes.size()];
+        float position[3] = {
+            (box[0] + box[1]) / 2, box[3] + 2, (box[4] + box[5]) / 2 };
+        float modelView[16];
+        makeView(modelView, position, (float)rand() / RAND_MAX * 2 * M_PI);
+        view.setMatrices(modelView, projection);
+    }
+
+    timeCulling("sphere", views, repeats, cullSpheres);
+    timeCulling("box", views, repeats, cullBoxes);
+    timeCulling("simd", views, repeats, cullSimd);
+    timeCulling("tree", views, repeats, cullTree);
+
+    SDL_Quit();
+    return 0;
+}
@@ -0,0 +1,391 @@
+/**
+ * Offline optimiser for DOF files, so the work is done once at install time rather
+ * than every time the track loads. Each dof is loaded with the game's own parser,
+ * cleaned up and written back out as DOF1:
+ *  * only the triangles the bursts cover are kept, the rest of the index list is
+ *    dropped along with degenerate triangles and the vertices nothing uses
+ *  * each geob gets a single burst that matches its indices
+ *  * VCOL and any other chunks we don't read are dropped
+ *  * opaque geobs with the same material are merged, as long as the result fits in
+ *    short indices and isn't so big it stops the frustum culling doing its job
+ *  * the triangles and vertices are reordered for the vertex cache
+ *
+ * The materials are copied over untouched. Each file is read back in after it is
+ * written and is only put in place if it loads.
+ *
+ * Usage: raceya-dofopt [--output directory] [--no-merge] [--merge-size size]
+ *                      files or directories...
+ *
+ * Without --output the dofs are rewritten in place, and the original is kept next to
+ * it with .orig on the end (unless there already is one).
+ */
+#include "../src/dof.h"
+#include "../src/texture.h"
+#include "../src/geometry_cache.h"
+#include "../src/mesh_optimiser.h"
+#include "../src/logger.h"
+
+#include <vector>
+#include <string>
+#include <iostream>
+#include <stdlib.h>
+#include <SDL/SDL.h>
+#include <boost/filesystem.hpp>
+#include <boost/algorithm/string.hpp>
+#include <boost/foreach.hpp>
+
+using namespace std;
+namespace fs = boost::filesystem;
+
+// Largest number of vertices a geob can have with short indices
+#define MAX_GEOB_VERTICES 65535
+
+static bool mergeGeobs = true;
+// Merged geobs can't be bigger than this in any direction
+static float mergeSize = 100;
+
+// Totals for the report
+static int nFiles = 0;
+static int geobsBefore = 0;
+static int geobsAfter = 0;
+static long trianglesDropped = 0;
+static long verticesDropped = 0;
+static long bytesBefore = 0;
+static long bytesAfter = 0;
+
+// The geometry of one or more geobs on its way to being written out
+class Mesh {
+    public:
+        // Take the triangles the geob draws and the vertices they use
+        Mesh(Geob & geob, bool transparent);
+
+        unsigned int material;
+        int flags;
+        int paintFlags;
+        bool transparent;
+        bool hasNormals;
+        bool hasTextureCoords;
+
+        std::vector<unsigned short> indices;
+        std::vector<float> vertices;
+        std::vector<float> normals;
+        std::vector<float> textureCoords;
+        float boundingBox[6];
+
+        int getNVertices();
+
+        // Check mesh can be added to this one, and add it
+        bool canMerge(Mesh & mesh);
+        void merge(Mesh & mesh);
+
+        // Make a geob for dof with a single burst covering all the triangles
+        Geob * makeGeob(Dof * dof);
+};
+
+Mesh::Mesh(Geob & geob, bool transparent) {
+    this->material = geob.material;
+    this->flags = geob.flags;
+    this->paintFlags = geob.paintFlags;
+    this->transparent = transparent;
+    this->hasNormals = geob.nNormals > 0;
+    this->hasTextureCoords = geob.nTextureCoords > 0;
+
+    // Where each of the geob's vertices ends up, -1 if it isn't used
+    vector<int> remap(geob.nVertices, -1);
+
+    // The same as Geob::draw, a burst can run off the end of the indices
+    for (int j = 0; j < geob.nBursts; ++j) {
+        int start = geob.burstStarts[j] / 3;
+        int end = min(start + geob.burstsCount[j] / 3, geob.nIndices);
+        if (start < 0) continue;
+
+        for (int i = start; i + 2 < end; i += 3) {
+            unsigned short * triangle = geob.indices + i;
+            if (triangle[0] == triangle[1] || triangle[1] == triangle[2]
+                    || triangle[0] == triangle[2]) {
+                continue;
+            }
+
+            for (int k = 0; k < 3; ++k) {
+                int v = triangle[k];
+                if (remap[v] < 0) {
+                    remap[v] = this->getNVertices();
+                    this->vertices.insert(this->vertices.end(), geob.vertices[v],
+                            geob.vertices[v] + 3);
+
+                    // Missing normals and texture coordinates are 0, as they are when
+                    // the game loads them
+                    for (int l = 0; l < 3; ++l) {
+                        this->normals.push_back(
+                                v < (int)geob.nNormals ? geob.normals[v][l] : 0);
+                    }
+                    for (int l = 0; l < 2; ++l) {
+                        this->textureCoords.push_back(
+                                v < (int)geob.nTextureCoords ? geob.textureCoords[v][l] : 0);
+                    }
+                }
+                this->indices.push_back(remap[v]);
+            }
+        }
+    }
+
+    trianglesDropped += geob.nIndices / 3 - this->indices.size() / 3;
+    verticesDropped += geob.nVertices - this->getNVertices();
+
+    for (int i = 0; i < 3; ++i) {
+        this->boundingBox[i * 2] = 0;
+        this->boundingBox[i * 2 + 1] = 0;
+    }
+    for (int v = 0; v < this->getNVertices(); ++v) {
+        for (int i = 0; i < 3; ++i) {
+            float value = this->vertices[v * 3 + i];
+            if (v == 0 || value < this->boundingBox[i * 2]) {
+                this->boundingBox[i * 2] = value;
+            }
+            if (v == 0 || value > this->boundingBox[i * 2 + 1]) {
+                this->boundingBox[i * 2 + 1] = value;
+            }
+        }
+    }
+}
+
+int Mesh::getNVertices() {
+    return this->vertices.size() / 3;
+}
+
+bool Mesh::canMerge(Mesh & mesh) {
+    // Transparent geobs are drawn in the order they are in the file
+    if (this->transparent || mesh.transparent) return false;
+
+    if (this->material != mesh.material || this->flags != mesh.flags
+            || this->paintFlags != mesh.paintFlags
+            || this->hasNormals != mesh.hasNormals
+            || this->hasTextureCoords != mesh.hasTextureCoords) {
+        return false;
+    }
+
+    if (this->getNVertices() + mesh.getNVertices() > MAX_GEOB_VERTICES) return false;
+
+    for (int i = 0; i < 3; ++i) {
+        float size = max(this->boundingBox[i * 2 + 1], mesh.boundingBox[i * 2 + 1])
+            - min(this->boundingBox[i * 2], mesh.boundingBox[i * 2]);
+        if (size > mergeSize) return false;
+    }
+    return true;
+}
+
+void Mesh::merge(Mesh & mesh) {
+    int offset = this->getNVertices();
+    for (unsigned int i = 0; i < mesh.indices.size(); ++i) {
+        this->indices.push_back(mesh.indices[i] + offset);
+    }
+    this->vertices.insert(this->vertices.end(), mesh.vertices.begin(), mesh.vertices.end());
+    this->normals.insert(this->normals.end(), mesh.normals.begin(), mesh.normals.end());
+    this->textureCoords.insert(this->textureCoords.end(), mesh.textureCoords.begin(),
+            mesh.textureCoords.end());
+
+    for (int i = 0; i < 3; ++i) {
+        this->boundingBox[i * 2] = min(this->boundingBox[i * 2], mesh.boundingBox[i * 2]);
+        this->boundingBox[i * 2 + 1] = max(this->boundingBox[i * 2 + 1],
+                mesh.boundingBox[i * 2 + 1]);
+    }
+}
+
+Geob * Mesh::makeGeob(Dof * dof) {
+    Geob * geob = new Geob();
+    geob->dof = dof;
+    geob->material = this->material;
+    geob->flags = this->flags;
+    geob->paintFlags = this->paintFlags;
+
+    geob->nIndices = this->indices.size();
+    geob->indices = new unsigned short[geob->nIndices];
+    copy(this->indices.begin(), this->indices.end(), geob->indices);
+
+    geob->nVertices = this->getNVertices();
+    geob->vertices = new float[geob->nVertices][3];
+    copy(this->vertices.begin(), this->vertices.end(), geob->vertices[0]);
+    if (this->hasNormals) {
+        geob->nNormals = geob->nVertices;
+        geob->normals = new float[geob->nVertices][3];
+        copy(this->normals.begin(), this->normals.end(), geob->normals[0]);
+    }
+    if (this->hasTextureCoords) {
+        geob->nTextureCoords = geob->nVertices;
+        geob->textureCoords = new float[geob->nVertices][2];
+        copy(this->textureCoords.begin(), this->textureCoords.end(),
+                geob->textureCoords[0]);
+    }
+
+    // The burst counts are in thirds of an index, like the ones the exporters write
+    geob->nBursts = 1;
+    geob->burstStarts = new int[1];
+    geob->burstsCount = new int[1];
+    geob->burstsMaterials = new int[1];
+    geob->burstStarts[0] = 0;
+    geob->burstsCount[0] = geob->nIndices * 3;
+    geob->burstsMaterials[0] = this->material;
+    return geob;
+}
+
+// Optimise the dof at path and write it to output, returns false if it was left alone
+static bool optimiseDof(const fs::path & path, const fs::path & output) {
+    Dof dof(path.string(), 0, true, true);
+    if (!dof.isValid) {
+        cout << "Warning: couldn't load " << path.string() << ", skipping" << endl;
+        return false;
+    }
+
+    boost::ptr_list<Geob> & geobs = dof.getGeobs();
+    int nMats = dof.getMats().size();
+    vector<Mesh> meshes;
+    BOOST_FOREACH(Geob & geob, geobs) {
+        // Without a material we can't tell if it is transparent, so it is left alone
+        bool transparent = geob.material >= (unsigned int)nMats
+            || dof.getMats()[geob.material].isTransparent();
+        Mesh mesh(geob, transparent);
+        if (mesh.indices.empty()) continue;
+
+        // Add it to the first mesh it fits in, the order of the geobs is kept
+        // otherwise
+        bool merged = false;
+        for (unsigned int i = 0; i < meshes.size() && mergeGeobs && !merged; ++i) {
+            if (meshes[i].canMerge(mesh)) {
+                meshes[i].merge(mesh);
+                merged = true;
+            }
+        }
+        if (!merged) meshes.push_back(mesh);
+    }
+
+    int nGeobs = geobs.size();
+    geobs.clear();
+    BOOST_FOREACH(Mesh & mesh, meshes) {
+        Geob * geob = mesh.makeGeob(&dof);
+        MeshOptimiser::optimise(*geob);
+        geobs.push_back(geob);
+    }
+
+    // Write it next to where it is going, and check it loads before putting it in
+    // place
+    fs::create_directories(output.parent_path());
+    string tmpPath = output.string() + ".tmp";
+    if (!dof.save(tmpPath)) {
+        fs::remove(tmpPath);
+        return false;
+    }
+    Dof check(tmpPath, 0, true, true);
+    if (!check.isValid || check.getGeobs().size() != geobs.size()) {
+        cout << "Warning: optimised " << path.string() << " didn't load back in, "
+            << "skipping" << endl;
+        fs::remove(tmpPath);
+        return false;
+    }
+
+    bytesBefore += fs::file_size(path);
+    bytesAfter += fs::file_size(tmpPath);
+    if (output == path) {
+        fs::path backup = path.string() + ".orig";
+        if (!fs::exists(backup)) fs::copy_file(path, backup);
+        fs::remove(path);
+    }
+    fs::rename(tmpPath, output);
+
+    ++nFiles;
+    geobsBefore += nGeobs;
+    geobsAfter += geobs.size();
+    return true;
+}
+
+int main(int argc, char ** argv) {
+    string output;
+    vector<fs::path> roots;
+
+    for (int i = 1; i < argc; ++i) {
+        string argument(argv[i]);
+        if (argument == "--output" && i + 1 < argc) {
+            output = argv[++i];
+        } else if (argument == "--no-merge") {
+            mergeGeobs = false;
+        } else if (argument == "--merge-size" && i + 1 < argc) {
+            mergeSize = atof(argv[++i]);
+        } else {
+            roots.push_back(argument);
+        }
+    }
+    if (roots.empty()) {
+        cout << "Usage: " << argv[0] << " [--output directory] [--no-merge] "
+            << "[--merge-size size] files or directories..." << endl;
+        return 1;
+    }
+
+    // We want the geometry as it is in the file, not the cache
+    GeometryCache::cachePath = "";
+
+    // The materials load their textures, and SDL needs a video mode to convert them
+    // to. The dummy driver gives us one without a window
+    setenv("SDL_VIDEODRIVER", "dummy", 1);
+    if (SDL_Init(SDL_INIT_VIDEO) < 0 || SDL_SetVideoMode(16, 16, 32, SDL_SWSURFACE) == NULL) {
+        cout << "Unable to init SDL: " << SDL_GetError() << endl;
+        return 1;
+    }
+    Texture::deferUploads = true;
+
+    BOOST_FOREACH(fs::path & root, roots) {
+        if (!fs::exists(root)) {
+            cout << "Warning: " << root.string() << " doesn't exist" << endl;
+            continue;
+        }
+
+        vector<fs::path> dofs;
+        if (fs::is_directory(root)) {
+            for (fs::recursive_directory_iterator it(root), end; it != end; ++it) {
+                if (fs::is_regular_file(it->path())
+                        && boost::to_lower_copy(it->path().extension().string()) == ".dof") {
+                    dofs.push_back(it->path());
+                }
+            }
+        } else {
+            dofs.push_back(root);
+        }
+
+        BOOST_FOREACH(fs::path & dof, dofs) {
+            // With an output directory the files keep their place under the root
+            fs::path target = dof;
+            if (!output.empty()) {
+                // The directory iterator puts the root on the front of each path
+                string relative = dof.filename().string();
+                if (fs::is_directory(root)) {
+                    relative = dof.string().substr(root.string().size());
+                    boost::trim_left_if(relative, boost::is_any_of("/"));
+                }
+                target = fs::path(output) / relative;
+            }
+
+            try {
+                optimiseDof(dof, target);
+            } catch (std::exception & e) {
+                cout << "Warning: failed to optimise " << dof.string() << ": "
+                    << e.what() << endl;
+            }
+
+            // Nothing is going to the GPU, and the log would grow for ever
+            Texture::discardPending();
+            Logger::maintain();
+        }
+    }
+
+    cout << nFiles << " dofs optimised, " << bytesBefore / 1024 << "KB to "
+        << bytesAfter / 1024 << "KB" << endl;
+    cout << "Geobs: " << geobsBefore << " to " << geobsAfter << endl;
+    cout << "Dropped " << trianglesDropped << " triangles and " << verticesDropped
+        << " vertices" << endl;
+    if (MeshOptimiser::triangles > 0) {
+        cout << "ACMR: " << (float)MeshOptimiser::transformsBefore / MeshOptimiser::triangles
+            << " to " << (float)MeshOptimiser::transformsAfter / MeshOptimiser::triangles
+            << endl;
+    }
+
+    SDL_Quit();
+    return 0;
+}
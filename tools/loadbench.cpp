@@ -0,0 +1,190 @@
+/**
+ * Headless benchmark of the asset loaders. Walks the tracks and cars under the given
+ * directories (resources/tracks and resources/cars by default) and times the ini
+ * parser, shader parser, texture decoding and DOF parsing separately, without
+ * opening a window or touching OpenGL.
+ *
+ * Writes a CSV report, one line per file plus a total for each type:
+ *   type,file,bytes,ms,mb_per_s
+ *
+ * Usage: raceya-loadbench [--output report.csv] [--geometry-cache] [--texture-cache]
+ *                         [directories...]
+ *
+ * The texture decodes a shader or DOF does while it loads are taken out of its time,
+ * they are reported as textures. The caches are off unless asked for, so the DOF and
+ * texture times are the real parse and decode. Run it twice with a cache on to
+ * compare a cold start with a warm one.
+ */
+#include "../src/dof.h"
+#include "../src/ini.h"
+#include "../src/shader.h"
+#include "../src/texture.h"
+#include "../src/load_timer.h"
+#include "../src/geometry_cache.h"
+#include "../src/texture_cache.h"
+#include "../src/logger.h"
+
+#include <map>
+#include <vector>
+#include <string>
+#include <fstream>
+#include <iostream>
+#include <stdlib.h>
+#include <SDL/SDL.h>
+#include <boost/filesystem.hpp>
+#include <boost/algorithm/string.hpp>
+#include <boost/foreach.hpp>
+
+using namespace std;
+namespace fs = boost::filesystem;
+
+// Totals for a type of file
+class Total {
+    public:
+        Total() : files(0), bytes(0), milliseconds(0) {}
+        int files;
+        long bytes;
+        double milliseconds;
+};
+
+static ofstream report;
+static map<string, Total> totals;
+
+static double textureTime() {
+    return LoadTimer::phases["texture decode"] + LoadTimer::phases["texture cache"];
+}
+
+static void writeLine(const string & type, const string & file, long bytes,
+        double milliseconds) {
+    double rate = milliseconds > 0 ? (bytes / 1048576.0) / (milliseconds / 1000) : 0;
+    report << type << "," << file << "," << bytes << "," << milliseconds << ","
+        << rate << endl;
+}
+
+// Time one file. Shaders and dofs can decode textures on the way, that's taken out
+// so it only counts towards the textures
+template <class F> static void timeFile(const string & type, const fs::path & file,
+        F load) {
+    double textures = textureTime();
+    double start = LoadTimer::now();
+    load(file.string());
+    double milliseconds = LoadTimer::now() - start;
+    if (type != "texture") milliseconds -= textureTime() - textures;
+
+    long bytes = fs::file_size(file);
+    writeLine(type, file.string(), bytes, milliseconds);
+
+    Total & total = totals[type];
+    ++total.files;
+    total.bytes += bytes;
+    total.milliseconds += milliseconds;
+
+    // None of this is going to the GPU, and the log would grow for ever
+    Texture::discardPending();
+    Logger::maintain();
+}
+
+static void loadIni(const string & path) {
+    Ini ini(path);
+}
+
+static void loadShader(const string & path) {
+    Shader::parseShaderFile(path);
+}
+
+static void loadTexture(const string & path) {
+    Texture::getOrMakeTexture(path);
+}
+
+static void loadDof(const string & path) {
+    Dof dof(path, 0, true, true);
+}
+
+int main(int argc, char ** argv) {
+    string output = "loadbench.csv";
+    vector<string> roots;
+    string cachePath = GeometryCache::cachePath;
+    GeometryCache::cachePath = "";
+    string textureCachePath = TextureCache::cachePath;
+    TextureCache::cachePath = "";
+
+    for (int i = 1; i < argc; ++i) {
+        string argument(argv[i]);
+        if (argument == "--output" && i + 1 < argc) {
+            output = argv[++i];
+        } else if (argument == "--geometry-cache") {
+            GeometryCache::cachePath = cachePath;
+        } else if (argument == "--texture-cache") {
+            TextureCache::cachePath = textureCachePath;
+        } else {
+            roots.push_back(argument);
+        }
+    }
+    if (roots.empty()) {
+        roots.push_back("resources/tracks");
+        roots.push_back("resources/cars");
+    }
+
+    // SDL needs a video mode to convert the textures to, the dummy driver gives us one
+    // without a window
+    setenv("SDL_VIDEODRIVER", "dummy", 1);
+    if (SDL_Init(SDL_INIT_VIDEO) < 0 || SDL_SetVideoMode(16, 16, 32, SDL_SWSURFACE) == NULL) {
+        cout << "Unable to init SDL: " << SDL_GetError() << endl;
+        return 1;
+    }
+    Texture::deferUploads = true;
+
+    report.open(output.c_str());
+    if (!report.is_open()) {
+        cout << "Couldn't open " << output << endl;
+        return 1;
+    }
+    report << "type,file,bytes,ms,mb_per_s" << endl;
+
+    // Sort the files by type first, so each type is timed in one go. Textures go
+    // before the shaders and DOFs that use them, so those mostly find them decoded
+    vector<fs::path> inis, shaders, textures, dofs;
+    BOOST_FOREACH(string & root, roots) {
+        if (!fs::exists(root)) {
+            cout << "Warning: " << root << " doesn't exist" << endl;
+            continue;
+        }
+        for (fs::recursive_directory_iterator it(root), end; it != end; ++it) {
+            if (!fs::is_regular_file(it->path())) continue;
+
+            string extension = boost::to_lower_copy(it->path().extension().string());
+            if (extension == ".ini") {
+                inis.push_back(it->path());
+            } else if (extension == ".shd") {
+                shaders.push_back(it->path());
+            } else if (extension == ".bmp" || extension == ".tga" || extension == ".png"
+                    || extension == ".jpg") {
+                textures.push_back(it->path());
+            } else if (extension == ".dof") {
+                dofs.push_back(it->path());
+            }
+        }
+    }
+
+    BOOST_FOREACH(fs::path & file, inis) timeFile("ini", file, loadIni);
+    BOOST_FOREACH(fs::path & file, textures) timeFile("texture", file, loadTexture);
+    BOOST_FOREACH(fs::path & file, shaders) timeFile("shader", file, loadShader);
+    BOOST_FOREACH(fs::path & file, dofs) timeFile("dof", file, loadDof);
+
+    // The totals go in the report and on the console
+    for (map<string, Total>::iterator it = totals.begin(); it != totals.end(); ++it) {
+        writeLine("total", it->first, it->second.bytes, it->second.milliseconds);
+        cout << it->first << ": " << it->second.files << " files, "
+            << it->second.bytes / 1024 << "KB in " << it->second.milliseconds << "ms"
+            << endl;
+    }
+    if (!TextureCache::cachePath.empty()) {
+        cout << "texture cache: " << TextureCache::hits << " hits in "
+            << TextureCache::hitTime << "ms, " << TextureCache::misses << " misses in "
+            << TextureCache::missTime << "ms" << endl;
+    }
+
+    report.close();
+    SDL_Quit();
+    return 0;
+}
@@ -0,0 +1,185 @@
+/**
+ * Benchmark of building the mipmaps for the bundled textures. Decodes every power of
+ * two texture under the given directories (resources/tracks and resources/cars by
+ * default) the same way Texture does, then times for all of them:
+ *   glu: gluBuild2DMipmaps, building and uploading the levels
+ *   build: MipmapGenerator::build
+ *   gamma: MipmapGenerator::build averaging in linear space
+ *   upload: glTexImage2D for each level MipmapGenerator made
+ * and prints the milliseconds for each over all the textures, the best of the
+ * repeats. The largest difference between GLU's second level and ours is printed
+ * too, it should be 0 or 1.
+ *
+ * Usage: raceya-mipbench [--repeats n] [directories...]
+ *
+ * GLU needs a GL context, so unlike the other tools this opens a (small) window.
+ */
+#include "../src/mipmap_generator.h"
+#include "../src/texture_cache.h"
+#include "../src/load_timer.h"
+
+#include <vector>
+#include <string>
+#include <iostream>
+#include <stdlib.h>
+#include <string.h>
+#include <GL/gl.h>
+#include <GL/glu.h>
+#include <SDL/SDL.h>
+#include <SDL/SDL_image.h>
+#include <boost/filesystem.hpp>
+#include <boost/ptr_container/ptr_vector.hpp>
+#include <boost/algorithm/string.hpp>
+#include <boost/foreach.hpp>
+
+using namespace std;
+namespace fs = boost::filesystem;
+
+// A decoded texture, as Texture::_buildLevels leaves it before the mipmaps
+static void makeLevels(SDL_Surface * surface, TextureLevels & levels) {
+    levels.format = surface->format->Rmask == 0x000000ff ? GL_RGBA : GL_BGRA;
+    levels.nLevels = 1;
+    levels.widths[0] = surface->w;
+    levels.heights[0] = surface->h;
+    levels.sizes[0] = surface->w * surface->h * 4;
+    levels.offsets[0] = 0;
+    levels.buffer.resize(levels.sizes[0]);
+
+    SDL_LockSurface(surface);
+    for (int y = 0; y < surface->h; ++y) {
+        memcpy(&levels.buffer[y * surface->w * 4],
+                (unsigned char *)surface->pixels + y * surface->pitch, surface->w * 4);
+    }
+    SDL_UnlockSurface(surface);
+}
+
+static SDL_Surface * loadSurface(const fs::path & path) {
+    SDL_Surface * surface = IMG_Load(path.string().c_str());
+    if (surface == NULL) return NULL;
+
+    SDL_SetColorKey(surface, SDL_SRCCOLORKEY, SDL_MapRGB(surface->format, 255, 0, 255));
+    SDL_Surface * alphaSurface = SDL_DisplayFormatAlpha(surface);
+    SDL_FreeSurface(surface);
+
+    if (alphaSurface != NULL && ((alphaSurface->w & (alphaSurface->w - 1)) != 0
+                || (alphaSurface->h & (alphaSurface->h - 1)) != 0)) {
+        SDL_FreeSurface(alphaSurface);
+        return NULL;
+    }
+    return alphaSurface;
+}
+
+int main(int argc, char ** argv) {
+    int repeats = 5;
+    vector<string> roots;
+
+    for (int i = 1; i < argc; ++i) {
+        string argument(argv[i]);
+        if (argument == "--repeats" && i + 1 < argc) {
+            repeats = max(atoi(argv[++i]), 1);
+        } else {
+            roots.push_back(argument);
+        }
+    }
+    if (roots.empty()) {
+        roots.push_back("resources/tracks");
+        roots.push_back("resources/cars");
+    }
+
+    if (SDL_Init(SDL_INIT_VIDEO) < 0 || SDL_SetVideoMode(16, 16, 32, SDL_OPENGL) == NULL) {
+        cout << "Unable to init SDL: " << SDL_GetError() << endl;
+        return 1;
+    }
+
+    vector<SDL_Surface *> surfaces;
+    long bytes = 0;
+    BOOST_FOREACH(string & root, roots) {
+        if (!fs::exists(root)) {
+            cout << "Warning: " << root << " doesn't exist" << endl;
+            continue;
+        }
+        for (fs::recursive_directory_iterator it(root), end; it != end; ++it) {
+            if (!fs::is_regular_file(it->path())) continue;
+
+            string extension = boost::to_lower_copy(it->path().extension().string());
+            if (extension != ".bmp" && extension != ".tga" && extension != ".png"
+                    && extension != ".jpg") {
+                continue;
+            }
+            SDL_Surface * surface = loadSurface(it->path());
+            if (surface == NULL) continue;
+            surfaces.push_back(surface);
+            bytes += surface->w * surface->h * 4;
+        }
+    }
+    cout << surfaces.size() << " textures, " << bytes / 1024 << "KB decoded" << endl;
+
+    boost::ptr_vector<TextureLevels> levels;
+    BOOST_FOREACH(SDL_Surface * surface, surfaces) {
+        levels.push_back(new TextureLevels());
+        makeLevels(surface, levels.back());
+    }
+
+    double best[4] = { 1e30, 1e30, 1e30, 1e30 };
+    int difference = 0;
+    GLuint texture;
+    glGenTextures(1, &texture);
+    glBindTexture(GL_TEXTURE_2D, texture);
+
+    for (int repeat = 0; repeat < repeats; ++repeat) {
+        double start = LoadTimer::now();
+        for (size_t i = 0; i < surfaces.size(); ++i) {
+            gluBuild2DMipmaps(GL_TEXTURE_2D, 4, levels[i].widths[0], levels[i].heights[0],
+                    levels[i].format, GL_UNSIGNED_BYTE, levels[i].getLevel(0));
+        }
+        glFinish();
+        best[0] = min(best[0], LoadTimer::now() - start);
+
+        MipmapGenerator::gammaCorrect = true;
+        start = LoadTimer::now();
+        for (size_t i = 0; i < levels.size(); ++i) MipmapGenerator::build(levels[i]);
+        best[2] = min(best[2], LoadTimer::now() - start);
+
+        MipmapGenerator::gammaCorrect = false;
+        start = LoadTimer::now();
+        for (size_t i = 0; i < levels.size(); ++i) MipmapGenerator::build(levels[i]);
+        best[1] = min(best[1], LoadTimer::now() - start);
+
+        start = LoadTimer::now();
+        for (size_t i = 0; i < levels.size(); ++i) {
+            for (int j = 0; j < levels[i].nLevels; ++j) {
+                glTexImage2D(GL_TEXTURE_2D, j, GL_RGBA8, levels[i].widths[j],
+                        levels[i].heights[j], 0, levels[i].format, GL_UNSIGNED_BYTE,
+                        levels[i].getLevel(j));
+            }
+        }
+        glFinish();
+        best[3] = min(best[3], LoadTimer::now() - start);
+    }
+
+    // Compare the second levels, GLU's are read back from the texture
+    for (size_t i = 0; i < levels.size(); ++i) {
+        if (levels[i].nLevels < 2) continue;
+        gluBuild2DMipmaps(GL_TEXTURE_2D, 4, levels[i].widths[0], levels[i].heights[0],
+                levels[i].format, GL_UNSIGNED_BYTE, levels[i].getLevel(0));
+        vector<unsigned char> glu(levels[i].sizes[1]);
+        glGetTexImage(GL_TEXTURE_2D, 1, levels[i].format, GL_UNSIGNED_BYTE, &glu[0]);
+        const unsigned char * ours = levels[i].getLevel(1);
+        for (int j = 0; j < levels[i].sizes[1]; ++j) {
+            difference = max(difference, abs(glu[j] - ours[j]));
+        }
+    }
+    glDeleteTextures(1, &texture);
+
+    const char * names[4] = { "glu", "build", "gamma", "upload" };
+    for (int i = 0; i < 4; ++i) {
+        cout << names[i] << ": " << best[i] << "ms" << endl;
+    }
+    cout << "build + upload: " << best[1] + best[3] << "ms, "
+        << best[0] / max(best[1] + best[3], 0.001) << "x glu" << endl;
+    cout << "largest difference from glu: " << difference << endl;
+
+    BOOST_FOREACH(SDL_Surface * surface, surfaces) SDL_FreeSurface(surface);
+    SDL_Quit();
+    return 0;
+}
@@ -0,0 +1,289 @@
+/**
+ * Works out the potentially visible sets for a track and saves them next to its
+ * geometry.ini, for the game to use with --visibility-sets.
+ *
+ * The drivable surfaces (the dofs flagged DOF_SURFACE or DOF_COLLISION) are cut into
+ * a grid of sectors. From points on the surface in each sector the whole way round is
+ * drawn with the OcclusionCuller, a cube of six views at a couple of heights, and
+ * every geob that's in range and not hidden is marked visible from the sector. Each
+ * sector then takes in what its neighbours can see, so the camera can move around a
+ * bit without anything popping in.
+ *
+ * Usage: raceya-pvsgen [--spacing m] [--samples n] [--output file] [track directory]
+ *
+ * The track directory is resources/tracks/Monaco_AM by default.
+ */
+#include "../src/dof.h"
+#include "../src/track.h"
+#include "../src/frustum_culler.h"
+#include "../src/occlusion_culler.h"
+#include "../src/shader.h"
+#include "../src/visibility_sets.h"
+#include "../src/texture.h"
+#include "../src/load_timer.h"
+#include "../src/logger.h"
+
+#include <map>
+#include <vector>
+#include <string>
+#include <iostream>
+#include <stdlib.h>
+#include <math.h>
+#include <SDL/SDL.h>
+#include <boost/filesystem.hpp>
+#include <boost/ptr_container/ptr_vector.hpp>
+#include <boost/foreach.hpp>
+
+using namespace std;
+namespace fs = boost::filesystem;
+
+// Range of the views, a bit further than the game's far plane in main.cpp
+#define PVS_NEAR 0.5
+#define PVS_FAR 200.0
+
+// Heights above the surface to look from, the car's camera is somewhere in between
+static const float heights[] = { 1.5, 5 };
+
+// Where each face of the cube looks, and which way is up
+static const float faces[6][6] = {
+    { 1, 0, 0, 0, 1, 0 },
+    { -1, 0, 0, 0, 1, 0 },
+    { 0, 0, 1, 0, 1, 0 },
+    { 0, 0, -1, 0, 1, 0 },
+    { 0, 1, 0, 0, 0, -1 },
+    { 0, -1, 0, 0, 0, 1 }
+};
+
+// A square glFrustum with a 90 degree field of view
+static void makeProjection(float * matrix) {
+    for (int i = 0; i < 16; ++i) matrix[i] = 0;
+    matrix[0] = 1;
+    matrix[5] = 1;
+    matrix[10] = -(PVS_FAR + PVS_NEAR) / (PVS_FAR - PVS_NEAR);
+    matrix[11] = -1;
+    matrix[14] = -2 * PVS_FAR * PVS_NEAR / (PVS_FAR - PVS_NEAR);
+}
+
+// Like gluLookAt from position along one face of the cube
+static void makeView(float * matrix, const float * position, const float * face) {
+    const float * forward = face;
+    const float * up = face + 3;
+    float side[3] = {
+        forward[1] * up[2] - forward[2] * up[1],
+        forward[2] * up[0] - forward[0] * up[2],
+        forward[0] * up[1] - forward[1] * up[0] };
+
+    for (int i = 0; i < 16; ++i) matrix[i] = 0;
+    for (int i = 0; i < 3; ++i) {
+        matrix[i * 4] = side[i];
+        matrix[i * 4 + 1] = up[i];
+        matrix[i * 4 + 2] = -forward[i];
+    }
+    matrix[15] = 1;
+    for (int i = 0; i < 3; ++i) {
+        matrix[12] -= side[i] * position[i];
+        matrix[13] -= up[i] * position[i];
+        matrix[14] += forward[i] * position[i];
+    }
+}
+
+// A geob as the sets name it
+class Target {
+    public:
+        string dofFile;
+        int index;
+        float * boundingBox;
+};
+
+int main(int argc, char ** argv) {
+    float spacing = 20;
+    int nSamples = 8;
+    string trackPath = "resources/tracks/Monaco_AM";
+    string output;
+
+    for (int i = 1; i < argc; ++i) {
+        string argument(argv[i]);
+        if (argument == "--spacing" && i + 1 < argc) {
+            spacing = atof(argv[++i]);
+        } else if (argument == "--samples" && i + 1 < argc) {
+            nSamples = atoi(argv[++i]);
+        } else if (argument == "--output" && i + 1 < argc) {
+            output = argv[++i];
+        } else {
+            trackPath = argument;
+        }
+    }
+    if (output.empty()) output = (fs::path(trackPath) / VisibilitySets::fileName).string();
+    if (spacing <= 0 || nSamples <= 0) {
+        cout << "The spacing and samples have to be more than 0" << endl;
+        return 1;
+    }
+
+    map<string, string> dofFiles;
+    map<string, int> flags;
+    if (!Track::readGeometryIni(trackPath, dofFiles, flags)) {
+        cout << "Couldn't read the geometry.ini in " << trackPath << endl;
+        return 1;
+    }
+
+    // The materials load their textures, and SDL needs a video mode to convert them
+    setenv("SDL_VIDEODRIVER", "dummy", 1);
+    if (SDL_Init(SDL_INIT_VIDEO) < 0 || SDL_SetVideoMode(16, 16, 32, SDL_SWSURFACE) == NULL) {
+        cout << "Unable to init SDL: " << SDL_GetError() << endl;
+        return 1;
+    }
+    Texture::deferUploads = true;
+
+    // The sky and anything alpha tested is found from the shaders
+    Shader::parseShaderFile((fs::path(trackPath) / "track.shd").string());
+    Texture::discardPending();
+
+    // Everything solid hides things, not just the big occluders the game uses. The
+    // ground does too, for what's over the top of a hill
+    double start = LoadTimer::now();
+    boost::ptr_vector<Dof> dofs;
+    vector<Target> targets;
+    OcclusionCuller occlusionCuller;
+    // Points on the surfaces, by sector in the grid
+    map<pair<int, int>, vector<float> > cells;
+    for (map<string, string>::iterator it = dofFiles.begin(); it != dofFiles.end(); ++it) {
+        int dofFlags = flags.count(it->first) > 0 ? flags[it->first] : 0;
+        Dof * dof = new Dof(it->second, dofFlags, true, true);
+        Texture::discardPending();
+        Logger::maintain();
+        if (!dof->isValid) {
+            delete dof;
+            continue;
+        }
+        dofs.push_back(dof);
+
+        string dofFile = fs::path(it->second).filename().string();
+        int index = 0;
+        BOOST_FOREACH(Geob & geob, dof->getGeobs()) {
+            // The sky is drawn whatever the sets say
+            Mat * mat = geob.material < dof->getMats().size() ? &dof->getMats()[geob.material]
+                : NULL;
+            if (mat != NULL && mat->shader != NULL && mat->shader->isSky) {
+                ++index;
+                continue;
+            }
+
+            Target target;
+            target.dofFile = dofFile;
+            target.index = index++;
+            target.boundingBox = geob.boundingBox;
+            targets.push_back(target);
+
+            if (OcclusionCuller::isOccluder(*dof, geob)
+                    || (dof->isSurface() && OcclusionCuller::canOcclude(*dof, geob))) {
+                occlusionCuller.addOccluder(geob);
+            }
+            if (!dof->isSurface()) continue;
+
+            for (int i = 0; i + 2 < geob.nIndices; i += 3) {
+                float centre[3] = { 0, 0, 0 };
+                bool valid = true;
+                for (int k = 0; k < 3; ++k) {
+                    unsigned int vertex = geob.indices[i + k];
+                    if (vertex >= geob.nVertices) {
+                        valid = false;
+                        break;
+                    }
+                    for (int j = 0; j < 3; ++j) {
+                        centre[j] += geob.vertices[vertex][j] / 3;
+                    }
+                }
+                if (!valid) continue;
+
+                vector<float> & points = cells[make_pair(
+                        (int)floor(centre[0] / spacing), (int)floor(centre[2] / spacing))];
+                points.insert(points.end(), centre, centre + 3);
+            }
+        }
+    }
+    cout << targets.size() << " geobs from " << dofs.size() << " dofs, "
+        << occlusionCuller.getNOccluders() << " occluders, " << cells.size()
+        << " sectors, loaded in " << (LoadTimer::now() - start) / 1000 << "s" << endl;
+    if (cells.empty()) {
+        cout << "No surfaces found" << endl;
+        return 1;
+    }
+
+    float projection[16];
+    makeProjection(projection);
+    ViewFrustumCulling culler;
+    VisibilitySets sets;
+    map<pair<int, int>, int> sectors;
+    long nVisible = 0;
+    start = LoadTimer::now();
+    for (map<pair<int, int>, vector<float> >::iterator it = cells.begin();
+            it != cells.end(); ++it) {
+        // The sector goes at the middle of its points
+        vector<float> & points = it->second;
+        int nPoints = points.size() / 3;
+        float position[3] = { 0, 0, 0 };
+        for (int i = 0; i < nPoints; ++i) {
+            for (int j = 0; j < 3; ++j) {
+                position[j] += points[i * 3 + j] / nPoints;
+            }
+        }
+        int sector = sets.addSector(position);
+        sectors[it->first] = sector;
+
+        // Look from points spread through the sector
+        int step = max(1, nPoints / nSamples);
+        for (int i = 0; i < nPoints; i += step) {
+            BOOST_FOREACH(float height, heights) {
+                float eye[3] = { points[i * 3], points[i * 3 + 1] + height, points[i * 3 + 2] };
+                for (int face = 0; face < 6; ++face) {
+                    float modelView[16];
+                    makeView(modelView, eye, faces[face]);
+                    culler.setMatrices(modelView, projection);
+                    occlusionCuller.render(culler);
+
+                    BOOST_FOREACH(Target & target, targets) {
+                        int planes = FRUSTUM_ALL_PLANES;
+                        if (culler.testBox(target.boundingBox, planes) == FRUSTUM_OUTSIDE)
+                            continue;
+                        if (!occlusionCuller.testBox(target.boundingBox)) continue;
+                        sets.addVisible(sector, target.dofFile, target.index);
+                    }
+                }
+            }
+        }
+    }
+
+    // Take in the neighbours, from a copy so it doesn't spread any further
+    VisibilitySets own = sets;
+    for (map<pair<int, int>, int>::iterator it = sectors.begin(); it != sectors.end();
+            ++it) {
+        for (int x = -1; x <= 1; ++x) {
+            for (int z = -1; z <= 1; ++z) {
+                if (x == 0 && z == 0) continue;
+                map<pair<int, int>, int>::iterator neighbour = sectors.find(
+                        make_pair(it->first.first + x, it->first.second + z));
+                if (neighbour == sectors.end()) continue;
+                sets.merge(it->second, own, neighbour->second);
+            }
+        }
+
+        map<string, set<int> > & visible = sets.getVisible(it->second);
+        for (map<string, set<int> >::iterator dof = visible.begin(); dof != visible.end();
+                ++dof) {
+            nVisible += dof->second.size();
+        }
+    }
+
+    cout << "Worked out in " << (LoadTimer::now() - start) / 1000 << "s, "
+        << (float)nVisible / sectors.size() << " of " << targets.size()
+        << " geobs visible per sector" << endl;
+
+    if (!sets.save(output)) {
+        cout << "Couldn't write " << output << endl;
+        return 1;
+    }
+    cout << "Saved " << output << endl;
+
+    SDL_Quit();
+    return 0;
+}